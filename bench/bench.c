@@ -0,0 +1,1099 @@
+/**
+ * bench.c
+ *
+ * Measures embed on synthetic sets of files: how fast it generates each
+ * output format, how large the output is, how long the output takes to
+ * compile and how much memory both take, and how long each lookup strategy
+ * takes to find a file. Results are written as JSON.
+ *
+ * With --fuzz it instead generates random sets of names, checks that every
+ * lookup strategy finds each name and misses everything else, and reports
+ * the latency percentiles of hits and misses. With --cxx each set is also
+ * linked into a C++ program using the header's C++ wrappers.
+ *
+ * Usage: embed-bench [--quick] [--fuzz] [--seed <n>] [--cxx <compiler>]
+ *            [--output <file>] <embed> -- <compiler...>
+ *
+ * Copyright 2021 Doug Johnson
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ * this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ * this list of conditions and the following disclaimer in the documentation
+ * and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ * contributors may be used to endorse or promote products derived from this
+ * software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+// Processes are timed and measured with wait4, so this only runs on POSIX
+// systems
+#define _DEFAULT_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+// Lookups timed for each strategy, spread over all the names
+#define LOOKUP_COUNT 4000000
+
+// A set of files generated to run embed on
+struct corpus {
+  const char* name;
+  size_t file_count;
+  // Files are sized between these, spread evenly on a log scale
+  size_t min_size;
+  size_t max_size;
+};
+
+static const struct corpus corpora[] = {
+  { "tiny", 2000, 16, 256 },
+  { "huge", 2, 8 << 20, 8 << 20 },
+  { "mixed", 300, 64, 256 << 10 },
+};
+
+static const char* formats[] = { "hex", "decimal", "string", "u64" };
+
+static const char* lookups[] = { "linear", "sorted", "hash" };
+
+// Numbers of files the lookups are timed with, the first files of the tiny
+// corpus
+static const size_t lookup_file_counts[] = { 16, 2000 };
+
+// Loops over the names in a shuffled order, so the branch predictor can not
+// learn the sequence
+static const char* lookup_source
+    = "#define _POSIX_C_SOURCE 200809L\n"
+      "#include <stdio.h>\n"
+      "#include <stdlib.h>\n"
+      "#include <string.h>\n"
+      "#include <time.h>\n"
+      "#include \"lookup.h\"\n"
+      "\n"
+      "int main(int argc, char** argv) {\n"
+      "  size_t count = bench_get_count();\n"
+      "  size_t lookups = (size_t)strtoull(argv[argc - 1], NULL, 10);\n"
+      "  char** names = malloc(sizeof(char*) * count);\n"
+      "  for (size_t i = 0; i < count; i++) {\n"
+      "    const char* name = bench_get_name_at(i);\n"
+      "    names[i] = malloc(strlen(name) + 1);\n"
+      "    strcpy(names[i], name);\n"
+      "  }\n"
+      "  unsigned long long state = 88172645463325252ULL;\n"
+      "  for (size_t i = count; i > 1; i--) {\n"
+      "    state ^= state << 13;\n"
+      "    state ^= state >> 7;\n"
+      "    state ^= state << 17;\n"
+      "    size_t j = state % i;\n"
+      "    char* name = names[i - 1];\n"
+      "    names[i - 1] = names[j];\n"
+      "    names[j] = name;\n"
+      "  }\n"
+      "  size_t found = 0;\n"
+      "  struct timespec start, end;\n"
+      "  clock_gettime(CLOCK_MONOTONIC, &start);\n"
+      "  for (size_t i = 0; i < lookups; i++) {\n"
+      "    size_t length;\n"
+      "    found += bench_get(names[i % count], &length) != NULL;\n"
+      "  }\n"
+      "  clock_gettime(CLOCK_MONOTONIC, &end);\n"
+      "  double ns = (end.tv_sec - start.tv_sec) * 1e9\n"
+      "      + (end.tv_nsec - start.tv_nsec);\n"
+      "  if (found != lookups) {\n"
+      "    fprintf(stderr, \"Lookups failed\\n\");\n"
+      "    return 1;\n"
+      "  }\n"
+      "  printf(\"%f\\n\", ns / lookups);\n"
+      "  return 0;\n"
+      "}\n";
+
+// Numbers of files the lookups are checked with by --fuzz, with --quick and
+// without. The empty set only has misses.
+static const size_t fuzz_quick_counts[] = { 0, 1, 300, 5000 };
+static const size_t fuzz_counts[] = { 0, 1, 2000, 40000 };
+
+// Lookups timed for each kind of name by --fuzz, fewer for the linear lookup
+// of many files so a run takes about the same time for any count
+#define FUZZ_SAMPLES 200000
+#define FUZZ_LINEAR_BUDGET 200000000
+
+// Reads cases of a hit or a miss, a path and a name separated by tabs, and
+// checks every one with each lookup function, the prehashed one when built
+// with FUZZ_HASHED for --lookup hash, before timing them one at a time. Prints the 50th and 99th percentile of hits and misses, or the
+// lookups that failed, on stdout as stderr is not kept.
+static const char* fuzz_source
+    = "#define _POSIX_C_SOURCE 200809L\n"
+      "#include <stdint.h>\n"
+      "#include <stdio.h>\n"
+      "#include <stdlib.h>\n"
+      "#include <string.h>\n"
+      "#include <time.h>\n"
+      "#include \"fuzz.h\"\n"
+      "\n"
+      "static char* read_all(const char* path, size_t* size) {\n"
+      "  FILE* fd = fopen(path, \"rb\");\n"
+      "  if (!fd) {\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  fseek(fd, 0, SEEK_END);\n"
+      "  long length = ftell(fd);\n"
+      "  fseek(fd, 0, SEEK_SET);\n"
+      "  char* data = malloc(length + 1);\n"
+      "  *size = fread(data, 1, length, fd);\n"
+      "  fclose(fd);\n"
+      "  return data;\n"
+      "}\n"
+      "\n"
+      "static double now_ns(void) {\n"
+      "  struct timespec time;\n"
+      "  clock_gettime(CLOCK_MONOTONIC, &time);\n"
+      "  return time.tv_sec * 1e9 + time.tv_nsec;\n"
+      "}\n"
+      "\n"
+      "static int compare_double(const void* a, const void* b) {\n"
+      "  double x = *(const double*)a;\n"
+      "  double y = *(const double*)b;\n"
+      "  return x < y ? -1 : x > y;\n"
+      "}\n"
+      "\n"
+      "static unsigned long long state = 88172645463325252ULL;\n"
+      "static size_t next_index(size_t count) {\n"
+      "  state ^= state << 13;\n"
+      "  state ^= state >> 7;\n"
+      "  state ^= state << 17;\n"
+      "  return state % count;\n"
+      "}\n"
+      "\n"
+      "// Times lookups of the names in a shuffled order one at a time, less\n"
+      "// the time of reading the clock\n"
+      "static void percentiles(char** names, size_t count, size_t samples,\n"
+      "    double overhead, double* p50, double* p99) {\n"
+      "  *p50 = 0;\n"
+      "  *p99 = 0;\n"
+      "  if (!count) {\n"
+      "    return;\n"
+      "  }\n"
+      "  for (size_t i = count; i > 1; i--) {\n"
+      "    size_t j = next_index(i);\n"
+      "    char* name = names[i - 1];\n"
+      "    names[i - 1] = names[j];\n"
+      "    names[j] = name;\n"
+      "  }\n"
+      "  double* times = malloc(sizeof(double) * samples);\n"
+      "  uintptr_t sink = 0;\n"
+      "  for (size_t i = 0; i < samples; i++) {\n"
+      "    size_t length;\n"
+      "    double start = now_ns();\n"
+      "    sink += (uintptr_t)fuzz_get(names[i % count], &length);\n"
+      "    times[i] = now_ns() - start - overhead;\n"
+      "  }\n"
+      "  qsort(times, samples, sizeof(double), compare_double);\n"
+      "  *p50 = times[samples / 2] > 0 ? times[samples / 2] : 0;\n"
+      "  *p99 = times[samples * 99 / 100] > 0 ? times[samples * 99 / 100] "
+      ": 0;\n"
+      "  free(times);\n"
+      "  if (sink == 1) {\n"
+      "    printf(\"\\n\");\n"
+      "  }\n"
+      "}\n"
+      "\n"
+      "int main(int argc, char** argv) {\n"
+      "  size_t samples = (size_t)strtoull(argv[argc - 1], NULL, 10);\n"
+      "  size_t size;\n"
+      "  char* cases = read_all(argv[1], &size);\n"
+      "  if (!cases) {\n"
+      "    fprintf(stderr, \"Could not read the cases\\n\");\n"
+      "    return 1;\n"
+      "  }\n"
+      "  cases[size] = '\\0';\n"
+      "  char** hits = malloc(sizeof(char*) * (size + 1));\n"
+      "  char** misses = malloc(sizeof(char*) * (size + 1));\n"
+      "  size_t hit_count = 0;\n"
+      "  size_t miss_count = 0;\n"
+      "  size_t errors = 0;\n"
+      "  for (char* line = cases; *line;) {\n"
+      "    char* end = strchr(line, '\\n');\n"
+      "    *end = '\\0';\n"
+      "    char* path = strchr(line, '\\t') + 1;\n"
+      "    char* name = strchr(path, '\\t') + 1;\n"
+      "    name[-1] = '\\0';\n"
+      "    size_t name_length = strlen(name);\n"
+      "    // The name copied without a terminator for the _n lookup\n"
+      "    char* unterminated = malloc(name_length + 1);\n"
+      "    memcpy(unterminated, name, name_length);\n"
+      "    unterminated[name_length] = 'x';\n"
+      "    size_t length = 0;\n"
+      "    size_t length_n = 0;\n"
+      "    const char* data = fuzz_get(name, &length);\n"
+      "    const char* data_n = fuzz_get_n(unterminated, name_length, "
+      "&length_n);\n"
+      "    // Lookups other than the hash have no hashed function to check\n"
+      "    size_t length_h = length_n;\n"
+      "    const char* data_h = data_n;\n"
+      "#ifdef FUZZ_HASHED\n"
+      "    data_h = fuzz_get_hashed(fuzz_get_hash(unterminated, "
+      "name_length),\n"
+      "        unterminated, name_length, &length_h);\n"
+      "#endif\n"
+      "    free(unterminated);\n"
+      "    const char* problem = NULL;\n"
+      "    if (line[0] == 'M') {\n"
+      "      misses[miss_count++] = name;\n"
+      "      problem = data || data_n || data_h ? \"found a missing name\"\n"
+      "                                         : NULL;\n"
+      "    } else {\n"
+      "      hits[hit_count++] = name;\n"
+      "      size_t expected_size = 0;\n"
+      "      char* expected = read_all(path, &expected_size);\n"
+      "      if (!data || !data_n || !data_h) {\n"
+      "        problem = \"did not find the name\";\n"
+      "      } else if (data != data_n || length != length_n) {\n"
+      "        problem = \"found different data with the length\";\n"
+      "      } else if (data != data_h || length != length_h) {\n"
+      "        problem = \"found different data with the hash\";\n"
+      "      } else if (!expected || length != expected_size\n"
+      "          || 0 != memcmp(data, expected, length) || data[length]) {\n"
+      "        problem = \"found the wrong data\";\n"
+      "      }\n"
+      "      free(expected);\n"
+      "    }\n"
+      "    if (problem) {\n"
+      "      if (errors < 10) {\n"
+      "        printf(\"'%s': %s\\n\", name, problem);\n"
+      "      }\n"
+      "      errors++;\n"
+      "    }\n"
+      "    line = end + 1;\n"
+      "  }\n"
+      "  if (errors) {\n"
+      "    printf(\"%zu lookups failed\\n\", errors);\n"
+      "    return 0;\n"
+      "  }\n"
+      "  // The median time of reading the clock twice\n"
+      "  double overhead[1001];\n"
+      "  for (size_t i = 0; i < 1001; i++) {\n"
+      "    double start = now_ns();\n"
+      "    overhead[i] = now_ns() - start;\n"
+      "  }\n"
+      "  qsort(overhead, 1001, sizeof(double), compare_double);\n"
+      "  double hit_p50, hit_p99, miss_p50, miss_p99;\n"
+      "  percentiles(hits, hit_count, samples, overhead[500], &hit_p50, "
+      "&hit_p99);\n"
+      "  percentiles(misses, miss_count, samples, overhead[500], &miss_p50,\n"
+      "      &miss_p99);\n"
+      "  printf(\"%zu %zu %f %f %f %f\\n\", hit_count, miss_count, hit_p50,\n"
+      "      hit_p99, miss_p50, miss_p99);\n"
+      "  return 0;\n"
+      "}\n";
+
+// Links the generated source into a C++ program, so the header has to work
+// for C++ callers, and checks that the views and the index find the same
+// data as the C functions for every name. Prints ok, or the names that failed, on stdout.
+static const char* fuzz_cpp_source
+    = "#include <cstdio>\n"
+      "#include <cstring>\n"
+      "#include \"fuzz.h\"\n"
+      "\n"
+      "int main() {\n"
+      "  size_t errors = 0;\n"
+      "  for (size_t i = 0; i < fuzz_get_count(); i++) {\n"
+      "    const char* name = fuzz_get_name_at(i);\n"
+      "    size_t length = 0;\n"
+      "    const char* data = fuzz_get_n(name, std::strlen(name), &length);\n"
+      "    std::string_view view = fuzz_get(std::string_view(name));\n"
+      "    const char* problem = nullptr;\n"
+      "    if (!data || view.data() != data || view.size() != length) {\n"
+      "      problem = \"the view found different data\";\n"
+      "    }\n"
+      "    // Names given twice find the first file given\n"
+      "    int index = fuzz_get_index(name);\n"
+      "    if (index < 0 || fuzz_get_at(index, &length) != data\n"
+      "        || std::strcmp(fuzz_get_name_at(index), name)) {\n"
+      "      problem = \"the index found a different file\";\n"
+      "    }\n"
+      "#if __cplusplus >= 202002L\n"
+      "    std::span<const std::byte> bytes = fuzz_get_bytes(name);\n"
+      "    if (reinterpret_cast<const char*>(bytes.data()) != data\n"
+      "        || bytes.size() != length) {\n"
+      "      problem = \"the span found different data\";\n"
+      "    }\n"
+      "#endif\n"
+      "    if (problem) {\n"
+      "      if (errors < 10) {\n"
+      "        std::printf(\"'%s': %s\\n\", name, problem);\n"
+      "      }\n"
+      "      errors++;\n"
+      "    }\n"
+      "  }\n"
+      "  if (fuzz_get(std::string_view(\"\\n\")).data()) {\n"
+      "    std::printf(\"the view found a missing name\\n\");\n"
+      "    errors++;\n"
+      "  }\n"
+      "  if (!errors) {\n"
+      "    std::printf(\"ok\\n\");\n"
+      "  }\n"
+      "  return 0;\n"
+      "}\n";
+
+// Time and peak memory of a finished process
+struct run_result {
+  double seconds;
+  long peak_rss_kb;
+};
+
+static double now(void)
+{
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// Runs a command to completion, with its output sent to `output` unless it
+// is NULL, and exits if it fails
+// Scratch directory everything runs in and where the run started, so the
+// directory is removed however the run ends, failures included
+static char* scratch_directory;
+static char* scratch_start;
+
+static void remove_scratch_directory(void)
+{
+  if (!scratch_directory || chdir(scratch_start) != 0) {
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    execlp("rm", "rm", "-rf", scratch_directory, (char*)NULL);
+    _exit(127);
+  }
+  if (pid > 0) {
+    waitpid(pid, NULL, 0);
+  }
+}
+
+static struct run_result run(char* const* command, const char* output)
+{
+  struct run_result result;
+  double start = now();
+  pid_t pid = fork();
+  if (pid < 0) {
+    fprintf(stderr, "Could not start '%s'\n", command[0]);
+    exit(1);
+  }
+  if (pid == 0) {
+    if (output && !freopen(output, "w", stdout)) {
+      _exit(127);
+    }
+    // embed explains a missing header on every run
+    if (!freopen("/dev/null", "w", stderr)) {
+      _exit(127);
+    }
+    execvp(command[0], command);
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status)
+      || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Command failed:");
+    for (size_t i = 0; command[i]; i++) {
+      fprintf(stderr, " %s", command[i]);
+    }
+    fprintf(stderr, "\n");
+    exit(1);
+  }
+  result.seconds = now() - start;
+  // Linux and the BSDs report kilobytes, macOS bytes
+#ifdef __APPLE__
+  result.peak_rss_kb = usage.ru_maxrss / 1024;
+#else
+  result.peak_rss_kb = usage.ru_maxrss;
+#endif
+  return result;
+}
+
+static char* format_string(const char* format, const char* a, const char* b)
+{
+  size_t length = strlen(format) + strlen(a) + strlen(b) + 1;
+  char* text = malloc(length);
+  if (!text) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  snprintf(text, length, format, a, b);
+  return text;
+}
+
+static size_t file_size(const char* path)
+{
+  struct stat info;
+  if (stat(path, &info) != 0) {
+    fprintf(stderr, "Could not find '%s'\n", path);
+    exit(1);
+  }
+  return (size_t)info.st_size;
+}
+
+static uint64_t next_random(uint64_t* state)
+{
+  *state ^= *state << 13;
+  *state ^= *state >> 7;
+  *state ^= *state << 17;
+  return *state;
+}
+
+// Writes `size` bytes of runs of words mixed with runs of random bytes, so
+// encodings that escape or compress see both
+static void write_contents(const char* path, size_t size, uint64_t* state)
+{
+  static const char* words[] = { "vertex", "shader", " ", "uniform", "{",
+    "}", "\n", "float", "texture", "0.5", ";", "return", "\"name\"" };
+  FILE* fd = fopen(path, "wb");
+  if (!fd) {
+    fprintf(stderr, "Could not write '%s'\n", path);
+    exit(1);
+  }
+  size_t written = 0;
+  while (written < size) {
+    uint64_t choice = next_random(state);
+    size_t run = 16 + choice % 240;
+    if (run > size - written) {
+      run = size - written;
+    }
+    for (size_t i = 0; i < run;) {
+      if (choice & 1) {
+        fputc((int)(next_random(state) & 0xff), fd);
+        i++;
+        continue;
+      }
+      const char* word
+          = words[next_random(state) % (sizeof(words) / sizeof(words[0]))];
+      for (; *word && i < run; word++, i++) {
+        fputc(*word, fd);
+      }
+    }
+    written += run;
+  }
+  fclose(fd);
+}
+
+// Writes the corpus's files into `directory`, returning their total size
+static size_t write_corpus(const struct corpus* corpus, const char* directory,
+    size_t divisor)
+{
+  uint64_t state = 0x9E3779B97F4A7C15ULL;
+  size_t total = 0;
+  size_t min_size = corpus->min_size / divisor ? corpus->min_size / divisor
+                                               : 1;
+  size_t max_size = corpus->max_size / divisor ? corpus->max_size / divisor
+                                               : 1;
+  mkdir(directory, 0755);
+  for (size_t i = 0; i < corpus->file_count; i++) {
+    double step = corpus->file_count > 1
+        ? (double)i / (double)(corpus->file_count - 1)
+        : 0;
+    size_t size = (size_t)((double)min_size
+        * pow((double)max_size / (double)min_size, step));
+    char name[64];
+    snprintf(name, sizeof(name), "file_%zu.bin", i);
+    char* path = format_string("%s/%s", directory, name);
+    write_contents(path, size, &state);
+    free(path);
+    total += size;
+  }
+  return total;
+}
+
+// Command running embed on every file of a corpus
+static char** embed_command(const char* embed, const char* corpus_directory,
+    size_t file_count, char* const* options)
+{
+  size_t option_count = 0;
+  while (options[option_count]) {
+    option_count++;
+  }
+  char** command = calloc(file_count + option_count + 2, sizeof(char*));
+  if (!command) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  command[0] = (char*)embed;
+  memcpy(command + 1, options, sizeof(char*) * option_count);
+  for (size_t i = 0; i < file_count; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "file_%zu.bin", i);
+    command[1 + option_count + i]
+        = format_string("%s/%s", corpus_directory, name);
+  }
+  return command;
+}
+
+static void free_embed_command(char** command, size_t option_count)
+{
+  for (size_t i = 1 + option_count; command[i]; i++) {
+    free(command[i]);
+  }
+  free(command);
+}
+
+// Compiler command with the given arguments appended
+static char** compiler_command(char* const* compiler, char* const* arguments)
+{
+  size_t compiler_count = 0;
+  size_t argument_count = 0;
+  while (compiler[compiler_count]) {
+    compiler_count++;
+  }
+  while (arguments[argument_count]) {
+    argument_count++;
+  }
+  char** command = calloc(compiler_count + argument_count + 1, sizeof(char*));
+  if (!command) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  memcpy(command, compiler, sizeof(char*) * compiler_count);
+  memcpy(command + compiler_count, arguments,
+      sizeof(char*) * argument_count);
+  return command;
+}
+
+// Directories names are placed in, where the same plain name in several of
+// them collides unless paths are preserved. They end in + so no file name
+// is also a directory name.
+static const char* fuzz_directories[] = { "", "assets+/",
+  "assets+/textures+/", "assets+/textures+/level_01+/", "a b+/",
+  "odd\\dir+/", "x+/y+/z+/", "shared+/" };
+
+// Characters of names, anything embed would take as a pattern, an option or
+// a separator left out
+static const char fuzz_characters[]
+    = "abcdefghijklmnopqrstuvwxyzABCXYZ0123456789_-. \\\"'";
+
+// Appends `length` random name characters, starting with a letter or digit
+// so no name is . or .. or starts like an option
+static void random_characters(char* name, size_t length, uint64_t* state)
+{
+  size_t end = strlen(name);
+  for (size_t i = 0; i < length; i++) {
+    size_t choices = i == 0 ? 42 : sizeof(fuzz_characters) - 1;
+    name[end + i] = fuzz_characters[next_random(state) % choices];
+  }
+  name[end + length] = '\0';
+}
+
+// A file of a fuzzed set, at `path` below set/ and found by `name`
+struct fuzz_file {
+  char* path;
+  const char* name;
+  size_t index;
+};
+
+static int compare_fuzz_files(const void* a, const void* b)
+{
+  const struct fuzz_file* left = a;
+  const struct fuzz_file* right = b;
+  int order = strcmp(left->name, right->name);
+  if (order != 0) {
+    return order;
+  }
+  return left->index < right->index ? -1 : left->index > right->index;
+}
+
+static int compare_names(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, ((const struct fuzz_file*)b)->name);
+}
+
+// Makes `count` files with random names and contents: names sharing long
+// prefixes, short and long names, names repeated in other directories and
+// names one character away from others. An eighth of the files are empty.
+static struct fuzz_file* write_fuzz_set(size_t count, uint64_t* state)
+{
+  struct fuzz_file* files = calloc(count + 1, sizeof(*files));
+  if (!files) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  char base[256];
+  for (size_t i = 0; i < count; i++) {
+    base[0] = '\0';
+    switch (next_random(state) % 6) {
+    case 0:
+      snprintf(base, sizeof(base),
+          "texture_atlas_prefix_shared_by_many_names_%zu.png", i);
+      break;
+    case 1:
+      random_characters(base, 1 + next_random(state) % 3, state);
+      break;
+    case 2:
+      random_characters(base, 100 + next_random(state) % 100, state);
+      break;
+    case 3:
+    case 4:
+      if (i > 0) {
+        // The plain name of an earlier file, as it is or with one character
+        // changed or added
+        const char* other = files[next_random(state) % i].path;
+        const char* slash = strrchr(other, '/');
+        snprintf(base, sizeof(base), "%s", slash + 1);
+        size_t length = strlen(base);
+        if (next_random(state) % 3 == 0 && length + 1 < sizeof(base)) {
+          random_characters(base, 1, state);
+        } else if (next_random(state) % 2 == 0 && length > 1) {
+          base[1 + next_random(state) % (length - 1)] = '_';
+        }
+        break;
+      }
+      // Fall through
+    default:
+      random_characters(base, 5 + next_random(state) % 25, state);
+      break;
+    }
+    const char* directory = fuzz_directories[next_random(state)
+        % (sizeof(fuzz_directories) / sizeof(fuzz_directories[0]))];
+    char* path = format_string("set/%s%s", directory, base);
+    for (char* slash = strchr(path, '/'); slash;
+         slash = strchr(slash + 1, '/')) {
+      *slash = '\0';
+      mkdir(path, 0755);
+      *slash = '/';
+    }
+    FILE* fd = fopen(path, "wb");
+    if (!fd) {
+      fprintf(stderr, "Could not write '%s'\n", path);
+      exit(1);
+    }
+    size_t size = next_random(state) % 8 == 0 ? 0 : next_random(state) % 64;
+    for (size_t b = 0; b < size; b++) {
+      fputc((int)(next_random(state) & 0xff), fd);
+    }
+    fclose(fd);
+    files[i].path = path;
+    files[i].index = i;
+  }
+  return files;
+}
+
+// Writes the inputs as a response file and the cases the lookups are checked
+// with: every name with the path of the first file it was given for, which
+// is the one found, and a name near each one that is not in the set
+static void write_fuzz_cases(struct fuzz_file* files, size_t count,
+    bool preserve_paths, uint64_t* state)
+{
+  FILE* inputs = fopen("inputs.txt", "w");
+  FILE* cases = fopen("cases.txt", "w");
+  if (!inputs || !cases) {
+    fprintf(stderr, "Could not write the cases\n");
+    exit(1);
+  }
+  struct fuzz_file* sorted = malloc(sizeof(*sorted) * (count + 1));
+  if (!sorted) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < count; i++) {
+    fprintf(inputs, "%s\n", files[i].path);
+    files[i].name
+        = preserve_paths ? files[i].path : strrchr(files[i].path, '/') + 1;
+    sorted[i] = files[i];
+  }
+  qsort(sorted, count, sizeof(*sorted), compare_fuzz_files);
+  char miss[512];
+  for (size_t i = 0; i < count; i++) {
+    if (i > 0 && 0 == strcmp(sorted[i].name, sorted[i - 1].name)) {
+      continue;
+    }
+    fprintf(cases, "H\t%s\t%s\n", sorted[i].path, sorted[i].name);
+    size_t length = strlen(sorted[i].name);
+    snprintf(miss, sizeof(miss), "%s", sorted[i].name);
+    switch (next_random(state) % 4) {
+    case 0:
+      miss[length - 1] = '\0';
+      break;
+    case 1:
+      random_characters(miss, 1, state);
+      break;
+    case 2:
+      miss[next_random(state) % length] ^= 0x20;
+      break;
+    default:
+      snprintf(miss, sizeof(miss), "set/%s", sorted[i].name);
+      break;
+    }
+    char* key = miss;
+    if (!strchr(miss, '\t')
+        && !bsearch(&key, sorted, count, sizeof(*sorted), compare_names)) {
+      fprintf(cases, "M\t\t%s\n", miss);
+    }
+  }
+  // The empty name, and a plain name so the empty set has one of each
+  fprintf(cases, "M\t\t\n");
+  const char* key = "missing";
+  if (!bsearch(&key, sorted, count, sizeof(*sorted), compare_names)) {
+    fprintf(cases, "M\t\t%s\n", key);
+  }
+  free(sorted);
+  fclose(inputs);
+  fclose(cases);
+}
+
+// Links the generated fuzz.c into the C++ program and runs it, returning
+// whether it printed ok. What it printed otherwise is left in fuzz_cpp.txt.
+static bool check_cpp(char* const* compiler, const char* cxx)
+{
+  char* compile_arguments[] = { "-c", "-O2", "-w", "fuzz.c", "-o", "fuzz.o",
+    NULL };
+  char** compile = compiler_command(compiler, compile_arguments);
+  run(compile, NULL);
+  free(compile);
+  char* link_command[] = { (char*)cxx, "-std=c++20", "-O2", "-w",
+    "fuzz_cpp.cpp", "fuzz.o", "-o", "fuzz_cpp", NULL };
+  run(link_command, NULL);
+  char* check_command[] = { "./fuzz_cpp", NULL };
+  run(check_command, "fuzz_cpp.txt");
+  FILE* result = fopen("fuzz_cpp.txt", "r");
+  char line[16] = "";
+  bool ok = result && fgets(line, sizeof(line), result)
+      && 0 == strcmp(line, "ok\n");
+  if (result) {
+    fclose(result);
+  }
+  return ok;
+}
+
+// Prints what a failed check printed to stderr and exits
+static void fuzz_failed(const char* output, size_t count, const char* lookup,
+    const char* layout, bool preserve)
+{
+  fprintf(stderr, "%zu files, --lookup %s, --layout %s%s:\n", count, lookup,
+      layout, preserve ? ", --preserve-paths" : "");
+  FILE* result = fopen(output, "r");
+  char line[1024];
+  if (result) {
+    while (fgets(line, sizeof(line), result)) {
+      fputs(line, stderr);
+    }
+    fclose(result);
+  }
+  exit(1);
+}
+
+// Checks and times every lookup strategy, with and without preserved paths,
+// on random sets of names, writing what it measured as JSON to `out`. With
+// a C++ compiler in `cxx` the header is also checked from C++.
+static void run_fuzz(FILE* out, const char* embed, char* const* compiler,
+    const char* cxx, bool quick, uint64_t seed)
+{
+  FILE* source = fopen("fuzz_main.c", "w");
+  FILE* cpp_source = fopen("fuzz_cpp.cpp", "w");
+  if (!source || !cpp_source) {
+    fprintf(stderr, "Could not write the lookup program\n");
+    exit(1);
+  }
+  fputs(fuzz_source, source);
+  fclose(source);
+  fputs(fuzz_cpp_source, cpp_source);
+  fclose(cpp_source);
+  const size_t* counts = quick ? fuzz_quick_counts : fuzz_counts;
+  fprintf(out, "{\n  \"quick\": %s,\n  \"seed\": %llu,\n  \"lookup\": [",
+      quick ? "true" : "false", (unsigned long long)seed);
+  uint64_t state = seed ? seed : 1;
+  bool first = true;
+  for (size_t n = 0; n < sizeof(fuzz_counts) / sizeof(size_t); n++) {
+    char* remove_command[] = { "rm", "-rf", "set", NULL };
+    run(remove_command, NULL);
+    mkdir("set", 0755);
+    struct fuzz_file* files = write_fuzz_set(counts[n], &state);
+    for (int preserve = 0; preserve < 2; preserve++) {
+      write_fuzz_cases(files, counts[n], preserve, &state);
+      for (size_t l = 0; l < sizeof(lookups) / sizeof(lookups[0]); l++) {
+        const char* layout = next_random(&state) % 2 ? "blob" : "pointers";
+        char* command[] = { (char*)embed, "--source", "fuzz.c", "--header",
+          "fuzz.h", "--function", "fuzz_get", "--file-index", "--format",
+          "string", "--lookup", (char*)lookups[l], "--layout", (char*)layout,
+          preserve ? "--preserve-paths" : "@inputs.txt",
+          preserve ? "@inputs.txt" : NULL, NULL };
+        run(command, NULL);
+        bool hashed = 0 == strcmp(lookups[l], "hash");
+        char* compile_arguments[] = { "-O2", "-w",
+          hashed ? "-DFUZZ_HASHED" : "-UFUZZ_HASHED", "fuzz_main.c", "fuzz.c",
+          "-o", "fuzz", NULL };
+        char** compile = compiler_command(compiler, compile_arguments);
+        run(compile, NULL);
+        free(compile);
+        size_t samples = FUZZ_SAMPLES;
+        if (0 == strcmp(lookups[l], "linear") && counts[n]
+            && FUZZ_LINEAR_BUDGET / counts[n] < samples) {
+          samples = FUZZ_LINEAR_BUDGET / counts[n];
+        }
+        if (quick) {
+          samples /= 8;
+        }
+        char samples_text[32];
+        snprintf(samples_text, sizeof(samples_text), "%zu", samples);
+        char* check_command[] = { "./fuzz", "cases.txt", samples_text, NULL };
+        run(check_command, "fuzz.txt");
+        FILE* result = fopen("fuzz.txt", "r");
+        size_t names = 0;
+        size_t misses = 0;
+        double hit_p50 = 0, hit_p99 = 0, miss_p50 = 0, miss_p99 = 0;
+        if (!result
+            || fscanf(result, "%zu %zu %lf %lf %lf %lf", &names, &misses,
+                   &hit_p50, &hit_p99, &miss_p50, &miss_p99)
+                != 6) {
+          // The lookups that failed are printed instead
+          fuzz_failed("fuzz.txt", counts[n], lookups[l], layout, preserve);
+        }
+        fclose(result);
+        if (cxx && !check_cpp(compiler, cxx)) {
+          fuzz_failed(
+              "fuzz_cpp.txt", counts[n], lookups[l], layout, preserve);
+        }
+        fprintf(out,
+            "%s\n    {\n"
+            "      \"files\": %zu,\n"
+            "      \"lookup\": \"%s\",\n"
+            "      \"layout\": \"%s\",\n"
+            "      \"preserve_paths\": %s,\n"
+            "      \"names\": %zu,\n"
+            "      \"misses\": %zu,\n"
+            "      \"hit_p50_ns\": %.1f,\n"
+            "      \"hit_p99_ns\": %.1f,\n"
+            "      \"miss_p50_ns\": %.1f,\n"
+            "      \"miss_p99_ns\": %.1f\n"
+            "    }",
+            first ? "" : ",", counts[n], lookups[l], layout,
+            preserve ? "true" : "false", names, misses, hit_p50, hit_p99,
+            miss_p50, miss_p99);
+        first = false;
+      }
+    }
+    for (size_t i = 0; i < counts[n]; i++) {
+      free(files[i].path);
+    }
+    free(files);
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+// Measures generating and compiling each format for every corpus, then the
+// lookups, writing the results as JSON to `out`
+static void run_bench(FILE* out, const char* embed_path,
+    char* const* compiler, size_t divisor)
+{
+  char buffer[256];
+  fprintf(out, "{\n  \"quick\": %s,\n  \"generate\": [", divisor > 1 ? "true" :
+      "false");
+  bool first = true;
+  for (size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); c++) {
+    const struct corpus* corpus = &corpora[c];
+    size_t bytes = write_corpus(corpus, corpus->name, divisor);
+    for (size_t f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+      char* options[] = { "--source", "out.c", "--function", "bench_get",
+        "--format", (char*)formats[f], NULL };
+      char** command
+          = embed_command(embed_path, corpus->name, corpus->file_count, options);
+      struct run_result generate = run(command, NULL);
+      free_embed_command(command, 6);
+      size_t output_size = file_size("out.c");
+      char* compile_arguments[] = { "-c", "-O0", "-w", "out.c", "-o", "out.o",
+        NULL };
+      command = compiler_command(compiler, compile_arguments);
+      struct run_result compile = run(command, NULL);
+      free(command);
+      fprintf(out,
+          "%s\n    {\n"
+          "      \"corpus\": \"%s\",\n"
+          "      \"files\": %zu,\n"
+          "      \"input_bytes\": %zu,\n"
+          "      \"format\": \"%s\",\n"
+          "      \"generate_seconds\": %.6f,\n"
+          "      \"generate_mb_per_second\": %.3f,\n"
+          "      \"generate_peak_rss_kb\": %ld,\n"
+          "      \"output_bytes\": %zu,\n"
+          "      \"compile_seconds\": %.6f,\n"
+          "      \"compile_peak_rss_kb\": %ld\n"
+          "    }",
+          first ? "" : ",", corpus->name, corpus->file_count, bytes,
+          formats[f], generate.seconds,
+          (double)bytes / 1e6 / generate.seconds, generate.peak_rss_kb,
+          output_size, compile.seconds, compile.peak_rss_kb);
+      first = false;
+      remove("out.c");
+      remove("out.o");
+    }
+  }
+  fprintf(out, "\n  ],\n  \"lookup\": [");
+  FILE* source = fopen("lookup_main.c", "w");
+  if (!source) {
+    fprintf(stderr, "Could not write the lookup program\n");
+    exit(1);
+  }
+  fputs(lookup_source, source);
+  fclose(source);
+  first = true;
+  for (size_t n = 0; n < sizeof(lookup_file_counts) / sizeof(size_t); n++) {
+    for (size_t l = 0; l < sizeof(lookups) / sizeof(lookups[0]); l++) {
+      char* options[] = { "--source", "lookup.c", "--header", "lookup.h",
+        "--function", "bench_get", "--lookup", (char*)lookups[l], NULL };
+      char** command = embed_command(
+          embed_path, corpora[0].name, lookup_file_counts[n], options);
+      run(command, NULL);
+      free_embed_command(command, 8);
+      char* compile_arguments[] = { "-O2", "-w", "lookup_main.c", "lookup.c",
+        "-o", "lookup", NULL };
+      command = compiler_command(compiler, compile_arguments);
+      run(command, NULL);
+      free(command);
+      snprintf(buffer, sizeof(buffer), "%d", LOOKUP_COUNT);
+      char* lookup_command[] = { "./lookup", buffer, NULL };
+      run(lookup_command, "lookup.txt");
+      FILE* result = fopen("lookup.txt", "r");
+      double ns = 0;
+      if (!result || fscanf(result, "%lf", &ns) != 1) {
+        fprintf(stderr, "Could not read the lookup time\n");
+        exit(1);
+      }
+      fclose(result);
+      fprintf(out,
+          "%s\n    {\n"
+          "      \"files\": %zu,\n"
+          "      \"lookup\": \"%s\",\n"
+          "      \"ns_per_lookup\": %.3f\n"
+          "    }",
+          first ? "" : ",", lookup_file_counts[n], lookups[l], ns);
+      first = false;
+    }
+  }
+  fprintf(out, "\n  ]\n}\n");
+}
+
+static void print_help(const char* exec_name)
+{
+  fprintf(stderr,
+      "Usage: %s [--quick] [--fuzz] [--seed <n>] [--cxx <compiler>]\n"
+      "\t\t[--output <file>] <embed> -- <compiler...>\n"
+      "\t--quick - Use files an eighth of the size, or fewer files and\n"
+      "\t          lookups with --fuzz\n"
+      "\t--fuzz - Check and time the lookups of random sets of names\n"
+      "\t--seed <n> - Seed of the names made by --fuzz, 1 by default\n"
+      "\t--cxx <compiler> - With --fuzz, also link each set into a C++20\n"
+      "\t          program checking the header's C++ wrappers\n"
+      "\t--output <file> - Write the results to a file as well as stdout\n",
+      exec_name);
+}
+
+int main(int argc, char** argv)
+{
+  size_t divisor = 1;
+  bool fuzz = false;
+  uint64_t seed = 1;
+  const char* output_file = NULL;
+  const char* cxx = NULL;
+  const char* embed = NULL;
+  char* const* compiler = NULL;
+  for (int arg = 1; arg < argc; arg++) {
+    if (0 == strcmp(argv[arg], "--quick")) {
+      divisor = 8;
+    } else if (0 == strcmp(argv[arg], "--fuzz")) {
+      fuzz = true;
+    } else if (0 == strcmp(argv[arg], "--seed") && arg + 1 < argc) {
+      seed = strtoull(argv[++arg], NULL, 10);
+    } else if (0 == strcmp(argv[arg], "--cxx") && arg + 1 < argc) {
+      cxx = argv[++arg];
+    } else if (0 == strcmp(argv[arg], "--output") && arg + 1 < argc) {
+      output_file = argv[++arg];
+    } else if (0 == strcmp(argv[arg], "--")) {
+      compiler = &argv[arg + 1];
+      break;
+    } else if (!embed) {
+      embed = argv[arg];
+    } else {
+      print_help(argv[0]);
+      return EXIT_FAILURE;
+    }
+  }
+  if (!embed || !compiler || !compiler[0]) {
+    print_help(argv[0]);
+    return EXIT_FAILURE;
+  }
+  // Everything runs in a scratch directory, embed is found from there by its
+  // full path
+  char* embed_path = realpath(embed, NULL);
+  char* start_directory = getcwd(NULL, 0);
+  if (!embed_path || !start_directory) {
+    fprintf(stderr, "Could not find '%s'\n", embed);
+    return EXIT_FAILURE;
+  }
+  const char* tmp = getenv("TMPDIR");
+  char* directory = format_string("%s/%s", tmp ? tmp : "/tmp",
+      "embed-bench-XXXXXX");
+  if (!mkdtemp(directory)) {
+    fprintf(stderr, "Could not create a scratch directory\n");
+    return EXIT_FAILURE;
+  }
+  scratch_directory = directory;
+  scratch_start = start_directory;
+  atexit(remove_scratch_directory);
+  if (chdir(directory) != 0) {
+    fprintf(stderr, "Could not enter the scratch directory\n");
+    return EXIT_FAILURE;
+  }
+  char* json = NULL;
+  size_t json_size = 0;
+  FILE* out = open_memstream(&json, &json_size);
+  if (!out) {
+    fprintf(stderr, "Could not allocate memory\n");
+    return EXIT_FAILURE;
+  }
+  if (fuzz) {
+    run_fuzz(out, embed_path, compiler, cxx, divisor > 1, seed);
+  } else {
+    run_bench(out, embed_path, compiler, divisor);
+  }
+  fclose(out);
+  fputs(json, stdout);
+  if (chdir(start_directory) != 0) {
+    fprintf(stderr, "Could not return to '%s'\n", start_directory);
+    return EXIT_FAILURE;
+  }
+  if (output_file) {
+    FILE* fd = fopen(output_file, "w");
+    if (!fd || fwrite(json, 1, json_size, fd) != json_size) {
+      fprintf(stderr, "Could not write '%s'\n", output_file);
+      return EXIT_FAILURE;
+    }
+    fclose(fd);
+  }
+  free(json);
+  free(embed_path);
+  return EXIT_SUCCESS;
+}
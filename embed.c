@@ -33,20 +33,70 @@
  *
  */
 
+// clock_gettime, realpath, lstat, madvise and d_type are hidden by strict C
+// dialects such as -std=c99 unless asked for
+#ifndef _DEFAULT_SOURCE
+#define _DEFAULT_SOURCE
+#endif
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#ifdef EMBED_HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 // Number of columns to show hex output
 #define HEX_COLS 12
 
+// Size of the blocks read from input files
+#define READ_BLOCK_SIZE (1 << 20)
+
+// Amount of generated output to buffer before flushing it to disk
+#define OUTPUT_BUFFER_SIZE (4 << 20)
+
 #ifdef _WIN32
 #define PATH_SEPARATOR '\\'
 #else
 #define PATH_SEPARATOR '/'
 #endif
 
+// Object format of the platform embed was built for
+#if defined(__APPLE__) && defined(__aarch64__)
+#define DEFAULT_OBJECT_FORMAT "macho-arm64"
+#elif defined(__APPLE__)
+#define DEFAULT_OBJECT_FORMAT "macho-x86-64"
+#elif defined(_WIN32) && (defined(_M_ARM64) || defined(__aarch64__))
+#define DEFAULT_OBJECT_FORMAT "coff-arm64"
+#elif defined(_WIN32) && (defined(_M_X64) || defined(__x86_64__))
+#define DEFAULT_OBJECT_FORMAT "coff-x86-64"
+#elif defined(_WIN32)
+#define DEFAULT_OBJECT_FORMAT "coff-i386"
+#elif defined(__aarch64__)
+#define DEFAULT_OBJECT_FORMAT "elf64-aarch64"
+#elif defined(__arm__)
+#define DEFAULT_OBJECT_FORMAT "elf32-arm"
+#elif defined(__riscv) && __riscv_xlen == 64
+#define DEFAULT_OBJECT_FORMAT "elf64-riscv"
+#elif defined(__i386__)
+#define DEFAULT_OBJECT_FORMAT "elf32-i386"
+#else
+#define DEFAULT_OBJECT_FORMAT "elf64-x86-64"
+#endif
+
 // print help
 static void print_help(const char* exec_name)
 {
@@ -64,208 +114,8550 @@ static void print_help(const char* exec_name)
       "\t\t--preserve-paths - When set, paths passed for files are\n"
       "\t\t                   preserved for retrieval by the retreival\n"
       "                       function\n"
-      "\t\t ...<input files> - List of input files\n",
+      "\t\t--format <hex|decimal|string|u64> - Encoding of the embedded\n"
+      "\t\t                   data in the source file. Defaults to hex.\n"
+      "\t\t                   decimal and string are smaller, string\n"
+      "\t\t                   data is written as rows of short literals\n"
+      "\t\t                   so MSVC takes files of any size.\n"
+      "\t\t                   u64 packs 8 bytes per word for little\n"
+      "\t\t                   endian targets\n"
+      "\t\t--backend <array|embed|incbin> - How data gets into the\n"
+      "\t\t                   program. embed uses C23 #embed, or .incbin\n"
+      "\t\t                   where #embed is unavailable, incbin only\n"
+      "\t\t                   uses .incbin. Both fall back to arrays on\n"
+      "\t\t                   other toolchains. Defaults to array\n"
+      "\t\t--overlay - Let the functions serve files from the directory\n"
+      "\t\t                   in the <FUNCTION>_OVERLAY environment\n"
+      "\t\t                   variable or given to\n"
+      "\t\t                   <function>_set_overlay() while developing.\n"
+      "\t\t                   Left out when compiling with NDEBUG or\n"
+      "\t\t                   EMBEDDED_OVERLAY defined as 0\n"
+      "\t\t--verify - Keep a CRC32C of each file and add\n"
+      "\t\t                   <function>_verify(), _verify_at() and\n"
+      "\t\t                   _verify_all() to check what is retrieved,\n"
+      "\t\t                   as from a pack or the overlay\n"
+      "\t\t--file-index - Declare in the header an enum with every\n"
+      "\t\t                   file's index, a static inline accessor\n"
+      "\t\t                   for each file and for C++14 a constexpr\n"
+      "\t\t                   <function>_index(name). The header grows\n"
+      "\t\t                   with the number of files\n"
+      "\t\t--section <name> - Put the data in its own section, as in\n"
+      "\t\t                   .embed, to keep it apart from other read\n"
+      "\t\t                   only data\n"
+      "\t\t--no-fallback - Leave the array fallback out of the source\n"
+      "\t\t                   for the embed and incbin backends\n"
+      "\t\t--lookup <linear|hash|sorted> - How the function finds files.\n"
+      "\t\t                   hash uses a perfect hash built over the\n"
+      "\t\t                   names, sorted a binary search over names\n"
+      "\t\t                   ordered by length and then bytes,\n"
+      "\t\t                   linear is the default and compares every\n"
+      "\t\t                   name, which is faster for a few files\n"
+      "\t\t--layout <pointers|blob> - pointers, the default, has a table\n"
+      "\t\t                   of pointers to each file's data. blob\n"
+      "\t\t                   packs all names and all data into two\n"
+      "\t\t                   arrays indexed by offset tables, which\n"
+      "\t\t                   needs no relocations at load time\n"
+      "\t\t--align <bytes> - Alignment of each file's data, a power of\n"
+      "\t\t                   two. Defaults to 16\n"
+      "\t\t--compress <none|lz4|deflate|zstd> - Compress each file's\n"
+      "\t\t                   data, which is decompressed the first\n"
+      "\t\t                   time the file is retrieved. lz4 is the\n"
+      "\t\t                   fastest to decompress, zstd needs embed\n"
+      "\t\t                   and the program built with libzstd. Only\n"
+      "\t\t                   for the array backend and object files\n"
+      "\t\t--compress-threshold <percent> - Only keep compressed data\n"
+      "\t\t                   at most this percent of the file's size.\n"
+      "\t\t                   Defaults to 90\n"
+      "\t\t--block-size <bytes> - Compress files larger than this in\n"
+      "\t\t                   independent blocks of this size, so\n"
+      "\t\t                   reads only decompress the blocks they\n"
+      "\t\t                   cover. 0, the default, compresses\n"
+      "\t\t                   files whole\n"
+      "\t\t-j, --jobs <count> - Threads used to compress and encode\n"
+      "\t\t                   files, 0 for one per processor. The\n"
+      "\t\t                   output does not depend on it. Defaults\n"
+      "\t\t                   to 1\n"
+      "\t\t--max-memory <bytes> - Compress and encode only as much at\n"
+      "\t\t                   once as fits in this much memory, as in\n"
+      "\t\t                   512M or 2G, with mapped files not\n"
+      "\t\t                   counted. Fails when the data that has to\n"
+      "\t\t                   be kept does not fit\n"
+      "\t\t--shards <count> - Split the array data across <count>\n"
+      "\t\t                   sources named after the source, as in\n"
+      "\t\t                   assets_0.c, to compile them in parallel\n"
+      "\t\t--recursive <directory> - Embed every file below the\n"
+      "\t\t                   directory in sorted order, leaving out\n"
+      "\t\t                   names starting with a dot\n"
+      "\t\t--archive <archive> - Embed every file in a tar or zip\n"
+      "\t\t                   archive under its path in the archive,\n"
+      "\t\t                   in the order they are stored\n"
+      "\t\t--stats - Print the size of each file before and after\n"
+      "\t\t                   compression, the time spent compressing\n"
+      "\t\t                   and encoding it and the time of each\n"
+      "\t\t                   phase, the slowest files first\n"
+      "\t\t--stats-json <file> - Write the same report as JSON, to\n"
+      "\t\t                   stdout for -\n"
+      "\t\t--incremental - Keep a manifest of the inputs' sizes and\n"
+      "\t\t                   hashes next to the source, and leave the\n"
+      "\t\t                   outputs untouched when nothing changed\n"
+      "\t\t--depfile <file> - Write a make style dependency file\n"
+      "\t\t                   listing the inputs, as for -MD\n"
+      "\t\t--object <object file> - Write the data directly into an\n"
+      "\t\t                   object file to link with the source\n"
+      "\t\t--object-format <format> - Format of the object file, one of\n"
+      "\t\t                   elf64-x86-64, elf32-i386, elf64-aarch64,\n"
+      "\t\t                   elf32-arm, elf64-riscv, coff-x86-64,\n"
+      "\t\t                   coff-i386, coff-arm64, macho-x86-64 or\n"
+      "\t\t                   macho-arm64. Defaults to " DEFAULT_OBJECT_FORMAT "\n"
+      "\t\t--pack <pack file> - Write the data into a pack file that the\n"
+      "\t\t                   source maps on first use, from the path\n"
+      "\t\t                   given, <FUNCTION>_PACK or\n"
+      "\t\t                   <function>_set_pack(), so only the names\n"
+      "\t\t                   and tables are compiled\n"
+      "\t\t--sets <file> - Generate several sets of files in one run,\n"
+      "\t\t                   one per line of the file, each line\n"
+      "\t\t                   holding the options and inputs of a set.\n"
+      "\t\t                   Options given before --sets apply to\n"
+      "\t\t                   every set. Files in more than one set\n"
+      "\t\t                   are read and compressed once\n"
+      "\t\t--shared-data <source> - With --sets, write the data stored\n"
+      "\t\t                   by more than one set once into this\n"
+      "\t\t                   source, which the sets' sources refer\n"
+      "\t\t                   to. Needs the array backend and the\n"
+      "\t\t                   pointers layout, in other sets the data\n"
+      "\t\t                   stays in their own sources\n"
+      "\t\t ...<input files> - List of input files. Settings for a\n"
+      "\t\t                   single file follow its path, as in\n"
+      "\t\t                   file.bin:align=4096,compress=none.\n"
+      "\t\t                   Files take align, compress,\n"
+      "\t\t                   compress-threshold, block-size and\n"
+      "\t\t                   placement=hot or cold, which puts the\n"
+      "\t\t                   file first or last with the blob\n"
+      "\t\t                   layout, --object or --pack, and name,\n"
+      "\t\t                   which\n"
+      "\t\t                   embeds it under another path. - reads\n"
+      "\t\t                   a file from stdin, as in\n"
+      "\t\t                   -:name=app.min.js.\n"
+      "\t\t                   Patterns such as 'assets/**/*.png'\n"
+      "\t\t                   are expanded in sorted order and\n"
+      "\t\t                   @<file> reads more inputs from a\n"
+      "\t\t                   file, one per line\n",
       exec_name);
 }
 
-static void output_hex(FILE* fd, char b)
+// Precomputed "0xNN, " text for every byte value
+#define HEX_ENTRY_SIZE 6
+static char hex_table[256][HEX_ENTRY_SIZE];
+
+static void init_hex_table(void)
+{
+  const char* digits = "0123456789ABCDEF";
+  for (int i = 0; i < 256; i++) {
+    hex_table[i][0] = '0';
+    hex_table[i][1] = 'x';
+    hex_table[i][2] = digits[i >> 4];
+    hex_table[i][3] = digits[i & 0xF];
+    hex_table[i][4] = ',';
+    hex_table[i][5] = ' ';
+  }
+}
+
+// Monotonic time in seconds, for --stats
+static double clock_seconds(void)
+{
+#ifdef _WIN32
+  LARGE_INTEGER counter;
+  LARGE_INTEGER frequency;
+  QueryPerformanceCounter(&counter);
+  QueryPerformanceFrequency(&frequency);
+  return (double)counter.QuadPart / (double)frequency.QuadPart;
+#else
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+#endif
+}
+
+// Time spent writing output to files, which only happens on the main thread
+static double output_write_seconds;
+
+// In memory buffer for generated output, written to the file in large chunks
+struct output_buffer {
+  FILE* fd;
+  char* data;
+  size_t length;
+  size_t capacity;
+};
+
+static void output_buffer_init(struct output_buffer* out, FILE* fd)
+{
+  out->fd = fd;
+  out->length = 0;
+  out->capacity = fd ? OUTPUT_BUFFER_SIZE : 4096;
+  out->data = malloc(out->capacity);
+  if (!out->data) {
+    fprintf(stderr, "Could not allocate output buffer\n");
+    exit(1);
+  }
+}
+
+static void output_write_fd(FILE* fd, const char* data, size_t size)
+{
+  double start = clock_seconds();
+  if (size && fwrite(data, 1, size, fd) != size) {
+    fprintf(stderr, "Could not write output\n");
+    exit(1);
+  }
+  output_write_seconds += clock_seconds() - start;
+}
+
+// Buffers without a file collect all output in memory
+static void output_buffer_flush(struct output_buffer* out)
+{
+  if (!out->fd) {
+    return;
+  }
+  output_write_fd(out->fd, out->data, out->length);
+  out->length = 0;
+}
+
+// Make sure there is room for at least `size` more bytes
+static char* output_buffer_reserve(struct output_buffer* out, size_t size)
+{
+  if (out->length + size > out->capacity) {
+    output_buffer_flush(out);
+  }
+  if (out->length + size > out->capacity) {
+    out->capacity = (out->length + size) * 2;
+    out->data = realloc(out->data, out->capacity);
+    if (!out->data) {
+      fprintf(stderr, "Could not allocate output buffer\n");
+      exit(1);
+    }
+  }
+  return out->data + out->length;
+}
+
+static void output_buffer_write(
+    struct output_buffer* out, const char* data, size_t size)
+{
+  if (size > out->capacity && out->fd) {
+    output_buffer_flush(out);
+    output_write_fd(out->fd, data, size);
+    return;
+  }
+  memcpy(output_buffer_reserve(out, size), data, size);
+  out->length += size;
+}
+
+static void output_buffer_puts(struct output_buffer* out, const char* str)
+{
+  output_buffer_write(out, str, strlen(str));
+}
+
+static void output_buffer_free(struct output_buffer* out)
+{
+  output_buffer_flush(out);
+  free(out->data);
+  out->data = NULL;
+}
+
+// Precomputed "N," text for every byte value, padded to 4 bytes
+static char decimal_table[256][4];
+static unsigned char decimal_length[256];
+
+static void init_decimal_table(void)
+{
+  for (int i = 0; i < 256; i++) {
+    char text[8];
+    int length = snprintf(text, sizeof(text), "%d,", i);
+    memcpy(decimal_table[i], text, 4);
+    decimal_length[i] = length;
+  }
+}
+
+// Input bytes per line for each format
+#define DECIMAL_COLS 32
+#define STRING_COLS 256
+#define U64_COLS 64
+#define MAX_LINE_BYTES STRING_COLS
+
+// An encoding for embedded data. Data is written in lines of `line_bytes`
+// input bytes and the text of a line only depends on the bytes in it, so data
+// can be encoded in blocks of whole lines.
+struct data_format {
+  const char* name;
+  size_t line_bytes;
+  // Upper bound on the encoded length of a line
+  size_t max_line_length;
+  // Emitted once at the top of the source file
+  const char* preamble;
+  // Opens an encoded object, typically a compound literal
+  const char* begin;
+  // Element type, the dimension following [] and opening of the initializer
+  // for static arrays
+  const char* type;
+  const char* dimension;
+  const char* array_begin;
+  // Encodes a line of up to `line_bytes` bytes found `offset` bytes into the
+  // object, returning the end of the written text
+  char* (*encode_line)(
+      char* o, const unsigned char* data, size_t size, size_t offset);
+  // Returns the text closing an object of `size` bytes, including the null
+  // terminator
+  const char* (*end)(size_t size);
+};
+
+static char* encode_hex_line(
+    char* o, const unsigned char* data, size_t size, size_t offset)
+{
+  (void)offset;
+  for (size_t i = 0; i < size; i++) {
+    memcpy(o, hex_table[data[i]], HEX_ENTRY_SIZE);
+    o += HEX_ENTRY_SIZE;
+  }
+  if (size == HEX_COLS) {
+    memcpy(o, "\n\t\t", 3);
+    o += 3;
+  }
+  return o;
+}
+
+static const char* end_hex(size_t size)
+{
+  (void)size;
+  return "0x00\n\t}";
+}
+
+static char* encode_decimal_line(
+    char* o, const unsigned char* data, size_t size, size_t offset)
+{
+  (void)offset;
+  for (size_t i = 0; i < size; i++) {
+    // Entries are padded, so copy all 4 bytes and only advance by the length
+    memcpy(o, decimal_table[data[i]], 4);
+    o += decimal_length[data[i]];
+  }
+  if (size == DECIMAL_COLS) {
+    *o++ = '\n';
+  }
+  return o;
+}
+
+static const char* end_decimal(size_t size)
+{
+  (void)size;
+  return "0}";
+}
+
+static char* encode_string_literal(
+    char* o, const unsigned char* data, size_t size)
+{
+  *o++ = '"';
+  for (size_t i = 0; i < size; i++) {
+    unsigned char c = data[i];
+    switch (c) {
+    case '"':
+    case '\\':
+      *o++ = '\\';
+      *o++ = c;
+      continue;
+    case '\n':
+      *o++ = '\\';
+      *o++ = 'n';
+      continue;
+    case '\t':
+      *o++ = '\\';
+      *o++ = 't';
+      continue;
+    case '\r':
+      *o++ = '\\';
+      *o++ = 'r';
+      continue;
+    case '?':
+      // Never leave two question marks in a row so no trigraphs can form
+      if (i > 0 && data[i - 1] == '?') {
+        *o++ = '\\';
+      }
+      *o++ = '?';
+      continue;
+    }
+    if (c >= 0x20 && c < 0x7F) {
+      *o++ = c;
+      continue;
+    }
+    // Octal escapes are at most 3 digits, so a short escape is fine unless
+    // the next character is itself an octal digit
+    bool full = i + 1 < size && data[i + 1] >= '0' && data[i + 1] <= '7';
+    *o++ = '\\';
+    if (full || c >= 0100) {
+      *o++ = '0' + (c >> 6);
+    }
+    if (full || c >= 010) {
+      *o++ = '0' + ((c >> 3) & 7);
+    }
+    *o++ = '0' + (c & 7);
+  }
+  *o++ = '"';
+  return o;
+}
+
+// Lines are concatenated into one literal, for names
+static char* encode_string_line(
+    char* o, const unsigned char* data, size_t size, size_t offset)
+{
+  if (offset != 0) {
+    *o++ = '\n';
+    *o++ = '\t';
+  }
+  return encode_string_literal(o, data, size);
+}
+
+static const char* end_string(size_t size)
+{
+  // String literals carry their own null terminator
+  return size == 0 ? "\"\"" : "";
+}
+
+// Arrays are made of rows of STRING_COLS bytes, each its own literal, as
+// MSVC can not concatenate literals past 64 KiB. A full row leaves out the
+// null terminator, which C allows, and the rows are contiguous.
+static char* encode_string_row(
+    char* o, const unsigned char* data, size_t size, size_t offset)
+{
+  if (offset != 0) {
+    *o++ = ',';
+    *o++ = '\n';
+    *o++ = '\t';
+  }
+  return encode_string_literal(o, data, size);
+}
+
+static const char* end_string_rows(size_t size)
+{
+  // A partial last row is padded with zeros, a full one needs another row
+  // for the terminator
+  if (size == 0) {
+    return "\"\"}";
+  }
+  return (size % STRING_COLS) == 0 ? ",\n\t\"\"}" : "}";
+}
+
+static char* encode_u64_line(
+    char* o, const unsigned char* data, size_t size, size_t offset)
+{
+  (void)offset;
+  const char* digits = "0123456789ABCDEF";
+  for (size_t i = 0; i < size; i += 8) {
+    // Words are little endian, a partial final word is padded with zeros
+    uint64_t word = 0;
+    for (size_t b = 0; b < 8 && i + b < size; b++) {
+      word |= (uint64_t)data[i + b] << (8 * b);
+    }
+    if (word == 0) {
+      *o++ = '0';
+    } else {
+      *o++ = '0';
+      *o++ = 'x';
+      int shift = 60;
+      while ((word >> shift) == 0) {
+        shift -= 4;
+      }
+      for (; shift >= 0; shift -= 4) {
+        *o++ = digits[(word >> shift) & 0xF];
+      }
+    }
+    *o++ = ',';
+  }
+  if (size == U64_COLS) {
+    *o++ = '\n';
+  }
+  return o;
+}
+
+static const char* end_u64(size_t size)
+{
+  // A partial last word already has a zero byte after the data
+  return (size % 8) == 0 ? "0}" : "}";
+}
+
+#define STRINGIFY(x) #x
+#define STRING_ROW_DIMENSION(cols) "[" STRINGIFY(cols) "]"
+
+static const struct data_format data_formats[] = {
+  { "hex", HEX_COLS, HEX_COLS * HEX_ENTRY_SIZE + 3, "", "(char[]){\n\t\t",
+      "unsigned char", "", "{\n\t\t", encode_hex_line, end_hex },
+  { "decimal", DECIMAL_COLS, DECIMAL_COLS * 4 + 1, "",
+      "(const char*)(const unsigned char[]){\n", "unsigned char", "", "{\n",
+      encode_decimal_line, end_decimal },
+  // MSVC warns about the full rows of arrays leaving out the terminator,
+  // which C allows and C++ does not, so these sources only compile as C
+  { "string", STRING_COLS, STRING_COLS * 4 + 4,
+      "#ifdef _MSC_VER\n"
+      "#pragma warning(disable : 4295)\n"
+      "#endif\n",
+      "", "char", "", "\n\t", encode_string_line, end_string },
+  { "u64", U64_COLS, (U64_COLS / 8) * 19 + 1,
+      "#include <stdint.h>\n"
+      "#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__\n"
+      "#error \"Data was generated with --format u64 for little endian "
+      "targets\"\n"
+      "#endif\n",
+      "(const char*)(const uint64_t[]){\n", "uint64_t", "", "{\n",
+      encode_u64_line, end_u64 },
+};
+
+// The string format as it is written in arrays
+static const struct data_format string_rows_format
+    = { "string", STRING_COLS, STRING_COLS * 4 + 5, "", "", "char",
+        STRING_ROW_DIMENSION(STRING_COLS), "{\n\t", encode_string_row,
+        end_string_rows };
+
+// Format of the data in static arrays, which only differs for strings
+static const struct data_format* array_format(
+    const struct data_format* format)
+{
+  return format->encode_line == encode_string_line ? &string_rows_format
+                                                   : format;
+}
+
+static const struct data_format* find_data_format(const char* name)
+{
+  for (size_t i = 0; i < sizeof(data_formats) / sizeof(data_formats[0]);
+       i++) {
+    if (0 == strcmp(name, data_formats[i].name)) {
+      return &data_formats[i];
+    }
+  }
+  return NULL;
+}
+
+// Encodes `size` bytes of an object's data found `offset` bytes into it.
+// Unless this reaches the end of the object `size` must be a multiple of the
+// format's line size
+static void output_data(struct output_buffer* out,
+    const struct data_format* format, const unsigned char* data, size_t size,
+    size_t offset)
+{
+  while (size > 0) {
+    size_t line = size < format->line_bytes ? size : format->line_bytes;
+    char* o = output_buffer_reserve(out, format->max_line_length);
+    out->length = format->encode_line(o, data, line, offset) - out->data;
+    data += line;
+    size -= line;
+    offset += line;
+  }
+}
+
+// A name without its directories, where / separates them on every system as
+// it does in archives
+static const char* plain_name(const char* filename)
+{
+  const char* no_path = filename;
+  for (int i = 0; filename[i] != '\0'; i++) {
+    if (filename[i] == PATH_SEPARATOR || filename[i] == '/') {
+      no_path = &(filename[i + 1]);
+    }
+  }
+  return no_path;
+}
+
+// Name a file is retrieved by
+static const char* file_name(const char* input_file, bool preserve_paths)
+{
+  return preserve_paths ? input_file : plain_name(input_file);
+}
+
+// Backends for getting file data into the program. Anything but the array
+// backend leaves reading the files to the compiler or assembler
+enum backend {
+  BACKEND_ARRAY,
+  BACKEND_EMBED,
+  BACKEND_INCBIN,
+  BACKEND_OBJECT,
+  BACKEND_PACK,
+};
+
+// Strategies for looking up a file by name in the generated function
+enum lookup {
+  LOOKUP_LINEAR,
+  LOOKUP_HASH,
+  LOOKUP_SORTED,
+};
+
+// How tables are laid out in the source. pointers has a table of pointers to
+// separate arrays for each file, blob puts everything in one array with a
+// table of offsets into it
+enum layout {
+  LAYOUT_POINTERS,
+  LAYOUT_BLOB,
+};
+
+// Compression applied to a file's data. The generated code decompresses a
+// file the first time it is asked for.
+enum compression {
+  COMPRESS_NONE,
+  COMPRESS_LZ4,
+  COMPRESS_DEFLATE,
+  COMPRESS_ZSTD,
+};
+
+static const char* compression_names[] = { "none", "lz4", "deflate", "zstd" };
+
+// Where a file's data goes, hot files first and cold files last so the data
+// used at startup is paged in together
+enum placement {
+  PLACEMENT_NORMAL,
+  PLACEMENT_HOT,
+  PLACEMENT_COLD,
+};
+
+static const char* placement_names[] = { "normal", "hot", "cold" };
+
+static bool find_placement(const char* name, enum placement* placement)
+{
+  for (size_t i = 0; i < sizeof(placement_names) / sizeof(placement_names[0]);
+       i++) {
+    if (0 == strcmp(name, placement_names[i])) {
+      *placement = (enum placement)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static bool find_compression(const char* name, enum compression* compression)
+{
+  for (size_t i = 0;
+       i < sizeof(compression_names) / sizeof(compression_names[0]); i++) {
+    if (0 == strcmp(name, compression_names[i])) {
+      *compression = (enum compression)i;
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint32_t read_le32(const unsigned char* data)
+{
+  return (uint32_t)data[0] | (uint32_t)data[1] << 8 | (uint32_t)data[2] << 16
+      | (uint32_t)data[3] << 24;
+}
+
+// Writes an LZ4 length continuation, 255 for every full byte then the rest
+static size_t lz4_length(unsigned char* out, size_t o, size_t length)
+{
+  while (length >= 255) {
+    out[o++] = 255;
+    length -= 255;
+  }
+  out[o++] = (unsigned char)length;
+  return o;
+}
+
+// Writes an LZ4 sequence of literals followed by a match, or only the
+// literals when `match_length` is 0
+static size_t lz4_sequence(unsigned char* out, size_t o,
+    const unsigned char* literals, size_t literal_length, size_t offset,
+    size_t match_length)
+{
+  size_t match_code = match_length ? match_length - 4 : 0;
+  out[o++] = (unsigned char)((literal_length < 15 ? literal_length : 15) << 4
+      | (match_code < 15 ? match_code : 15));
+  if (literal_length >= 15) {
+    o = lz4_length(out, o, literal_length - 15);
+  }
+  memcpy(out + o, literals, literal_length);
+  o += literal_length;
+  if (match_length) {
+    out[o++] = (unsigned char)offset;
+    out[o++] = (unsigned char)(offset >> 8);
+    if (match_code >= 15) {
+      o = lz4_length(out, o, match_code - 15);
+    }
+  }
+  return o;
+}
+
+#define LZ4_HASH_BITS 16
+
+// Compresses into an LZ4 block, `out` must hold lz4_bound(size) bytes
+static size_t lz4_bound(size_t size)
+{
+  return size + size / 255 + 16;
+}
+
+static size_t lz4_compress(
+    const unsigned char* in, size_t size, unsigned char* out)
+{
+  // Position + 1 of the last occurrence of each hashed 4 byte sequence
+  size_t* table = calloc((size_t)1 << LZ4_HASH_BITS, sizeof(size_t));
+  if (!table) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  size_t o = 0;
+  size_t anchor = 0;
+  size_t ip = 0;
+  // The last match has to start 12 bytes and end 5 bytes before the end
+  size_t match_start_limit = size > 12 ? size - 12 : 0;
+  size_t misses = 0;
+  while (ip < match_start_limit) {
+    uint32_t sequence = read_le32(in + ip);
+    uint32_t hash = (sequence * 2654435761u) >> (32 - LZ4_HASH_BITS);
+    size_t candidate = table[hash];
+    table[hash] = ip + 1;
+    if (!candidate || ip - (candidate - 1) > 65535
+        || read_le32(in + candidate - 1) != sequence) {
+      // Skip ahead faster through data that does not compress
+      ip += 1 + (misses++ >> 6);
+      continue;
+    }
+    misses = 0;
+    size_t ref = candidate - 1;
+    size_t length = 4;
+    while (ip + length < size - 5 && in[ref + length] == in[ip + length]) {
+      length++;
+    }
+    while (ip > anchor && ref > 0 && in[ip - 1] == in[ref - 1]) {
+      ip--;
+      ref--;
+      length++;
+    }
+    o = lz4_sequence(out, o, in + anchor, ip - anchor, ip - ref, length);
+    ip += length;
+    anchor = ip;
+    if (ip - 2 < match_start_limit) {
+      table[(read_le32(in + ip - 2) * 2654435761u) >> (32 - LZ4_HASH_BITS)]
+          = ip - 1;
+    }
+  }
+  o = lz4_sequence(out, o, in + anchor, size - anchor, 0, 0);
+  free(table);
+  return o;
+}
+
+// Deflate streams are written least significant bit first
+struct bit_writer {
+  unsigned char* data;
+  size_t length;
+  size_t capacity;
+  uint64_t bits;
+  unsigned count;
+};
+
+static void put_bits(struct bit_writer* writer, uint32_t value, unsigned bits)
+{
+  writer->bits |= ((uint64_t)value & (((uint64_t)1 << bits) - 1))
+      << writer->count;
+  writer->count += bits;
+  while (writer->count >= 8) {
+    if (writer->length == writer->capacity) {
+      writer->capacity = writer->capacity * 2 + 4096;
+      writer->data = realloc(writer->data, writer->capacity);
+      if (!writer->data) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+      }
+    }
+    writer->data[writer->length++] = (unsigned char)writer->bits;
+    writer->bits >>= 8;
+    writer->count -= 8;
+  }
+}
+
+static const uint16_t deflate_length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11,
+  13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195,
+  227, 258 };
+static const unsigned char deflate_length_extra[29] = { 0, 0, 0, 0, 0, 0, 0,
+  0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+static const uint16_t deflate_distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13,
+  17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+  4097, 6145, 8193, 12289, 16385, 24577 };
+static const unsigned char deflate_distance_extra[30] = { 0, 0, 0, 0, 1, 1, 2,
+  2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13,
+  13 };
+// Order code length code lengths are stored in
+static const unsigned char deflate_code_length_order[19] = { 16, 17, 18, 0, 8,
+  7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+
+static unsigned deflate_length_code(unsigned length)
+{
+  unsigned code = 0;
+  while (code < 28 && deflate_length_base[code + 1] <= length) {
+    code++;
+  }
+  return code;
+}
+
+static unsigned deflate_distance_code(unsigned distance)
+{
+  unsigned code = 0;
+  while (code < 29 && deflate_distance_base[code + 1] <= distance) {
+    code++;
+  }
+  return code;
+}
+
+struct huffman_leaf {
+  uint32_t freq;
+  uint16_t symbol;
+};
+
+static int compare_huffman_leaf(const void* a, const void* b)
+{
+  const struct huffman_leaf* left = a;
+  const struct huffman_leaf* right = b;
+  if (left->freq != right->freq) {
+    return left->freq < right->freq ? -1 : 1;
+  }
+  return left->symbol < right->symbol ? -1 : (left->symbol > right->symbol);
+}
+
+// Computes Huffman code lengths no longer than `limit` for `count` symbols
+static void huffman_lengths(const uint32_t* freqs, size_t count,
+    unsigned limit, unsigned char* lengths)
+{
+  struct huffman_leaf leaves[288];
+  size_t used = 0;
+  memset(lengths, 0, count);
+  for (size_t i = 0; i < count; i++) {
+    if (freqs[i]) {
+      leaves[used].freq = freqs[i];
+      leaves[used].symbol = (uint16_t)i;
+      used++;
+    }
+  }
+  // A complete code needs two symbols
+  for (size_t i = 0; used < 2; i++) {
+    if (!freqs[i]) {
+      leaves[used].freq = 1;
+      leaves[used].symbol = (uint16_t)i;
+      used++;
+    }
+  }
+  qsort(leaves, used, sizeof(leaves[0]), compare_huffman_leaf);
+  // Merge the two lightest of the sorted leaves and the queue of merged
+  // nodes, which are created in order of weight
+  uint64_t weights[2 * 288];
+  size_t parents[2 * 288];
+  for (size_t i = 0; i < used; i++) {
+    weights[i] = leaves[i].freq;
+  }
+  size_t next_leaf = 0;
+  size_t next_node = used;
+  size_t node_count = used;
+  while (node_count < 2 * used - 1) {
+    size_t picked[2];
+    for (int k = 0; k < 2; k++) {
+      if (next_leaf < used
+          && (next_node == node_count
+              || weights[next_leaf] <= weights[next_node])) {
+        picked[k] = next_leaf++;
+      } else {
+        picked[k] = next_node++;
+      }
+    }
+    weights[node_count] = weights[picked[0]] + weights[picked[1]];
+    parents[picked[0]] = node_count;
+    parents[picked[1]] = node_count;
+    node_count++;
+  }
+  // Depths from the root down, then count the leaves at each length
+  unsigned depths[2 * 288];
+  depths[node_count - 1] = 0;
+  unsigned length_counts[64] = { 0 };
+  for (size_t i = node_count - 1; i-- > 0;) {
+    depths[i] = depths[parents[i]] + 1;
+  }
+  for (size_t i = 0; i < used; i++) {
+    length_counts[depths[i] < limit ? depths[i] : limit]++;
+  }
+  // Lengths cut down to the limit oversubscribe the code. Each step moves a
+  // leaf down from the limit and splits a shorter leaf, as zlib does.
+  uint64_t kraft = 0;
+  for (unsigned length = 1; length <= limit; length++) {
+    kraft += (uint64_t)length_counts[length] << (limit - length);
+  }
+  while (kraft > ((uint64_t)1 << limit)) {
+    unsigned length = limit - 1;
+    while (length_counts[length] == 0) {
+      length--;
+    }
+    length_counts[length]--;
+    length_counts[length + 1] += 2;
+    length_counts[limit]--;
+    kraft--;
+  }
+  // The most frequent symbols get the shortest codes
+  size_t leaf = used;
+  for (unsigned length = 1; length <= limit; length++) {
+    for (unsigned i = 0; i < length_counts[length]; i++) {
+      lengths[leaves[--leaf].symbol] = (unsigned char)length;
+    }
+  }
+}
+
+// Canonical codes for the lengths, bit reversed to be written least
+// significant bit first
+static void huffman_codes(
+    const unsigned char* lengths, size_t count, uint16_t* codes)
+{
+  unsigned length_counts[16] = { 0 };
+  for (size_t i = 0; i < count; i++) {
+    length_counts[lengths[i]]++;
+  }
+  length_counts[0] = 0;
+  unsigned next[16];
+  unsigned code = 0;
+  for (int length = 1; length < 16; length++) {
+    code = (code + length_counts[length - 1]) << 1;
+    next[length] = code;
+  }
+  for (size_t i = 0; i < count; i++) {
+    unsigned length = lengths[i];
+    if (!length) {
+      continue;
+    }
+    unsigned value = next[length]++;
+    unsigned reversed = 0;
+    for (unsigned bit = 0; bit < length; bit++) {
+      reversed |= ((value >> bit) & 1) << (length - 1 - bit);
+    }
+    codes[i] = (uint16_t)reversed;
+  }
+}
+
+// A literal, or a match when distance is not 0
+struct deflate_symbol {
+  uint16_t value;
+  uint16_t distance;
+};
+
+#define DEFLATE_WINDOW 32768
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_CHAIN 64
+#define DEFLATE_BLOCK_SYMBOLS (1 << 16)
+
+// Writes a block of symbols with Huffman codes built for it, or the fixed
+// codes when those come out smaller
+static void deflate_block(struct bit_writer* writer,
+    const struct deflate_symbol* symbols, size_t count, bool last)
+{
+  uint32_t litlen_freqs[286] = { 0 };
+  uint32_t distance_freqs[30] = { 0 };
+  for (size_t i = 0; i < count; i++) {
+    if (symbols[i].distance) {
+      litlen_freqs[257 + deflate_length_code(symbols[i].value)]++;
+      distance_freqs[deflate_distance_code(symbols[i].distance)]++;
+    } else {
+      litlen_freqs[symbols[i].value]++;
+    }
+  }
+  litlen_freqs[256] = 1;
+  unsigned char lengths[286 + 30];
+  huffman_lengths(litlen_freqs, 286, 15, lengths);
+  huffman_lengths(distance_freqs, 30, 15, lengths + 286);
+  size_t litlen_count = 286;
+  while (litlen_count > 257 && !lengths[litlen_count - 1]) {
+    litlen_count--;
+  }
+  size_t distance_count = 30;
+  while (distance_count > 1 && !lengths[286 + distance_count - 1]) {
+    distance_count--;
+  }
+  memmove(lengths + litlen_count, lengths + 286, distance_count);
+  // Run length encode the code lengths of both codes as one sequence
+  unsigned char runs[286 + 30];
+  unsigned char run_extra[286 + 30];
+  size_t run_count = 0;
+  uint32_t run_freqs[19] = { 0 };
+  size_t total = litlen_count + distance_count;
+  for (size_t i = 0; i < total;) {
+    size_t repeat = 1;
+    while (i + repeat < total && lengths[i + repeat] == lengths[i]) {
+      repeat++;
+    }
+    if (lengths[i] == 0 && repeat >= 3) {
+      repeat = repeat > 138 ? 138 : repeat;
+      runs[run_count] = repeat >= 11 ? 18 : 17;
+      run_extra[run_count] = (unsigned char)(repeat - (repeat >= 11 ? 11 : 3));
+    } else if (i > 0 && lengths[i] == lengths[i - 1] && repeat >= 3) {
+      repeat = repeat > 6 ? 6 : repeat;
+      runs[run_count] = 16;
+      run_extra[run_count] = (unsigned char)(repeat - 3);
+    } else {
+      repeat = 1;
+      runs[run_count] = lengths[i];
+    }
+    run_freqs[runs[run_count]]++;
+    run_count++;
+    i += repeat;
+  }
+  unsigned char run_lengths[19];
+  huffman_lengths(run_freqs, 19, 7, run_lengths);
+  size_t run_length_count = 19;
+  while (run_length_count > 4
+      && !run_lengths[deflate_code_length_order[run_length_count - 1]]) {
+    run_length_count--;
+  }
+
+  // Compare the size of both encodings of the block
+  static const unsigned char run_extra_bits[19] = { [16] = 2, [17] = 3,
+    [18] = 7 };
+  uint64_t dynamic_bits = 14 + 3 * run_length_count;
+  for (size_t i = 0; i < run_count; i++) {
+    dynamic_bits += run_lengths[runs[i]] + run_extra_bits[runs[i]];
+  }
+  uint64_t fixed_bits = 0;
+  for (int i = 0; i < 286; i++) {
+    unsigned fixed_length = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    unsigned extra = i > 256 ? deflate_length_extra[i - 257] : 0;
+    unsigned length = i < (int)litlen_count ? lengths[i] : 0;
+    fixed_bits += (uint64_t)litlen_freqs[i] * (fixed_length + extra);
+    dynamic_bits += (uint64_t)litlen_freqs[i] * (length + extra);
+  }
+  for (int i = 0; i < 30; i++) {
+    unsigned length = i < (int)distance_count ? lengths[litlen_count + i] : 0;
+    fixed_bits += (uint64_t)distance_freqs[i] * (5 + deflate_distance_extra[i]);
+    dynamic_bits
+        += (uint64_t)distance_freqs[i] * (length + deflate_distance_extra[i]);
+  }
+
+  unsigned char litlen_lengths[288];
+  unsigned char distance_lengths[30];
+  if (fixed_bits <= dynamic_bits) {
+    for (int i = 0; i < 288; i++) {
+      litlen_lengths[i] = i < 144 ? 8 : i < 256 ? 9 : i < 280 ? 7 : 8;
+    }
+    memset(distance_lengths, 5, sizeof(distance_lengths));
+    litlen_count = 288;
+    distance_count = 30;
+    put_bits(writer, last, 1);
+    put_bits(writer, 1, 2);
+  } else {
+    memcpy(litlen_lengths, lengths, litlen_count);
+    memcpy(distance_lengths, lengths + litlen_count, distance_count);
+    put_bits(writer, last, 1);
+    put_bits(writer, 2, 2);
+    put_bits(writer, (uint32_t)(litlen_count - 257), 5);
+    put_bits(writer, (uint32_t)(distance_count - 1), 5);
+    put_bits(writer, (uint32_t)(run_length_count - 4), 4);
+    for (size_t i = 0; i < run_length_count; i++) {
+      put_bits(writer, run_lengths[deflate_code_length_order[i]], 3);
+    }
+    uint16_t run_codes[19];
+    huffman_codes(run_lengths, 19, run_codes);
+    for (size_t i = 0; i < run_count; i++) {
+      put_bits(writer, run_codes[runs[i]], run_lengths[runs[i]]);
+      put_bits(writer, run_extra[i], run_extra_bits[runs[i]]);
+    }
+  }
+  uint16_t litlen_codes[288];
+  uint16_t distance_codes[30];
+  huffman_codes(litlen_lengths, litlen_count, litlen_codes);
+  huffman_codes(distance_lengths, distance_count, distance_codes);
+  for (size_t i = 0; i < count; i++) {
+    unsigned value = symbols[i].value;
+    if (!symbols[i].distance) {
+      put_bits(writer, litlen_codes[value], litlen_lengths[value]);
+      continue;
+    }
+    unsigned code = deflate_length_code(value);
+    put_bits(writer, litlen_codes[257 + code], litlen_lengths[257 + code]);
+    put_bits(writer, value - deflate_length_base[code],
+        deflate_length_extra[code]);
+    unsigned distance = symbols[i].distance;
+    code = deflate_distance_code(distance);
+    put_bits(writer, distance_codes[code], distance_lengths[code]);
+    put_bits(writer, distance - deflate_distance_base[code],
+        deflate_distance_extra[code]);
+  }
+  put_bits(writer, litlen_codes[256], litlen_lengths[256]);
+}
+
+// Compresses into a raw deflate stream, returning it and its size
+static unsigned char* deflate_compress(
+    const unsigned char* in, size_t size, size_t* compressed_size)
+{
+  size_t* head = malloc(sizeof(size_t) << DEFLATE_HASH_BITS);
+  size_t* chain = malloc(sizeof(size_t) * DEFLATE_WINDOW);
+  struct deflate_symbol* symbols
+      = malloc(sizeof(*symbols) * DEFLATE_BLOCK_SYMBOLS);
+  if (!head || !chain || !symbols) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  // Positions + 1 of the latest and earlier occurrences of 3 byte sequences
+  memset(head, 0, sizeof(size_t) << DEFLATE_HASH_BITS);
+  struct bit_writer writer = { NULL, 0, 0, 0, 0 };
+  size_t count = 0;
+  size_t ip = 0;
+  while (ip < size) {
+    size_t best_length = 0;
+    size_t best_distance = 0;
+    if (ip + 3 <= size) {
+      uint32_t hash
+          = ((uint32_t)in[ip] << 16 | (uint32_t)in[ip + 1] << 8 | in[ip + 2])
+              * 2654435761u
+          >> (32 - DEFLATE_HASH_BITS);
+      size_t max_length = size - ip < 258 ? size - ip : 258;
+      size_t candidate = head[hash];
+      for (int depth = 0; candidate && depth < DEFLATE_CHAIN; depth++) {
+        size_t ref = candidate - 1;
+        if (ip - ref > DEFLATE_WINDOW) {
+          break;
+        }
+        if (in[ref + best_length] == in[ip + best_length]) {
+          size_t length = 0;
+          while (length < max_length && in[ref + length] == in[ip + length]) {
+            length++;
+          }
+          if (length > best_length) {
+            best_length = length;
+            best_distance = ip - ref;
+            if (length == max_length) {
+              break;
+            }
+          }
+        }
+        size_t previous = chain[ref % DEFLATE_WINDOW];
+        if (previous >= candidate) {
+          break;
+        }
+        candidate = previous;
+      }
+      chain[ip % DEFLATE_WINDOW] = head[hash];
+      head[hash] = ip + 1;
+    }
+    if (best_length >= 3) {
+      symbols[count].value = (uint16_t)best_length;
+      symbols[count].distance = (uint16_t)best_distance;
+      // Record the positions skipped over by the match
+      for (size_t i = ip + 1; i < ip + best_length && i + 3 <= size; i++) {
+        uint32_t hash
+            = ((uint32_t)in[i] << 16 | (uint32_t)in[i + 1] << 8 | in[i + 2])
+                * 2654435761u
+            >> (32 - DEFLATE_HASH_BITS);
+        chain[i % DEFLATE_WINDOW] = head[hash];
+        head[hash] = i + 1;
+      }
+      ip += best_length;
+    } else {
+      symbols[count].value = in[ip];
+      symbols[count].distance = 0;
+      ip++;
+    }
+    if (++count == DEFLATE_BLOCK_SYMBOLS) {
+      deflate_block(&writer, symbols, count, ip == size);
+      count = 0;
+    }
+  }
+  if (count > 0 || size == 0) {
+    deflate_block(&writer, symbols, count, true);
+  }
+  // Flush the last partial byte
+  put_bits(&writer, 0, 7);
+  free(symbols);
+  free(chain);
+  free(head);
+  *compressed_size = writer.length;
+  return writer.data;
+}
+
+// Reads raw deflate streams, for zip archive members
+struct bit_reader {
+  const unsigned char* data;
+  size_t size;
+  size_t position;
+  uint64_t bits;
+  unsigned count;
+  bool error;
+};
+
+static unsigned get_bits(struct bit_reader* reader, unsigned bits)
+{
+  while (reader->count < bits) {
+    if (reader->position == reader->size) {
+      reader->error = true;
+      return 0;
+    }
+    reader->bits |= (uint64_t)reader->data[reader->position++] << reader->count;
+    reader->count += 8;
+  }
+  unsigned value = (unsigned)(reader->bits & ((1u << bits) - 1));
+  reader->bits >>= bits;
+  reader->count -= bits;
+  return value;
+}
+
+// Canonical Huffman code, decoded a bit at a time
+struct huffman_decoder {
+  uint16_t counts[16];
+  uint16_t symbols[288];
+};
+
+static bool huffman_decoder_init(struct huffman_decoder* decoder,
+    const unsigned char* lengths, size_t count)
+{
+  uint16_t offsets[16];
+  memset(decoder->counts, 0, sizeof(decoder->counts));
+  for (size_t i = 0; i < count; i++) {
+    decoder->counts[lengths[i]]++;
+  }
+  decoder->counts[0] = 0;
+  int left = 1;
+  offsets[1] = 0;
+  for (unsigned length = 1; length < 16; length++) {
+    left = (left << 1) - decoder->counts[length];
+    if (left < 0) {
+      return false;
+    }
+    if (length < 15) {
+      offsets[length + 1] = offsets[length] + decoder->counts[length];
+    }
+  }
+  for (size_t i = 0; i < count; i++) {
+    if (lengths[i]) {
+      decoder->symbols[offsets[lengths[i]]++] = (uint16_t)i;
+    }
+  }
+  return true;
+}
+
+static int huffman_decode(
+    struct bit_reader* reader, const struct huffman_decoder* decoder)
+{
+  int code = 0;
+  int first = 0;
+  int index = 0;
+  for (unsigned length = 1; length < 16 && !reader->error; length++) {
+    code |= (int)get_bits(reader, 1);
+    int count = decoder->counts[length];
+    if (code - count < first) {
+      return decoder->symbols[index + (code - first)];
+    }
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
+  }
+  reader->error = true;
+  return 0;
+}
+
+// Reads the code lengths of a dynamic block into `litlen` and `distance`
+static bool read_dynamic_codes(struct bit_reader* reader,
+    struct huffman_decoder* litlen, struct huffman_decoder* distance)
+{
+  unsigned litlen_count = get_bits(reader, 5) + 257;
+  unsigned distance_count = get_bits(reader, 5) + 1;
+  unsigned run_length_count = get_bits(reader, 4) + 4;
+  if (litlen_count > 286 || distance_count > 30) {
+    return false;
+  }
+  unsigned char lengths[286 + 30] = { 0 };
+  for (unsigned i = 0; i < run_length_count; i++) {
+    lengths[deflate_code_length_order[i]] = (unsigned char)get_bits(reader, 3);
+  }
+  struct huffman_decoder run_lengths;
+  if (!huffman_decoder_init(&run_lengths, lengths, 19)) {
+    return false;
+  }
+  unsigned total = litlen_count + distance_count;
+  for (unsigned i = 0; i < total && !reader->error;) {
+    int symbol = huffman_decode(reader, &run_lengths);
+    if (symbol < 16) {
+      lengths[i++] = (unsigned char)symbol;
+      continue;
+    }
+    unsigned char value = 0;
+    unsigned repeat;
+    if (symbol == 16) {
+      if (i == 0) {
+        return false;
+      }
+      value = lengths[i - 1];
+      repeat = 3 + get_bits(reader, 2);
+    } else if (symbol == 17) {
+      repeat = 3 + get_bits(reader, 3);
+    } else {
+      repeat = 11 + get_bits(reader, 7);
+    }
+    if (repeat > total - i) {
+      return false;
+    }
+    memset(lengths + i, value, repeat);
+    i += repeat;
+  }
+  return !reader->error
+      && huffman_decoder_init(litlen, lengths, litlen_count)
+      && huffman_decoder_init(distance, lengths + litlen_count, distance_count);
+}
+
+// Decompresses a raw deflate stream, returning whether it filled `out`
+// exactly
+static bool inflate_data(const unsigned char* in, size_t in_size,
+    unsigned char* out, size_t out_size)
+{
+  struct bit_reader reader = { in, in_size, 0, 0, 0, false };
+  struct huffman_decoder litlen;
+  struct huffman_decoder distance;
+  size_t o = 0;
+  bool last;
+  do {
+    last = get_bits(&reader, 1);
+    unsigned type = get_bits(&reader, 2);
+    if (type == 0) {
+      // Stored block, starting on a byte boundary
+      get_bits(&reader, reader.count & 7);
+      unsigned length = get_bits(&reader, 16);
+      unsigned check = get_bits(&reader, 16);
+      if (reader.error || length != (~check & 0xffff)
+          || length > out_size - o) {
+        return false;
+      }
+      for (; length > 0 && reader.count > 0; length--) {
+        out[o++] = (unsigned char)get_bits(&reader, 8);
+      }
+      if (length > reader.size - reader.position) {
+        return false;
+      }
+      memcpy(out + o, reader.data + reader.position, length);
+      reader.position += length;
+      o += length;
+      continue;
+    }
+    if (type == 1) {
+      unsigned char lengths[288];
+      memset(lengths, 8, 144);
+      memset(lengths + 144, 9, 112);
+      memset(lengths + 256, 7, 24);
+      memset(lengths + 280, 8, 8);
+      huffman_decoder_init(&litlen, lengths, 288);
+      memset(lengths, 5, 30);
+      huffman_decoder_init(&distance, lengths, 30);
+    } else if (type != 2 || !read_dynamic_codes(&reader, &litlen, &distance)) {
+      return false;
+    }
+    for (;;) {
+      int symbol = huffman_decode(&reader, &litlen);
+      if (reader.error) {
+        return false;
+      }
+      if (symbol < 256) {
+        if (o == out_size) {
+          return false;
+        }
+        out[o++] = (unsigned char)symbol;
+        continue;
+      }
+      if (symbol == 256) {
+        break;
+      }
+      symbol -= 257;
+      if (symbol >= 29) {
+        return false;
+      }
+      size_t length = deflate_length_base[symbol]
+          + get_bits(&reader, deflate_length_extra[symbol]);
+      symbol = huffman_decode(&reader, &distance);
+      if (symbol >= 30) {
+        return false;
+      }
+      size_t offset = deflate_distance_base[symbol]
+          + get_bits(&reader, deflate_distance_extra[symbol]);
+      if (reader.error || offset > o || length > out_size - o) {
+        return false;
+      }
+      for (; length > 0; length--, o++) {
+        out[o] = out[o - offset];
+      }
+    }
+  } while (!last);
+  return o == out_size;
+}
+
+// zstd is only available when embed is built against libzstd
+#define ZSTD_LEVEL 19
+
+// Compresses `size` bytes, returning the compressed data and its size
+static unsigned char* compress_data(enum compression compression,
+    const unsigned char* in, size_t size, size_t* compressed_size)
+{
+  unsigned char* out = NULL;
+  switch (compression) {
+  case COMPRESS_NONE:
+    break;
+  case COMPRESS_LZ4:
+    out = malloc(lz4_bound(size));
+    if (!out) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+    *compressed_size = lz4_compress(in, size, out);
+    break;
+  case COMPRESS_DEFLATE:
+    out = deflate_compress(in, size, compressed_size);
+    break;
+  case COMPRESS_ZSTD:
+#ifdef EMBED_HAVE_ZSTD
+    out = malloc(ZSTD_compressBound(size));
+    if (!out) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+    *compressed_size
+        = ZSTD_compress(out, ZSTD_compressBound(size), in, size, ZSTD_LEVEL);
+    if (ZSTD_isError(*compressed_size)) {
+      fprintf(stderr, "Could not compress: %s\n",
+          ZSTD_getErrorName(*compressed_size));
+      exit(1);
+    }
+#else
+    fprintf(stderr, "embed was built without zstd support\n");
+    exit(1);
+#endif
+    break;
+  }
+  return out;
+}
+
+// Gives back what a buffer has beyond `size` bytes and a terminator
+static unsigned char* trim_buffer(unsigned char* data, size_t size)
+{
+  unsigned char* trimmed = realloc(data, size + 1);
+  return trimmed ? trimmed : data;
+}
+
+// State zstd keeps at ZSTD_LEVEL, with room to spare
+#define ZSTD_STATE_MEMORY (128 << 20)
+
+// Memory compressing `size` bytes can take at most, for --max-memory: the
+// output buffer before it is trimmed and the compressor's tables
+static size_t compression_memory(enum compression compression, size_t size)
+{
+  switch (compression) {
+  case COMPRESS_NONE:
+    break;
+  case COMPRESS_LZ4:
+    return lz4_bound(size) + (sizeof(size_t) << LZ4_HASH_BITS);
+  case COMPRESS_DEFLATE:
+    // The output grows by doubling and codes take at most 9 bits a byte
+    return 2 * (size + size / 8 + 4096) + (sizeof(size_t) << DEFLATE_HASH_BITS)
+        + sizeof(size_t) * DEFLATE_WINDOW
+        + sizeof(struct deflate_symbol) * DEFLATE_BLOCK_SYMBOLS;
+  case COMPRESS_ZSTD:
+    return ZSTD_STATE_MEMORY + size + size / 128 + 4096;
+  }
+  return 0;
+}
+
+struct object_format;
+struct input_cache;
+
+// Phases of generating the output timed for --stats
+enum stats_phase {
+  PHASE_OPEN_INPUTS,
+  PHASE_LAYOUT,
+  PHASE_FILE_LIST,
+  PHASE_OBJECT,
+  PHASE_FILE_DATA,
+  PHASE_FILE_DATA_SIZES,
+  PHASE_DECOMPRESSION,
+  PHASE_FUNCTION,
+  PHASE_HEADER,
+  PHASE_COUNT,
+};
+
+static const char* phase_names[] = { "open_inputs", "compute_data_layout",
+  "generate_file_list", "generate_object", "generate_file_data",
+  "generate_file_data_sizes", "generate_decompression", "generate_function",
+  "header" };
+
+// What --stats reports, for each file and for each phase. Each file's
+// entries are only written by the task handling that file.
+struct stats {
+  size_t count;
+  size_t* input_bytes;
+  size_t* stored_bytes;
+  size_t* output_bytes;
+  unsigned char* compression;
+  bool* duplicate;
+  double* compress_seconds;
+  double* encode_seconds;
+  double phase_seconds[PHASE_COUNT];
+};
+
+// Settings shared by the generation steps
+struct options {
+  const char* function_name;
+  bool preserve_paths;
+  const struct data_format* format;
+  enum backend backend;
+  bool fallback;
+  enum lookup lookup;
+  enum layout layout;
+  const char* object_file;
+  const struct object_format* object_format;
+  // Pack file holding the data for the source to map at run time
+  const char* pack_file;
+  // Alignment of each file's data unless the file sets its own
+  size_t align;
+  // Compression of each file's data, which is only kept when it is at most
+  // `compress_threshold` percent of the file's size
+  enum compression compress;
+  unsigned compress_threshold;
+  // Size of the independently compressed blocks of files larger than it, so
+  // parts of them can be read alone, 0 to compress files whole
+  size_t block_size;
+  // Threads used to compress and encode files
+  unsigned jobs;
+  // Memory the work in flight may use, 0 for no limit, and what is held
+  // apart from it by output buffers and inputs read from pipes
+  size_t max_memory;
+  size_t reserved_memory;
+  // Sources the array data is split across, 0 to keep it in the main source
+  unsigned shards;
+  char** shard_files;
+  // Where timings and sizes are gathered, NULL unless they are reported
+  struct stats* stats;
+  // Whether the functions can serve files from a directory on disk
+  bool overlay;
+  // Whether each file's checksum is kept to verify what is retrieved
+  bool verify;
+  // Whether the header declares an index and accessor for every file
+  bool file_index;
+  // Section the data is placed in, NULL for the usual read only data
+  const char* section;
+  // Number of files with placement=hot, which come first
+  size_t hot_count;
+  // Inputs shared by the sets of --sets, NULL for a single set
+  struct input_cache* cache;
+};
+
+// Where the data of a file taken from a tar or zip archive is
+struct archive_member {
+  // The archive, NULL for other files
+  const struct input_data* archive;
+  size_t offset;
+  size_t size;
+  // Deflated zip members are inflated to `original_size` bytes
+  bool deflated;
+  size_t original_size;
+};
+
+// Settings given for a single input file, as in file.bin:align=4096
+struct file_options {
+  size_t align;
+  bool has_compress;
+  enum compression compress;
+  bool has_compress_threshold;
+  unsigned compress_threshold;
+  bool has_block_size;
+  size_t block_size;
+  enum placement placement;
+  // Path the file is read from when it is embedded under another name, which
+  // then takes its place in the file list
+  char* path;
+  // The name= option while the argument is parsed
+  const char* name;
+  struct archive_member member;
+};
+
+// Path file `i` is read from, - for stdin
+static const char* input_path(
+    char* const* files, const struct file_options* file_options, size_t i)
+{
+  return file_options[i].path ? file_options[i].path : files[i];
+}
+
+// Longest section name, the limit of Mach-O
+#define MAX_SECTION_NAME 16
+
+// Default alignment of each file's data, and the largest one allowed
+#define DATA_ALIGN 16
+#define MAX_DATA_ALIGN (1 << 20)
+
+static size_t align_up(size_t value, size_t align)
+{
+  return (value + align - 1) / align * align;
+}
+
+// Base 2 logarithm of a power of two
+static unsigned log2_size(size_t value)
+{
+  unsigned log = 0;
+  while (((size_t)1 << log) < value) {
+    log++;
+  }
+  return log;
+}
+
+// An input file's contents, mapped into memory where possible and otherwise
+// read into a buffer. Each file is opened once and its size is the size of
+// what was mapped, so the size tables always match the data.
+struct input_data {
+  const unsigned char* data;
+  size_t size;
+  bool mapped;
+  // Data inside an archive, which stays open as long as the inputs
+  bool borrowed;
+  // Entry of the input cache of --sets holding the file plus one, 0 for
+  // files not in it
+  size_t cache_entry;
+};
+
+static void input_too_large(const char* input_file)
+{
+  fprintf(stderr, "File is too large: '%s'\n", input_file);
+  exit(1);
+}
+
+static void input_read_error(const char* input_file)
+{
+  fprintf(stderr, "Could not read file: '%s'\n", input_file);
+  exit(1);
+}
+
+// Grows a read buffer to hold at least one more block
+static unsigned char* grow_read_buffer(
+    unsigned char* data, size_t length, size_t* capacity)
+{
+  if (length < *capacity) {
+    return data;
+  }
+  *capacity = *capacity * 2 + READ_BLOCK_SIZE;
+  data = realloc(data, *capacity);
+  if (!data) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  return data;
+}
+
+#ifdef _WIN32
+// Opens a file, or stdin for -, reading whatever can not be mapped
+static void open_input_file(const char* input_file, struct input_data* input)
+{
+  HANDLE file = 0 == strcmp(input_file, "-")
+      ? GetStdHandle(STD_INPUT_HANDLE)
+      : CreateFileA(input_file, GENERIC_READ, FILE_SHARE_READ, NULL,
+            OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+  if (file == INVALID_HANDLE_VALUE) {
+    fprintf(stderr, "Could not open file: '%s'\n", input_file);
+    exit(1);
+  }
+  input->data = NULL;
+  input->size = 0;
+  input->mapped = false;
+  input->borrowed = false;
+  LARGE_INTEGER size;
+  if (GetFileType(file) == FILE_TYPE_DISK && GetFileSizeEx(file, &size)) {
+    if ((unsigned long long)size.QuadPart > SIZE_MAX) {
+      input_too_large(input_file);
+    }
+    if (size.QuadPart == 0) {
+      CloseHandle(file);
+      return;
+    }
+    HANDLE mapping
+        = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mapping) {
+      input->data = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+      CloseHandle(mapping);
+    }
+    if (input->data) {
+      input->size = (size_t)size.QuadPart;
+      input->mapped = true;
+      CloseHandle(file);
+      return;
+    }
+  }
+  // Pipes and anything else that can not be mapped is read to its end
+  size_t capacity = 0;
+  unsigned char* data = NULL;
+  for (;;) {
+    data = grow_read_buffer(data, input->size, &capacity);
+    size_t want = capacity - input->size;
+    DWORD read;
+    if (!ReadFile(file, data + input->size,
+            want > (1u << 30) ? (1u << 30) : (DWORD)want, &read, NULL)) {
+      if (GetLastError() == ERROR_BROKEN_PIPE) {
+        break;
+      }
+      input_read_error(input_file);
+    }
+    if (read == 0) {
+      break;
+    }
+    input->size += read;
+  }
+  input->data = data;
+  CloseHandle(file);
+}
+
+static void close_input_file(struct input_data* input)
+{
+  if (input->borrowed) {
+    input->borrowed = false;
+  } else if (input->mapped) {
+    UnmapViewOfFile((void*)input->data);
+  } else {
+    free((void*)input->data);
+  }
+  input->data = NULL;
+}
+#else
+// Opens a file, or stdin for -, reading whatever can not be mapped
+static void open_input_file(const char* input_file, struct input_data* input)
+{
+  int fd = 0 == strcmp(input_file, "-") ? dup(STDIN_FILENO)
+                                        : open(input_file, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open file: '%s'\n", input_file);
+    exit(1);
+  }
+  input->data = NULL;
+  input->size = 0;
+  input->mapped = false;
+  input->borrowed = false;
+  struct stat info;
+  if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode)) {
+    if ((uintmax_t)info.st_size > SIZE_MAX) {
+      input_too_large(input_file);
+    }
+    if (info.st_size == 0) {
+      close(fd);
+      return;
+    }
+    void* data
+        = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+      madvise(data, (size_t)info.st_size, MADV_SEQUENTIAL);
+#endif
+      input->data = data;
+      input->size = (size_t)info.st_size;
+      input->mapped = true;
+      close(fd);
+      return;
+    }
+  }
+  // Pipes and anything else that can not be mapped is read to its end
+  size_t capacity = 0;
+  unsigned char* data = NULL;
+  for (;;) {
+    data = grow_read_buffer(data, input->size, &capacity);
+    ssize_t result = read(fd, data + input->size, capacity - input->size);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    }
+    if (result < 0) {
+      input_read_error(input_file);
+    }
+    if (result == 0) {
+      break;
+    }
+    input->size += (size_t)result;
+  }
+  input->data = data;
+  close(fd);
+}
+
+static void close_input_file(struct input_data* input)
+{
+  if (input->borrowed) {
+    input->borrowed = false;
+  } else if (input->mapped) {
+    munmap((void*)input->data, input->size);
+  } else {
+    free((void*)input->data);
+  }
+  input->data = NULL;
+}
+#endif
+
+// 64 bit xxHash (XXH64) of file contents
+#define XXH_PRIME64_1 0x9E3779B185EBCA87ULL
+#define XXH_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define XXH_PRIME64_3 0x165667B19E3779F9ULL
+#define XXH_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define XXH_PRIME64_5 0x27D4EB2F165667C5ULL
+
+static uint64_t rotate_left64(uint64_t value, unsigned bits)
+{
+  return value << bits | value >> (64 - bits);
+}
+
+static uint64_t load_le64(const unsigned char* p)
+{
+  uint64_t value = 0;
+  for (int i = 7; i >= 0; i--) {
+    value = value << 8 | p[i];
+  }
+  return value;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input)
+{
+  acc += input * XXH_PRIME64_2;
+  return rotate_left64(acc, 31) * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t value)
+{
+  acc ^= xxh64_round(0, value);
+  return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+static uint64_t xxh64(const unsigned char* data, size_t size, uint64_t seed)
+{
+  const unsigned char* end = data + size;
+  uint64_t h;
+  if (size >= 32) {
+    uint64_t v1 = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    uint64_t v2 = seed + XXH_PRIME64_2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - XXH_PRIME64_1;
+    for (; end - data >= 32; data += 32) {
+      v1 = xxh64_round(v1, load_le64(data));
+      v2 = xxh64_round(v2, load_le64(data + 8));
+      v3 = xxh64_round(v3, load_le64(data + 16));
+      v4 = xxh64_round(v4, load_le64(data + 24));
+    }
+    h = rotate_left64(v1, 1) + rotate_left64(v2, 7) + rotate_left64(v3, 12)
+        + rotate_left64(v4, 18);
+    h = xxh64_merge(h, v1);
+    h = xxh64_merge(h, v2);
+    h = xxh64_merge(h, v3);
+    h = xxh64_merge(h, v4);
+  } else {
+    h = seed + XXH_PRIME64_5;
+  }
+  h += size;
+  for (; end - data >= 8; data += 8) {
+    h ^= xxh64_round(0, load_le64(data));
+    h = rotate_left64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+  }
+  if (end - data >= 4) {
+    uint64_t word = (uint64_t)data[0] | (uint64_t)data[1] << 8
+        | (uint64_t)data[2] << 16 | (uint64_t)data[3] << 24;
+    h ^= word * XXH_PRIME64_1;
+    h = rotate_left64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+    data += 4;
+  }
+  for (; data < end; data++) {
+    h ^= *data * XXH_PRIME64_5;
+    h = rotate_left64(h, 11) * XXH_PRIME64_1;
+  }
+  h ^= h >> 33;
+  h *= XXH_PRIME64_2;
+  h ^= h >> 29;
+  h *= XXH_PRIME64_3;
+  h ^= h >> 32;
+  return h;
+}
+
+// CRC32C (Castagnoli) of file contents for --verify, eight bytes at a time
+// with a table for each byte position
+#define CRC32C_POLYNOMIAL 0x82F63B78
+static uint32_t crc32c_table[8][256];
+
+static void init_crc32c_table(void)
+{
+  for (uint32_t i = 0; i < 256; i++) {
+    uint32_t crc = i;
+    for (int bit = 0; bit < 8; bit++) {
+      crc = crc >> 1 ^ (crc & 1 ? CRC32C_POLYNOMIAL : 0);
+    }
+    crc32c_table[0][i] = crc;
+  }
+  for (int t = 1; t < 8; t++) {
+    for (int i = 0; i < 256; i++) {
+      uint32_t crc = crc32c_table[t - 1][i];
+      crc32c_table[t][i] = crc >> 8 ^ crc32c_table[0][crc & 0xFF];
+    }
+  }
+}
+
+static uint32_t crc32c(const unsigned char* data, size_t size)
+{
+  uint32_t crc = 0xFFFFFFFF;
+  for (; size >= 8; data += 8, size -= 8) {
+    uint32_t low = crc ^ ((uint32_t)data[0] | (uint32_t)data[1] << 8
+                     | (uint32_t)data[2] << 16 | (uint32_t)data[3] << 24);
+    crc = crc32c_table[7][low & 0xFF] ^ crc32c_table[6][(low >> 8) & 0xFF]
+        ^ crc32c_table[5][(low >> 16) & 0xFF] ^ crc32c_table[4][low >> 24]
+        ^ crc32c_table[3][data[4]] ^ crc32c_table[2][data[5]]
+        ^ crc32c_table[1][data[6]] ^ crc32c_table[0][data[7]];
+  }
+  for (; size > 0; data++, size--) {
+    crc = crc >> 8 ^ crc32c_table[0][(crc ^ *data) & 0xFF];
+  }
+  return ~crc;
+}
+
+// Work split into `count` independent tasks, handed out in order to threads
+struct parallel_work {
+  void (*task)(void* context, size_t index);
+  void* context;
+  size_t count;
+  size_t next;
+#ifdef _WIN32
+  CRITICAL_SECTION lock;
+#else
+  pthread_mutex_t lock;
+#endif
+};
+
+static size_t parallel_next(struct parallel_work* work)
+{
+#ifdef _WIN32
+  EnterCriticalSection(&work->lock);
+  size_t index = work->next++;
+  LeaveCriticalSection(&work->lock);
+#else
+  pthread_mutex_lock(&work->lock);
+  size_t index = work->next++;
+  pthread_mutex_unlock(&work->lock);
+#endif
+  return index;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI parallel_worker(LPVOID arg)
+#else
+static void* parallel_worker(void* arg)
+#endif
+{
+  struct parallel_work* work = arg;
+  for (size_t index; (index = parallel_next(work)) < work->count;) {
+    work->task(work->context, index);
+  }
+  return 0;
+}
+
+// Runs `task` for every index below `count` on up to `jobs` threads
+static void run_parallel(size_t count, unsigned jobs,
+    void (*task)(void* context, size_t index), void* context)
+{
+  if (jobs > count) {
+    jobs = (unsigned)count;
+  }
+  if (jobs <= 1) {
+    for (size_t i = 0; i < count; i++) {
+      task(context, i);
+    }
+    return;
+  }
+  struct parallel_work work;
+  work.task = task;
+  work.context = context;
+  work.count = count;
+  work.next = 0;
+#ifdef _WIN32
+  InitializeCriticalSection(&work.lock);
+  HANDLE* threads = malloc(sizeof(HANDLE) * jobs);
+#else
+  pthread_mutex_init(&work.lock, NULL);
+  pthread_t* threads = malloc(sizeof(pthread_t) * jobs);
+#endif
+  if (!threads) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  // The calling thread works too
+  for (unsigned i = 1; i < jobs; i++) {
+#ifdef _WIN32
+    threads[i] = CreateThread(NULL, 0, parallel_worker, &work, 0, NULL);
+    if (!threads[i]) {
+#else
+    if (pthread_create(&threads[i], NULL, parallel_worker, &work) != 0) {
+#endif
+      fprintf(stderr, "Could not start thread\n");
+      exit(1);
+    }
+  }
+  parallel_worker(&work);
+  for (unsigned i = 1; i < jobs; i++) {
+#ifdef _WIN32
+    WaitForSingleObject(threads[i], INFINITE);
+    CloseHandle(threads[i]);
+#else
+    pthread_join(threads[i], NULL);
+#endif
+  }
+#ifdef _WIN32
+  DeleteCriticalSection(&work.lock);
+#else
+  pthread_mutex_destroy(&work.lock);
+#endif
+  free(threads);
+}
+
+struct budget_context {
+  void (*task)(void* context, size_t index);
+  void* context;
+  size_t first;
+};
+
+static void budget_task(void* data, size_t i)
+{
+  struct budget_context* budget = data;
+  budget->task(budget->context, budget->first + i);
+}
+
+static void memory_exceeded(size_t needed, const struct options* options)
+{
+  fprintf(stderr,
+      "--max-memory of %zu bytes is too small, at least %zu are needed\n",
+      options->max_memory, needed);
+  exit(1);
+}
+
+// Runs `task` for every index below `count` as run_parallel does, but with
+// --max-memory only starts together as many tasks as fit in the budget. Task
+// `i` needs `memory[i]` bytes once it starts and `held` returns what earlier
+// tasks kept.
+static void run_in_budget(size_t count, const size_t* memory,
+    size_t (*held)(void* context), const struct options* options,
+    void (*task)(void* context, size_t index), void* context)
+{
+  if (!options->max_memory) {
+    run_parallel(count, options->jobs, task, context);
+    return;
+  }
+  struct budget_context budget = { task, context, 0 };
+  while (budget.first < count) {
+    size_t used = options->reserved_memory + held(context);
+    size_t end = budget.first + 1;
+    used += memory[budget.first];
+    if (used > options->max_memory) {
+      memory_exceeded(used, options);
+    }
+    while (end < count && used + memory[end] <= options->max_memory) {
+      used += memory[end++];
+    }
+    run_parallel(end - budget.first, options->jobs, budget_task, &budget);
+    budget.first = end;
+  }
+}
+
+// Number of processors available, for -j 0
+static unsigned processor_count(void)
+{
+#ifdef _WIN32
+  SYSTEM_INFO info;
+  GetSystemInfo(&info);
+  return info.dwNumberOfProcessors;
+#else
+  long count = sysconf(_SC_NPROCESSORS_ONLN);
+  return count > 0 ? (unsigned)count : 1;
+#endif
+}
+
+// Placement of every file's data, followed by a null terminator, in one
+// contiguous block. The block itself must be aligned to `align`, the largest
+// alignment of any file. Compressed files are stored as their compressed
+// payload, held in memory, and `sizes` are the sizes of what is stored.
+// Files stored as they are stay mapped in `inputs` until the layout is freed.
+// With shards each shard holds a contiguous run of files starting at
+// `shard_starts`, with offsets and its own block of `shard_sizes` bytes.
+struct data_layout {
+  size_t count;
+  struct input_data* inputs;
+  // File whose data each file uses, itself unless it is the same as an
+  // earlier file. Duplicates take no space and have the offset of that file.
+  size_t* data_index;
+  size_t shard_count;
+  size_t* shard_starts;
+  size_t* shard_sizes;
+  // Size of the shard's block once each file is placed, for finding the
+  // files in a range of it
+  size_t* ends;
+  size_t* sizes;
+  size_t* offsets;
+  size_t* aligns;
+  size_t align;
+  size_t size;
+  size_t* original_sizes;
+  enum compression* compression;
+  unsigned char** payloads;
+  // Size of the blocks of block compressed files, 0 for others, and where
+  // each block starts in the payload with the payload's size at the end
+  size_t* block_sizes;
+  size_t** block_offsets;
+  size_t compressed_count;
+  // Largest size of any file before compression
+  size_t original_size;
+  // CRC32C of each file's contents with --verify, NULL without
+  uint32_t* checksums;
+  // Symbol in the source of --shared-data holding each file's data plus
+  // one, 0 for data in the set's own source, NULL without --shared-data
+  size_t* shared;
+};
+
+// With --sets the sets share their inputs: each file is opened once and
+// kept open until every set is written, and what compressing it gave is kept
+// so later sets asking for the same compression do not compress it again
+struct cached_payload {
+  enum compression compression;
+  unsigned threshold;
+  // What was stored, the file as it is when it did not shrink enough
+  enum compression result;
+  unsigned char* payload;
+  size_t size;
+};
+
+// With --shared-data a first pass over the sets counts the sets storing
+// each file's data the same way, and data stored by more than one set is
+// written once into the shared source for their sources to refer to
+struct shared_payload {
+  // How the data is stored, whatever compression was asked for
+  enum compression compression;
+  const struct data_format* format;
+  // Largest alignment any of the sets asks for
+  size_t align;
+  size_t set_count;
+  // Symbol in the shared source plus one, 0 for data kept in its set
+  size_t symbol;
+};
+
+struct cached_input {
+  char* path;
+  struct input_data input;
+  struct cached_payload* payloads;
+  size_t payload_count;
+  struct shared_payload* shared;
+  size_t shared_count;
+};
+
+// Entries are found by path through an open addressing table of their
+// index plus one
+struct input_cache {
+  struct cached_input* entries;
+  size_t count;
+  size_t* slots;
+  size_t mask;
+  // Source from --shared-data, NULL when every set keeps its own data, and
+  // the prefix of its symbols
+  const char* shared_file;
+  char* shared_prefix;
+  // Whether the sets are only laid out to find the data they share
+  bool planning;
+  // Hash of the shared source, which each set's manifest depends on
+  uint64_t shared_hash;
+};
+
+// Slot holding `path`, or the empty slot where it would go
+static size_t input_cache_slot(const struct input_cache* cache, const char* path)
+{
+  size_t slot = (size_t)xxh64((const unsigned char*)path, strlen(path), 0)
+      & cache->mask;
+  for (; cache->slots[slot]; slot = (slot + 1) & cache->mask) {
+    if (0 == strcmp(cache->entries[cache->slots[slot] - 1].path, path)) {
+      break;
+    }
+  }
+  return slot;
+}
+
+// Takes ownership of an opened input, returning its entry plus one
+static size_t input_cache_add(
+    struct input_cache* cache, const char* path, struct input_data* input)
+{
+  // Kept at most half full, growing both arrays together
+  if ((cache->count + 1) * 2 > cache->mask + 1) {
+    size_t size = (cache->mask + 1) * 2;
+    size_t* slots = calloc(size, sizeof(size_t));
+    struct cached_input* entries
+        = realloc(cache->entries, sizeof(*entries) * size / 2);
+    if (!slots || !entries) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+    free(cache->slots);
+    cache->slots = slots;
+    cache->entries = entries;
+    cache->mask = size - 1;
+    for (size_t i = 0; i < cache->count; i++) {
+      cache->slots[input_cache_slot(cache, cache->entries[i].path)] = i + 1;
+    }
+  }
+  struct cached_input* entry = &cache->entries[cache->count];
+  entry->path = malloc(strlen(path) + 1);
+  if (!entry->path) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  strcpy(entry->path, path);
+  entry->input = *input;
+  entry->payloads = NULL;
+  entry->payload_count = 0;
+  entry->shared = NULL;
+  entry->shared_count = 0;
+  cache->slots[input_cache_slot(cache, path)] = ++cache->count;
+  input->cache_entry = cache->count;
+  return cache->count;
+}
+
+static void init_input_cache(struct input_cache* cache)
+{
+  cache->count = 0;
+  cache->shared_file = NULL;
+  cache->shared_prefix = NULL;
+  cache->planning = false;
+  cache->shared_hash = 0;
+  cache->mask = 15;
+  cache->slots = calloc(cache->mask + 1, sizeof(size_t));
+  cache->entries = malloc(sizeof(struct cached_input) * (cache->mask + 1) / 2);
+  if (!cache->slots || !cache->entries) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+}
+
+static void free_input_cache(struct input_cache* cache)
+{
+  for (size_t i = 0; i < cache->count; i++) {
+    struct cached_input* entry = &cache->entries[i];
+    if (entry->input.data) {
+      close_input_file(&entry->input);
+    }
+    for (size_t p = 0; p < entry->payload_count; p++) {
+      free(entry->payloads[p].payload);
+    }
+    free(entry->payloads);
+    free(entry->shared);
+    free(entry->path);
+  }
+  free(cache->entries);
+  free(cache->slots);
+  free(cache->shared_prefix);
+}
+
+// What compressing a cached input gave an earlier set, NULL if it was not
+// compressed that way
+static const struct cached_payload* find_cached_payload(
+    const struct options* options, const struct input_data* input,
+    enum compression compression, unsigned threshold)
+{
+  if (!options->cache || !input->cache_entry) {
+    return NULL;
+  }
+  const struct cached_input* entry
+      = &options->cache->entries[input->cache_entry - 1];
+  for (size_t p = 0; p < entry->payload_count; p++) {
+    if (entry->payloads[p].compression == compression
+        && entry->payloads[p].threshold == threshold) {
+      return &entry->payloads[p];
+    }
+  }
+  return NULL;
+}
+
+struct layout_context {
+  struct data_layout* layout;
+  const struct file_options* file_options;
+  const struct options* options;
+};
+
+// Measures a file, and compresses it when asked to
+static enum compression file_compression(const struct file_options* file,
+    const struct options* options)
+{
+  return file->has_compress ? file->compress : options->compress;
+}
+
+static unsigned file_compress_threshold(
+    const struct file_options* file, const struct options* options)
+{
+  return file->has_compress_threshold ? file->compress_threshold
+                                      : options->compress_threshold;
+}
+
+static size_t file_block_size(
+    const struct file_options* file, const struct options* options)
+{
+  return file->has_block_size ? file->block_size : options->block_size;
+}
+
+static void layout_file(void* data, size_t i)
+{
+  struct layout_context* context = data;
+  struct data_layout* layout = context->layout;
+  const struct file_options* file_options = context->file_options;
+  const struct options* options = context->options;
+  enum compression compression = file_compression(&file_options[i], options);
+  unsigned threshold = file_compress_threshold(&file_options[i], options);
+  layout->aligns[i]
+      = file_options[i].align ? file_options[i].align : options->align;
+  layout->compression[i] = COMPRESS_NONE;
+  layout->block_sizes[i] = 0;
+  struct input_data* input = &layout->inputs[i];
+  size_t size = input->size;
+  layout->sizes[i] = size;
+  layout->original_sizes[i] = size;
+  // Taken before compression lets go of the contents, duplicates take the
+  // checksum of the file they duplicate
+  if (layout->checksums && layout->data_index[i] == i) {
+    layout->checksums[i] = crc32c(input->data, size);
+  }
+  // Duplicates take what is stored from the file they duplicate
+  if (compression == COMPRESS_NONE || layout->data_index[i] != i) {
+    return;
+  }
+  // Blocks are compressed once every file is measured, so the blocks of a
+  // large file are spread across threads
+  size_t block_size = file_block_size(&file_options[i], options);
+  if (block_size && size > block_size) {
+    layout->block_sizes[i] = block_size;
+    return;
+  }
+  // An earlier set of --sets already compressed the file this way
+  const struct cached_payload* cached
+      = find_cached_payload(options, input, compression, threshold);
+  if (cached) {
+    if (cached->result != COMPRESS_NONE) {
+      unsigned char* payload = malloc(cached->size ? cached->size : 1);
+      if (!payload) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+      }
+      memcpy(payload, cached->payload, cached->size);
+      layout->sizes[i] = cached->size;
+      layout->compression[i] = cached->result;
+      layout->payloads[i] = payload;
+      close_input_file(input);
+    }
+    return;
+  }
+  size_t compressed_size = 0;
+  double start = clock_seconds();
+  unsigned char* compressed
+      = compress_data(compression, input->data, size, &compressed_size);
+  if (options->stats) {
+    options->stats->compress_seconds[i] = clock_seconds() - start;
+  }
+  // Files that do not shrink enough are stored as they are
+  if ((double)compressed_size * 100 <= (double)size * threshold) {
+    layout->sizes[i] = compressed_size;
+    layout->compression[i] = compression;
+    layout->payloads[i] = trim_buffer(compressed, compressed_size);
+    close_input_file(input);
+  } else {
+    free(compressed);
+  }
+}
+
+// Memory compressing a file whole takes, none for files stored as they are
+// or compressed in blocks
+static size_t layout_file_memory(const struct data_layout* layout,
+    const struct file_options* file_options, const struct options* options,
+    size_t i)
+{
+  size_t size = layout->inputs[i].size;
+  size_t block_size = file_block_size(&file_options[i], options);
+  if (layout->data_index[i] != i || (block_size && size > block_size)) {
+    return 0;
+  }
+  return compression_memory(file_compression(&file_options[i], options), size);
+}
+
+// Compressed data the layout keeps
+static size_t layout_held_memory(const struct data_layout* layout)
+{
+  size_t held = 0;
+  for (size_t i = 0; i < layout->count; i++) {
+    if (layout->payloads[i]) {
+      held += layout->sizes[i] + 1;
+    }
+  }
+  return held;
+}
+
+static size_t layout_held(void* data)
+{
+  return layout_held_memory(((struct layout_context*)data)->layout);
+}
+
+// A block of a file to compress and what it compressed to
+struct block_task {
+  size_t file;
+  size_t offset;
+  size_t size;
+  unsigned char* compressed;
+  size_t compressed_size;
+  double seconds;
+};
+
+struct block_context {
+  struct data_layout* layout;
+  struct block_task* tasks;
+  size_t task_count;
+  const struct file_options* file_options;
+  const struct options* options;
+};
+
+static void compress_block_task(void* data, size_t i)
+{
+  struct block_context* context = data;
+  struct block_task* task = &context->tasks[i];
+  enum compression compression = file_compression(
+      &context->file_options[task->file], context->options);
+  double start = clock_seconds();
+  unsigned char* compressed = compress_data(compression,
+      context->layout->inputs[task->file].data + task->offset, task->size,
+      &task->compressed_size);
+  task->compressed = trim_buffer(compressed, task->compressed_size);
+  task->seconds = clock_seconds() - start;
+}
+
+// Compressed data the layout and the finished blocks keep
+static size_t block_held(void* data)
+{
+  struct block_context* context = data;
+  size_t held = layout_held_memory(context->layout);
+  for (size_t i = 0; i < context->task_count; i++) {
+    if (context->tasks[i].compressed) {
+      held += context->tasks[i].compressed_size + 1;
+    }
+  }
+  return held;
+}
+
+// Compresses the files split into blocks, which are only kept as blocks
+// when they shrink as much as a whole file must
+static void compress_blocks(struct data_layout* layout,
+    const struct file_options* file_options, const struct options* options)
+{
+  size_t task_count = 0;
+  for (size_t i = 0; i < layout->count; i++) {
+    if (layout->block_sizes[i]) {
+      task_count += (layout->sizes[i] + layout->block_sizes[i] - 1)
+          / layout->block_sizes[i];
+    }
+  }
+  if (!task_count) {
+    return;
+  }
+  struct block_task* tasks = calloc(task_count, sizeof(struct block_task));
+  size_t* memory = malloc(sizeof(size_t) * task_count);
+  if (!tasks || !memory) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  size_t task = 0;
+  for (size_t i = 0; i < layout->count; i++) {
+    for (size_t offset = 0; layout->block_sizes[i] && offset < layout->sizes[i];
+         offset += layout->block_sizes[i]) {
+      tasks[task].file = i;
+      tasks[task].offset = offset;
+      tasks[task].size = layout->sizes[i] - offset < layout->block_sizes[i]
+          ? layout->sizes[i] - offset
+          : layout->block_sizes[i];
+      memory[task] = compression_memory(
+          file_compression(&file_options[i], options), tasks[task].size);
+      task++;
+    }
+  }
+  struct block_context context
+      = { layout, tasks, task_count, file_options, options };
+  run_in_budget(task_count, memory, block_held, options, compress_block_task,
+      &context);
+  free(memory);
+  for (size_t first = 0; first < task_count;) {
+    size_t i = tasks[first].file;
+    size_t end = first;
+    size_t compressed_size = 0;
+    for (; end < task_count && tasks[end].file == i; end++) {
+      compressed_size += tasks[end].compressed_size;
+      if (options->stats) {
+        options->stats->compress_seconds[i] += tasks[end].seconds;
+      }
+    }
+    size_t size = layout->sizes[i];
+    unsigned threshold = file_compress_threshold(&file_options[i], options);
+    if ((double)compressed_size * 100 <= (double)size * threshold) {
+      // The first block grows into the payload and the others are moved
+      // onto its end, so the blocks are not held twice
+      unsigned char* payload
+          = realloc(tasks[first].compressed, compressed_size + 1);
+      size_t* offsets = malloc(sizeof(size_t) * (end - first + 1));
+      if (!payload || !offsets) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+      }
+      tasks[first].compressed = NULL;
+      offsets[0] = 0;
+      size_t offset = tasks[first].compressed_size;
+      for (size_t t = first + 1; t < end; t++) {
+        offsets[t - first] = offset;
+        memcpy(payload + offset, tasks[t].compressed,
+            tasks[t].compressed_size);
+        offset += tasks[t].compressed_size;
+        free(tasks[t].compressed);
+        tasks[t].compressed = NULL;
+      }
+      offsets[end - first] = offset;
+      layout->sizes[i] = compressed_size;
+      layout->compression[i] = file_compression(&file_options[i], options);
+      layout->payloads[i] = payload;
+      layout->block_offsets[i] = offsets;
+      close_input_file(&layout->inputs[i]);
+    } else {
+      layout->block_sizes[i] = 0;
+    }
+    for (size_t t = first; t < end; t++) {
+      free(tasks[t].compressed);
+    }
+    first = end;
+  }
+  free(tasks);
+}
+
+// Bytes a file adds to the data with its null terminator, none for duplicates
+static size_t stored_size(const struct data_layout* layout, size_t index)
+{
+  return layout->data_index[index] == index ? layout->sizes[index] + 1 : 0;
+}
+
+// Data stored for a file, its compressed payload or its contents
+static const unsigned char* stored_data(
+    const struct data_layout* layout, size_t index)
+{
+  index = layout->data_index[index];
+  if (layout->payloads[index]) {
+    return layout->payloads[index];
+  }
+  return layout->inputs[index].data;
+}
+
+// A file that has the same size as another, so it may have the same contents
+struct duplicate_candidate {
+  size_t size;
+  uint64_t hash;
+  size_t index;
+};
+
+static int compare_candidate_sizes(const void* a, const void* b)
+{
+  const struct duplicate_candidate* left = a;
+  const struct duplicate_candidate* right = b;
+  if (left->size != right->size) {
+    return left->size < right->size ? -1 : 1;
+  }
+  return left->index < right->index ? -1 : left->index > right->index;
+}
+
+static int compare_candidates(const void* a, const void* b)
+{
+  const struct duplicate_candidate* left = a;
+  const struct duplicate_candidate* right = b;
+  if (left->size != right->size) {
+    return left->size < right->size ? -1 : 1;
+  }
+  if (left->hash != right->hash) {
+    return left->hash < right->hash ? -1 : 1;
+  }
+  return left->index < right->index ? -1 : left->index > right->index;
+}
+
+struct duplicate_context {
+  const struct input_data* inputs;
+  struct duplicate_candidate* candidates;
+};
+
+static void hash_candidate(void* data, size_t i)
+{
+  struct duplicate_context* context = data;
+  const struct input_data* input
+      = &context->inputs[context->candidates[i].index];
+  context->candidates[i].hash = xxh64(input->data, input->size, 0);
+}
+
+// Points every file with the same contents and compression settings as an
+// earlier file at that file's data. Only files sharing their size are hashed,
+// and equal hashes are confirmed by comparing the contents.
+static void find_duplicates(struct data_layout* layout,
+    const struct file_options* file_options, const struct options* options)
+{
+  size_t count = layout->count;
+  for (size_t i = 0; i < count; i++) {
+    layout->data_index[i] = i;
+  }
+  struct duplicate_candidate* candidates
+      = malloc(sizeof(*candidates) * (count + 1));
+  if (!candidates) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < count; i++) {
+    candidates[i].size = layout->inputs[i].size;
+    candidates[i].hash = 0;
+    candidates[i].index = i;
+  }
+  qsort(candidates, count, sizeof(*candidates), compare_candidate_sizes);
+  size_t candidate_count = 0;
+  for (size_t i = 0; i < count; i++) {
+    if ((i > 0 && candidates[i - 1].size == candidates[i].size)
+        || (i + 1 < count && candidates[i + 1].size == candidates[i].size)) {
+      candidates[candidate_count++] = candidates[i];
+    }
+  }
+  struct duplicate_context context = { layout->inputs, candidates };
+  run_parallel(candidate_count, options->jobs, hash_candidate, &context);
+  qsort(candidates, candidate_count, sizeof(*candidates), compare_candidates);
+  for (size_t run = 0; run < candidate_count;) {
+    size_t end = run + 1;
+    while (end < candidate_count && candidates[end].size == candidates[run].size
+        && candidates[end].hash == candidates[run].hash) {
+      end++;
+    }
+    // Runs are in file order, each file is compared with the earlier files
+    // that kept their own data
+    for (size_t i = run + 1; i < end; i++) {
+      size_t file = candidates[i].index;
+      const struct file_options* settings = &file_options[file];
+      for (size_t j = run; j < i; j++) {
+        size_t other = candidates[j].index;
+        if (layout->data_index[other] != other
+            || file_compression(settings, options)
+                != file_compression(&file_options[other], options)
+            || file_compress_threshold(settings, options)
+                != file_compress_threshold(&file_options[other], options)
+            || file_block_size(settings, options)
+                != file_block_size(&file_options[other], options)) {
+          continue;
+        }
+        if (candidates[i].size == 0
+            || 0 == memcmp(layout->inputs[file].data,
+                       layout->inputs[other].data, candidates[i].size)) {
+          layout->data_index[file] = other;
+          break;
+        }
+      }
+    }
+    run = end;
+  }
+  free(candidates);
+  for (size_t i = 0; i < count; i++) {
+    if (layout->data_index[i] != i) {
+      close_input_file(&layout->inputs[i]);
+    }
+  }
+}
+
+struct open_context {
+  char* const* files;
+  const struct file_options* file_options;
+  struct input_data* inputs;
+};
+
+// Opens a member of an archive, which is used in place unless it has to be
+// inflated
+static void open_archive_member(const char* name,
+    const struct archive_member* member, struct input_data* input)
+{
+  const unsigned char* data = member->archive->data + member->offset;
+  input->mapped = false;
+  input->borrowed = !member->deflated;
+  if (!member->deflated) {
+    input->data = data;
+    input->size = member->size;
+    return;
+  }
+  unsigned char* inflated = malloc(member->original_size + 1);
+  if (!inflated) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  if (!inflate_data(data, member->size, inflated, member->original_size)) {
+    fprintf(stderr, "Could not inflate archive member '%s'\n", name);
+    exit(1);
+  }
+  input->data = inflated;
+  input->size = member->original_size;
+}
+
+static void open_input_task(void* data, size_t i)
+{
+  struct open_context* context = data;
+  const struct archive_member* member = &context->file_options[i].member;
+  if (member->archive) {
+    open_archive_member(context->files[i], member, &context->inputs[i]);
+    return;
+  }
+  // Opened by an earlier set
+  if (context->inputs[i].cache_entry) {
+    return;
+  }
+  open_input_file(
+      input_path(context->files, context->file_options, i),
+      &context->inputs[i]);
+}
+
+// Opens every input file, in parallel since mapping, reading pipes and
+// inflating archive members can wait on the disk or take a while
+static struct input_data* open_input_files(char* const* files,
+    const struct file_options* file_options, const struct options* options)
+{
+  size_t count = 0;
+  while (files[count]) {
+    count++;
+  }
+  struct input_data* inputs = calloc(count + 1, sizeof(struct input_data));
+  if (!inputs) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  struct input_cache* cache = options->cache;
+  if (cache) {
+    for (size_t i = 0; i < count; i++) {
+      if (!file_options[i].member.archive) {
+        size_t slot
+            = input_cache_slot(cache, input_path(files, file_options, i));
+        inputs[i].cache_entry = cache->slots[slot];
+      }
+    }
+  }
+  struct open_context context = { files, file_options, inputs };
+  run_parallel(count, options->jobs, open_input_task, &context);
+  if (!cache) {
+    return inputs;
+  }
+  // The cache owns every file outside archives, which the set borrows. A
+  // file given twice in the set was opened twice, the second is let go.
+  for (size_t i = 0; i < count; i++) {
+    if (file_options[i].member.archive) {
+      continue;
+    }
+    size_t entry = inputs[i].cache_entry;
+    if (!entry) {
+      const char* path = input_path(files, file_options, i);
+      entry = cache->slots[input_cache_slot(cache, path)];
+      if (entry) {
+        close_input_file(&inputs[i]);
+      } else {
+        entry = input_cache_add(cache, path, &inputs[i]);
+      }
+    }
+    inputs[i] = cache->entries[entry - 1].input;
+    inputs[i].borrowed = true;
+    inputs[i].cache_entry = entry;
+  }
+  return inputs;
+}
+
+// Keeps what compressing each cached input whole gave, for later sets
+static void record_cached_payloads(const struct data_layout* layout,
+    const struct file_options* file_options, const struct options* options)
+{
+  if (!options->cache) {
+    return;
+  }
+  for (size_t i = 0; i < layout->count; i++) {
+    const struct input_data* input = &layout->inputs[i];
+    enum compression compression = file_compression(&file_options[i], options);
+    unsigned threshold = file_compress_threshold(&file_options[i], options);
+    if (!input->cache_entry || layout->data_index[i] != i
+        || compression == COMPRESS_NONE || layout->block_sizes[i]
+        || find_cached_payload(options, input, compression, threshold)) {
+      continue;
+    }
+    struct cached_input* entry
+        = &options->cache->entries[input->cache_entry - 1];
+    struct cached_payload* payloads = realloc(entry->payloads,
+        sizeof(struct cached_payload) * (entry->payload_count + 1));
+    if (!payloads) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+    entry->payloads = payloads;
+    struct cached_payload* cached = &payloads[entry->payload_count++];
+    cached->compression = compression;
+    cached->threshold = threshold;
+    cached->result = layout->compression[i];
+    cached->payload = NULL;
+    cached->size = 0;
+    if (cached->result != COMPRESS_NONE) {
+      cached->size = layout->sizes[i];
+      cached->payload = malloc(cached->size ? cached->size : 1);
+      if (!cached->payload) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+      }
+      memcpy(cached->payload, layout->payloads[i], cached->size);
+    }
+  }
+}
+
+// With --shared-data, counts the sets storing each file's data while
+// planning and otherwise finds the files whose data is in the shared source.
+// Only arrays of single files without a section can live in another source,
+// and block compressed files are not cached.
+static void share_data(
+    struct data_layout* layout, const struct options* options)
+{
+  struct input_cache* cache = options->cache;
+  if (!cache || !cache->shared_file || options->backend != BACKEND_ARRAY
+      || options->layout != LAYOUT_POINTERS || options->section) {
+    return;
+  }
+  if (!cache->planning) {
+    layout->shared = calloc(layout->count + 1, sizeof(size_t));
+    if (!layout->shared) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+  }
+  for (size_t i = 0; i < layout->count; i++) {
+    const struct input_data* input = &layout->inputs[i];
+    if (!input->cache_entry || layout->data_index[i] != i
+        || layout->block_sizes[i]) {
+      continue;
+    }
+    enum compression compression = layout->compression[i];
+    struct cached_input* entry = &cache->entries[input->cache_entry - 1];
+    struct shared_payload* shared = NULL;
+    for (size_t p = 0; p < entry->shared_count; p++) {
+      if (entry->shared[p].compression == compression
+          && entry->shared[p].format == options->format) {
+        shared = &entry->shared[p];
+        break;
+      }
+    }
+    if (!cache->planning) {
+      layout->shared[i] = shared ? shared->symbol : 0;
+      continue;
+    }
+    if (!shared) {
+      shared = realloc(entry->shared,
+          sizeof(struct shared_payload) * (entry->shared_count + 1));
+      if (!shared) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+      }
+      entry->shared = shared;
+      shared = &shared[entry->shared_count++];
+      shared->compression = compression;
+      shared->format = options->format;
+      shared->align = 1;
+      shared->set_count = 0;
+      shared->symbol = 0;
+    }
+    shared->set_count++;
+    if (layout->aligns[i] > shared->align) {
+      shared->align = layout->aligns[i];
+    }
+  }
+}
+
+// Lays out the opened `inputs`, which the layout takes ownership of
+static void compute_data_layout(struct data_layout* layout,
+    char* const* files, struct input_data* inputs,
+    const struct file_options* file_options, const struct options* options)
+{
+  layout->count = 0;
+  while (files[layout->count]) {
+    layout->count++;
+  }
+  layout->sizes = malloc(sizeof(size_t) * (layout->count + 1));
+  layout->offsets = malloc(sizeof(size_t) * (layout->count + 1));
+  layout->aligns = malloc(sizeof(size_t) * (layout->count + 1));
+  layout->original_sizes = malloc(sizeof(size_t) * (layout->count + 1));
+  layout->compression
+      = malloc(sizeof(enum compression) * (layout->count + 1));
+  layout->payloads = calloc(layout->count + 1, sizeof(unsigned char*));
+  layout->block_sizes = malloc(sizeof(size_t) * (layout->count + 1));
+  layout->block_offsets = calloc(layout->count + 1, sizeof(size_t*));
+  layout->inputs = inputs;
+  layout->data_index = malloc(sizeof(size_t) * (layout->count + 1));
+  layout->ends = malloc(sizeof(size_t) * (layout->count + 1));
+  layout->checksums = NULL;
+  layout->shared = NULL;
+  if (options->verify) {
+    layout->checksums = malloc(sizeof(uint32_t) * (layout->count + 1));
+    if (!layout->checksums) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+  }
+  layout->shard_count = options->shards ? options->shards : 1;
+  layout->shard_starts = malloc(sizeof(size_t) * (layout->shard_count + 1));
+  layout->shard_sizes = malloc(sizeof(size_t) * layout->shard_count);
+  if (!layout->sizes || !layout->offsets || !layout->aligns
+      || !layout->original_sizes || !layout->compression || !layout->payloads
+      || !layout->shard_starts || !layout->shard_sizes || !layout->data_index
+      || !layout->ends || !layout->block_sizes || !layout->block_offsets) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  find_duplicates(layout, file_options, options);
+  // Files are measured and compressed in parallel, then placed in order
+  struct layout_context context = { layout, file_options, options };
+  size_t* memory = malloc(sizeof(size_t) * (layout->count + 1));
+  if (!memory) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < layout->count; i++) {
+    memory[i] = layout_file_memory(layout, file_options, options, i);
+  }
+  run_in_budget(
+      layout->count, memory, layout_held, options, layout_file, &context);
+  free(memory);
+  compress_blocks(layout, file_options, options);
+  record_cached_payloads(layout, file_options, options);
+  for (size_t i = 0; i < layout->count; i++) {
+    size_t data = layout->data_index[i];
+    if (data != i) {
+      layout->sizes[i] = layout->sizes[data];
+      layout->compression[i] = layout->compression[data];
+      layout->block_sizes[i] = layout->block_sizes[data];
+      if (layout->checksums) {
+        layout->checksums[i] = layout->checksums[data];
+      }
+      if (layout->aligns[i] > layout->aligns[data]) {
+        layout->aligns[data] = layout->aligns[i];
+      }
+    }
+  }
+  share_data(layout, options);
+  // Shards get runs of files of about the same stored size, what is left
+  // after a large file is spread over the remaining shards
+  size_t left = 0;
+  for (size_t i = 0; i < layout->count; i++) {
+    left += stored_size(layout, i);
+  }
+  size_t shard = 0;
+  size_t share = left / layout->shard_count;
+  size_t placed = 0;
+  layout->shard_starts[0] = 0;
+  for (size_t i = 0; i < layout->count; i++) {
+    if (shard + 1 < layout->shard_count && placed > 0 && placed >= share) {
+      layout->shard_starts[++shard] = i;
+      share = left / (layout->shard_count - shard);
+      placed = 0;
+    }
+    placed += stored_size(layout, i);
+    left -= stored_size(layout, i);
+  }
+  while (shard < layout->shard_count) {
+    layout->shard_starts[++shard] = layout->count;
+  }
+  layout->size = 0;
+  layout->align = 1;
+  layout->compressed_count = 0;
+  layout->original_size = 0;
+  for (shard = 0; shard < layout->shard_count; shard++) {
+    size_t size = 0;
+    for (size_t i = layout->shard_starts[shard];
+         i < layout->shard_starts[shard + 1]; i++) {
+      size_t align = layout->aligns[i];
+      if (layout->compression[i] != COMPRESS_NONE) {
+        layout->compressed_count++;
+      }
+      if (layout->original_sizes[i] > layout->original_size) {
+        layout->original_size = layout->original_sizes[i];
+      }
+      if (layout->data_index[i] != i) {
+        layout->offsets[i] = layout->offsets[layout->data_index[i]];
+      } else {
+        layout->offsets[i] = align_up(size, align);
+        size = layout->offsets[i] + layout->sizes[i] + 1;
+      }
+      layout->ends[i] = size;
+      if (align > layout->align) {
+        layout->align = align;
+      }
+    }
+    layout->shard_sizes[shard] = size;
+    if (size > layout->size) {
+      layout->size = size;
+    }
+  }
+}
+
+// Shard holding a file's data
+static size_t file_shard(const struct data_layout* layout, size_t index)
+{
+  size_t shard = 0;
+  while (layout->shard_starts[shard + 1] <= index) {
+    shard++;
+  }
+  return shard;
+}
+
+static void free_data_layout(struct data_layout* layout)
+{
+  free(layout->sizes);
+  free(layout->offsets);
+  free(layout->aligns);
+  free(layout->original_sizes);
+  free(layout->compression);
+  for (size_t i = 0; i < layout->count; i++) {
+    free(layout->payloads[i]);
+    free(layout->block_offsets[i]);
+    if (layout->inputs[i].data) {
+      close_input_file(&layout->inputs[i]);
+    }
+  }
+  free(layout->payloads);
+  free(layout->block_sizes);
+  free(layout->block_offsets);
+  free(layout->inputs);
+  free(layout->shard_starts);
+  free(layout->shard_sizes);
+  free(layout->data_index);
+  free(layout->ends);
+  free(layout->checksums);
+  free(layout->shared);
+}
+
+// Type of offset and size tables able to index `size` bytes
+static const char* offset_type(size_t size)
+{
+  return size > UINT32_MAX ? "uint64_t" : "uint32_t";
+}
+
+static const char* align_macro
+    = "#ifndef EMBED_ALIGNED\n"
+      "#if defined(_MSC_VER)\n"
+      "#define EMBED_ALIGNED(n) __declspec(align(n))\n"
+      "#elif defined(__GNUC__) || defined(__clang__)\n"
+      "#define EMBED_ALIGNED(n) __attribute__((aligned(n)))\n"
+      "#else\n"
+      "#define EMBED_ALIGNED(n) _Alignas(n)\n"
+      "#endif\n"
+      "#endif\n";
+
+// Places the data of every file in the section from --section, with the
+// segment Mach-O needs and the pragma MSVC needs to allocate in it
+static void output_section_macro(
+    struct output_buffer* out, const struct options* options)
+{
+  if (!options->section) {
+    return;
+  }
+  const char* section = options->section;
+  char text[1024];
+  snprintf(text, sizeof(text),
+      "#ifndef EMBED_SECTION\n"
+      "#if defined(_MSC_VER)\n"
+      "#pragma section(\"%s\", read)\n"
+      "#define EMBED_SECTION __declspec(allocate(\"%s\"))\n"
+      "#elif defined(__APPLE__)\n"
+      "#define EMBED_SECTION __attribute__((section(\"__TEXT,%s\")))\n"
+      "#elif defined(__GNUC__) || defined(__clang__)\n"
+      "#define EMBED_SECTION __attribute__((section(\"%s\")))\n"
+      "#else\n"
+      "#define EMBED_SECTION\n"
+      "#endif\n"
+      "#endif\n",
+      section, section, section, section);
+  output_buffer_puts(out, text);
+}
+
+// Encodes a stream of bytes as one object in a data format. Bytes are
+// gathered into whole lines, so the output does not depend on how the stream
+// is split up.
+struct data_encoder {
+  struct output_buffer* out;
+  const struct data_format* format;
+  unsigned char line[MAX_LINE_BYTES];
+  size_t fill;
+  size_t offset;
+};
+
+static void encoder_init(struct data_encoder* encoder,
+    struct output_buffer* out, const struct data_format* format)
+{
+  encoder->out = out;
+  encoder->format = format;
+  encoder->fill = 0;
+  encoder->offset = 0;
+}
+
+static void encoder_push(
+    struct data_encoder* encoder, const unsigned char* data, size_t size)
+{
+  size_t line_bytes = encoder->format->line_bytes;
+  if (encoder->fill > 0) {
+    size_t take = line_bytes - encoder->fill;
+    take = take < size ? take : size;
+    memcpy(encoder->line + encoder->fill, data, take);
+    encoder->fill += take;
+    data += take;
+    size -= take;
+    if (encoder->fill < line_bytes) {
+      return;
+    }
+    output_data(encoder->out, encoder->format, encoder->line, line_bytes,
+        encoder->offset);
+    encoder->offset += line_bytes;
+    encoder->fill = 0;
+  }
+  // Whole lines are encoded straight from the input
+  size_t whole = size / line_bytes * line_bytes;
+  output_data(encoder->out, encoder->format, data, whole, encoder->offset);
+  encoder->offset += whole;
+  memcpy(encoder->line, data + whole, size - whole);
+  encoder->fill = size - whole;
+}
+
+// Writes out the last partial line and closes the object
+static void encoder_end(struct data_encoder* encoder)
+{
+  output_data(encoder->out, encoder->format, encoder->line, encoder->fill,
+      encoder->offset);
+  encoder->offset += encoder->fill;
+  encoder->fill = 0;
+  output_buffer_puts(encoder->out, encoder->format->end(encoder->offset));
+}
+
+// Opens an array holding data in the given format, static unless it is
+// shared between sources, and in the section from --section when `placed`
+static void output_array_begin(struct output_buffer* out,
+    const struct data_format* format, const char* name, size_t align,
+    bool shared, bool placed)
+{
+  char line[128];
+  if (placed) {
+    output_buffer_puts(out, "EMBED_SECTION ");
+  }
+  if (align > 1) {
+    snprintf(line, sizeof(line), "EMBED_ALIGNED(%zu) ", align);
+    output_buffer_puts(out, line);
+  }
+  format = array_format(format);
+  snprintf(line, sizeof(line), "%sconst %s ", shared ? "" : "static ",
+      format->type);
+  output_buffer_puts(out, line);
+  output_buffer_puts(out, name);
+  output_buffer_puts(out, "[]");
+  output_buffer_puts(out, format->dimension);
+  output_buffer_puts(out, " = ");
+  output_buffer_puts(out, format->array_begin);
+}
+
+static void generate_file_list(
+    FILE* fd, char* const* files, const struct options* options)
+{
+  const struct data_format* format = options->format;
+  bool preserve_paths = options->preserve_paths;
+  struct output_buffer out;
+  output_buffer_init(&out, fd);
+  struct data_encoder encoder;
+  if (options->layout == LAYOUT_BLOB) {
+    // Names are packed one after the other with their null terminators
+    output_array_begin(&out, format, "EMBEDDED_NAME_BLOB", 1, false, false);
+    encoder_init(&encoder, &out, array_format(format));
+    for (size_t file_count = 0; files[file_count]; file_count++) {
+      const char* name = file_name(files[file_count], preserve_paths);
+      encoder_push(&encoder, (const unsigned char*)name, strlen(name) + 1);
+    }
+    encoder_end(&encoder);
+    output_buffer_puts(&out, ";\n\n");
+    size_t offset = 0;
+    output_buffer_puts(
+        &out, "static const uint32_t EMBEDDED_FILE_NAME_OFFSETS[] = {");
+    for (size_t file_count = 0; files[file_count]; file_count++) {
+      const char* name = file_name(files[file_count], preserve_paths);
+      char line[64];
+      snprintf(line, sizeof(line), "%s%zu,",
+          (file_count % 16) == 0 ? "\n\t" : "", offset);
+      output_buffer_puts(&out, line);
+      offset += strlen(name) + 1;
+      if (offset > UINT32_MAX) {
+        fprintf(stderr, "File names are too long\n");
+        exit(1);
+      }
+    }
+    output_buffer_puts(&out,
+        "\n};\n\n"
+        "#define EMBEDDED_NAME(i) \\\n"
+        "  ((const char*)EMBEDDED_NAME_BLOB + EMBEDDED_FILE_NAME_OFFSETS[i])"
+        "\n\n");
+  } else {
+    output_buffer_puts(
+        &out, "static const char* EMBEDDED_FILE_NAMES[] = {\n");
+    for (size_t file_count = 0; files[file_count]; file_count++) {
+      const char* name = file_name(files[file_count], preserve_paths);
+      output_buffer_puts(&out, "\t/* ");
+      output_buffer_puts(&out, name);
+      output_buffer_puts(&out, " */\n\t");
+      output_buffer_puts(&out, format->begin);
+      encoder_init(&encoder, &out, format);
+      encoder_push(&encoder, (const unsigned char*)name, strlen(name));
+      encoder_end(&encoder);
+      output_buffer_puts(&out, ",\n");
+    }
+    output_buffer_puts(&out, "\t(char[]){0}\n");
+    output_buffer_puts(&out, "\n};\n\n");
+    output_buffer_puts(
+        &out, "#define EMBEDDED_NAME(i) (EMBEDDED_FILE_NAMES[i])\n\n");
+  }
+  output_buffer_puts(
+      &out, "static const size_t EMBEDDED_FILE_NAME_LENGTHS[] = {");
+  for (size_t file_count = 0; files[file_count]; file_count++) {
+    char line[32];
+    snprintf(line, sizeof(line), "%s%zu,",
+        (file_count % 16) == 0 ? "\n\t" : "",
+        strlen(file_name(files[file_count], preserve_paths)));
+    output_buffer_puts(&out, line);
+  }
+  output_buffer_puts(&out, "\n};\n\n");
+  output_buffer_free(&out);
+}
+
+// Toolchains that understand GNU style top level assembly with .incbin
+#define INCBIN_CONDITION \
+  "(defined(__GNUC__) || defined(__clang__)) && !defined(_MSC_VER)"
+
+// Format of the macros, taking the Mach-O, COFF and ELF sections
+static const char* incbin_macros
+    = "#ifndef EMBED_INCBIN\n"
+      "#define EMBED_STR_(x) #x\n"
+      "#define EMBED_STR(x) EMBED_STR_(x)\n"
+      "#define EMBED_SYMBOL(name) EMBED_STR(__USER_LABEL_PREFIX__) #name\n"
+      "#if defined(__APPLE__)\n"
+      "#define EMBED_INCBIN_SECTION \"%s\\n\"\n"
+      "#define EMBED_INCBIN_VISIBILITY \".private_extern \"\n"
+      "#define EMBED_INCBIN_END \".text\\n\"\n"
+      "#elif defined(_WIN32) || defined(__CYGWIN__)\n"
+      "#define EMBED_INCBIN_SECTION \".section %s,\\\"dr\\\"\\n\"\n"
+      "#define EMBED_INCBIN_VISIBILITY \".globl \"\n"
+      "#define EMBED_INCBIN_END \".text\\n\"\n"
+      "#else\n"
+      "#define EMBED_INCBIN_SECTION \".pushsection %s%s\\n\"\n"
+      "#define EMBED_INCBIN_VISIBILITY \".hidden \"\n"
+      "#define EMBED_INCBIN_END \".popsection\\n\"\n"
+      "#endif\n"
+      "#define EMBED_INCBIN_LABEL(name, align) \\\n"
+      "  \".globl \" EMBED_SYMBOL(name) \"\\n\" \\\n"
+      "  EMBED_INCBIN_VISIBILITY EMBED_SYMBOL(name) \"\\n\" \\\n"
+      "  \".balign \" #align \"\\n\" \\\n"
+      "  EMBED_SYMBOL(name) \":\\n\"\n"
+      "#define EMBED_INCBIN(name, path, align) \\\n"
+      "  __asm__(EMBED_INCBIN_SECTION \\\n"
+      "      EMBED_INCBIN_LABEL(name, align) \\\n"
+      "      \".incbin \\\"\" path \"\\\"\\n\" \\\n"
+      "      \".byte 0\\n\" \\\n"
+      "      EMBED_INCBIN_END); \\\n"
+      "  extern const char name[]\n"
+      "#endif\n";
+
+// Returns a copy of `text` escaped for use inside a C string literal
+static char* c_string_escape(const char* text)
+{
+  char* escaped = malloc(strlen(text) * 2 + 1);
+  if (!escaped) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  char* o = escaped;
+  for (const char* c = text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      *o++ = '\\';
+    }
+    *o++ = *c;
+  }
+  *o = '\0';
+  return escaped;
+}
+
+// Paths handed to the compiler are made absolute, as they would otherwise be
+// resolved relative to the generated source or the compiler's directory
+static char* absolute_path(const char* path)
+{
+#ifdef _WIN32
+  char* absolute = _fullpath(NULL, path, 0);
+#else
+  char* absolute = realpath(path, NULL);
+#endif
+  if (!absolute) {
+    fprintf(stderr, "Could not open file: '%s'\n", path);
+    exit(1);
+  }
+  return absolute;
+}
+
+// Input bytes encoded by one task, a piece of a file's data in the pointers
+// layout or of the whole blob. Pieces are split on line boundaries.
+#define ENCODE_UNIT_SIZE (256 << 10)
+
+struct encode_unit {
+  // File, or shard in the blob layout
+  size_t file;
+  size_t offset;
+  size_t size;
+  // Whether the unit closes its object, which is `total` bytes
+  bool last;
+  size_t total;
+  struct output_buffer text;
+  double seconds;
+};
+
+struct encode_context {
+  char* const* files;
+  const struct options* options;
+  const struct data_layout* layout;
+  struct encode_unit* units;
+};
+
+// First file of a shard whose data ends after `offset` in the shard's blob
+static size_t first_file_ending_after(
+    const struct data_layout* layout, size_t shard, size_t offset)
+{
+  size_t low = layout->shard_starts[shard];
+  size_t high = layout->shard_starts[shard + 1];
+  while (low < high) {
+    size_t mid = low + (high - low) / 2;
+    if (layout->ends[mid] <= offset) {
+      low = mid + 1;
+    } else {
+      high = mid;
+    }
+  }
+  return low;
+}
+
+// Counts an encoded unit's time and text towards its file, or in the blob
+// layout towards the files whose data it holds by how much of it they hold
+static void record_unit_stats(struct stats* stats,
+    const struct data_layout* layout, bool blob,
+    const struct encode_unit* unit)
+{
+  if (!blob) {
+    stats->encode_seconds[unit->file] += unit->seconds;
+    stats->output_bytes[unit->file] += unit->text.length;
+    return;
+  }
+  size_t last = layout->shard_starts[unit->file + 1];
+  size_t end = unit->offset + unit->size;
+  for (size_t i = first_file_ending_after(layout, unit->file, unit->offset);
+       i < last && unit->size; i++) {
+    if (layout->data_index[i] != i) {
+      continue;
+    }
+    if (layout->offsets[i] >= end) {
+      break;
+    }
+    size_t begin
+        = layout->offsets[i] > unit->offset ? layout->offsets[i] : unit->offset;
+    size_t file_end = layout->offsets[i] + layout->sizes[i] + 1;
+    file_end = file_end < end ? file_end : end;
+    if (begin < file_end) {
+      double share = (double)(file_end - begin) / (double)unit->size;
+      stats->encode_seconds[i] += unit->seconds * share;
+      stats->output_bytes[i] += (size_t)((double)unit->text.length * share);
+    }
+  }
+}
+
+// Gathers the bytes of a range of a shard's blob, the files' data with the
+// padding and null terminators between them
+static void read_blob_data(const struct data_layout* layout, size_t shard,
+    size_t offset, unsigned char* data, size_t size)
+{
+  memset(data, 0, size);
+  size_t last = layout->shard_starts[shard + 1];
+  for (size_t i = first_file_ending_after(layout, shard, offset); i < last;
+       i++) {
+    // Duplicates may have the offset of a file in another shard
+    if (layout->data_index[i] != i) {
+      continue;
+    }
+    if (layout->offsets[i] >= offset + size) {
+      break;
+    }
+    size_t begin = layout->offsets[i] > offset ? layout->offsets[i] : offset;
+    size_t end = layout->offsets[i] + layout->sizes[i];
+    end = end < offset + size ? end : offset + size;
+    if (begin < end) {
+      memcpy(data + (begin - offset),
+          stored_data(layout, i) + (begin - layout->offsets[i]), end - begin);
+    }
+  }
+}
+
+static void encode_unit(void* data, size_t index)
+{
+  struct encode_context* context = data;
+  struct encode_unit* unit = &context->units[index];
+  const struct data_format* format = array_format(context->options->format);
+  double start = clock_seconds();
+  output_buffer_init(&unit->text, NULL);
+  if (context->options->layout == LAYOUT_BLOB) {
+    unsigned char* block = malloc(unit->size + 1);
+    if (!block) {
+      fprintf(stderr, "Could not allocate read buffer\n");
+      exit(1);
+    }
+    read_blob_data(
+        context->layout, unit->file, unit->offset, block, unit->size);
+    output_data(&unit->text, format, block, unit->size, unit->offset);
+    free(block);
+  } else if (unit->size > 0) {
+    output_data(&unit->text, format,
+        stored_data(context->layout, unit->file) + unit->offset, unit->size,
+        unit->offset);
+  }
+  if (unit->last) {
+    output_buffer_puts(&unit->text, format->end(unit->total));
+  }
+  unit->seconds = clock_seconds() - start;
+}
+
+// Name of the array holding a file's data, or a shard's blob in the blob
+// layout. Arrays in shards are shared with the main source.
+static void array_name(char* name, size_t size, const struct options* options,
+    size_t index)
+{
+  bool blob = options->layout == LAYOUT_BLOB;
+  if (options->shards) {
+    snprintf(name, size, blob ? "%s_blob_%zu" : "%s_data_%zu",
+        options->function_name, index);
+  } else if (blob) {
+    snprintf(name, size, "EMBEDDED_DATA_BLOB");
+  } else {
+    snprintf(name, size, "EMBEDDED_FILE_DATA_%zu", index);
+  }
+}
+
+// Name of the array holding a file's data in the pointers layout, which is
+// in the source of --shared-data when other sets store the same data
+static void file_array_name(char* name, size_t size,
+    const struct options* options, const struct data_layout* layout,
+    size_t index)
+{
+  if (layout->shared && layout->shared[index]) {
+    snprintf(name, size, "%s_%zu", options->cache->shared_prefix,
+        layout->shared[index] - 1);
+  } else {
+    array_name(name, size, options, index);
+  }
+}
+
+// Whether a file's array is defined in the set's own sources
+static bool own_array(const struct data_layout* layout, size_t index)
+{
+  return layout->data_index[index] == index
+      && !(layout->shared && layout->shared[index]);
+}
+
+static void output_array_declaration(struct output_buffer* out,
+    const struct data_format* format, const char* name)
+{
+  format = array_format(format);
+  output_buffer_puts(out, "extern const ");
+  output_buffer_puts(out, format->type);
+  output_buffer_puts(out, " ");
+  output_buffer_puts(out, name);
+  output_buffer_puts(out, "[]");
+  output_buffer_puts(out, format->dimension);
+  output_buffer_puts(out, ";\n");
+}
+
+// Encodes the data of every file as arrays, into `shard_outs` when the data
+// is sharded. Pieces of the data are encoded in parallel a batch at a time
+// and written in order, so the output does not depend on the number of jobs.
+static void generate_array_data(struct output_buffer* out,
+    struct output_buffer* shard_outs, char* const* files,
+    const struct options* options, const struct data_layout* layout)
+{
+  const struct data_format* format = array_format(options->format);
+  size_t unit_size = ENCODE_UNIT_SIZE / format->line_bytes * format->line_bytes;
+  size_t batch_size = (size_t)options->jobs * 4;
+  bool blob = options->layout == LAYOUT_BLOB;
+  if (options->max_memory) {
+    // A piece's text may grow to twice its longest encoding, and pieces of
+    // the blob gather their bytes first
+    size_t unit_memory = 2
+            * (unit_size / format->line_bytes * format->max_line_length + 64)
+        + (blob ? unit_size : 0);
+    size_t used = options->reserved_memory + layout_held_memory(layout);
+    if (used + unit_memory > options->max_memory) {
+      memory_exceeded(used + unit_memory, options);
+    }
+    size_t fits = (options->max_memory - used) / unit_memory;
+    batch_size = fits < batch_size ? fits : batch_size;
+  }
+  struct encode_unit* units = malloc(sizeof(*units) * batch_size);
+  if (!units) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  struct encode_context context = { files, options, layout, units };
+  // Every shard's data is a single object in the blob layout
+  size_t object_count = blob ? layout->shard_count : layout->count;
+  char name[strlen(options->function_name)
+      + (layout->shared ? strlen(options->cache->shared_prefix) : 0) + 64];
+  if (shard_outs) {
+    // Declared first so the arrays are not internal when compiled as C++
+    for (size_t i = 0; i < object_count; i++) {
+      if (!blob && !own_array(layout, i)) {
+        continue;
+      }
+      array_name(name, sizeof(name), options, i);
+      output_array_declaration(
+          &shard_outs[blob ? i : file_shard(layout, i)], format, name);
+    }
+  }
+  size_t object = 0;
+  size_t offset = 0;
+  while (object < object_count) {
+    size_t count = 0;
+    while (count < batch_size && object < object_count) {
+      // Duplicates use the array of the file they duplicate
+      if (!blob && !own_array(layout, object)) {
+        object++;
+        continue;
+      }
+      size_t total = blob ? layout->shard_sizes[object] : layout->sizes[object];
+      struct encode_unit* unit = &units[count++];
+      unit->file = object;
+      unit->offset = offset;
+      unit->size = total - offset < unit_size ? total - offset : unit_size;
+      unit->total = total;
+      offset += unit->size;
+      unit->last = offset == total;
+      if (unit->last) {
+        object++;
+        offset = 0;
+      }
+    }
+    run_parallel(count, options->jobs, encode_unit, &context);
+    for (size_t i = 0; i < count; i++) {
+      struct encode_unit* unit = &units[i];
+      struct output_buffer* target = out;
+      if (shard_outs) {
+        size_t shard = blob ? unit->file : file_shard(layout, unit->file);
+        target = &shard_outs[shard];
+      }
+      if (unit->offset == 0) {
+        if (!blob) {
+          // A named array for each file, compound literals can not be aligned
+          output_buffer_puts(target, "/* ");
+          output_buffer_puts(target, files[unit->file]);
+          output_buffer_puts(target, " */\n");
+        }
+        array_name(name, sizeof(name), options, unit->file);
+        output_array_begin(target, format, name,
+            blob ? layout->align : layout->aligns[unit->file],
+            shard_outs != NULL, options->section != NULL);
+      }
+      output_buffer_write(target, unit->text.data, unit->text.length);
+      if (options->stats) {
+        record_unit_stats(options->stats, layout, blob, unit);
+      }
+      free(unit->text.data);
+      if (unit->last) {
+        output_buffer_puts(target, ";\n");
+      }
+    }
+  }
+  free(units);
+  if (shard_outs) {
+    output_buffer_puts(out, "\n");
+    for (size_t i = 0; i < object_count; i++) {
+      if (!blob && !own_array(layout, i)) {
+        continue;
+      }
+      array_name(name, sizeof(name), options, i);
+      output_array_declaration(out, format, name);
+    }
+  }
+  for (size_t i = 0; layout->shared && i < layout->count; i++) {
+    if (layout->data_index[i] == i && layout->shared[i]) {
+      file_array_name(name, sizeof(name), options, layout, i);
+      output_array_declaration(out, format, name);
+    }
+  }
+  if (blob && shard_outs) {
+    output_buffer_puts(out, "\nstatic const char* EMBEDDED_SHARD_DATA[] = {\n");
+    for (size_t i = 0; i < layout->shard_count; i++) {
+      array_name(name, sizeof(name), options, i);
+      output_buffer_puts(out, "\t(const char*)");
+      output_buffer_puts(out, name);
+      output_buffer_puts(out, ",\n");
+    }
+    output_buffer_puts(
+        out, "};\n\nstatic const uint16_t EMBEDDED_FILE_SHARDS[] = {");
+    for (size_t i = 0; i < layout->count; i++) {
+      snprintf(name, sizeof(name), "%s%zu,", (i % 16) == 0 ? "\n\t" : "",
+          file_shard(layout, layout->data_index[i]));
+      output_buffer_puts(out, name);
+    }
+    output_buffer_puts(out, "\n};\n\n");
+  } else if (blob) {
+    output_buffer_puts(out,
+        "#define EMBEDDED_DATA_BASE ((const char*)EMBEDDED_DATA_BLOB)\n\n");
+  } else {
+    output_buffer_puts(out, "\nstatic const char* EMBEDDED_FILE_DATA[] = {\n");
+    for (size_t i = 0; i < layout->count; i++) {
+      file_array_name(
+          name, sizeof(name), options, layout, layout->data_index[i]);
+      output_buffer_puts(out, "\t(const char*)");
+      output_buffer_puts(out, name);
+      output_buffer_puts(out, ",\n");
+    }
+    output_buffer_puts(out, "};\n\n");
+  }
+}
+
+// Checks that the compiler can be handed every file's path, before any output
+// is written. #embed can not take a path with a quote and neither it nor
+// .incbin one with a line break.
+static bool check_backend_paths(
+    char* const* files, const struct options* options)
+{
+  if (options->backend != BACKEND_EMBED
+      && options->backend != BACKEND_INCBIN) {
+    return true;
+  }
+  const char* rejected = options->backend == BACKEND_EMBED ? "\"\n" : "\n";
+  for (size_t i = 0; files[i]; i++) {
+    char* path = absolute_path(files[i]);
+    bool valid = !strpbrk(path, rejected);
+    if (!valid) {
+      fprintf(stderr, "Can not %s file with path '%s'\n",
+          options->backend == BACKEND_EMBED ? "#embed" : ".incbin", path);
+    }
+    free(path);
+    if (!valid) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void generate_embed_data(struct output_buffer* out, char* const* files,
+    const struct options* options, const struct data_layout* layout)
+{
+  char line[128];
+  const char* placed = options->section ? "EMBED_SECTION " : "";
+  if (options->layout == LAYOUT_BLOB) {
+    snprintf(line, sizeof(line),
+        "%sEMBED_ALIGNED(%zu) static const unsigned char "
+        "EMBEDDED_DATA_BLOB[] = {\n",
+        placed, layout->align);
+    output_buffer_puts(out, line);
+  }
+  for (size_t file_count = 0; files[file_count]; file_count++) {
+    if (layout->data_index[file_count] != file_count) {
+      continue;
+    }
+    char* path = absolute_path(files[file_count]);
+    if (options->layout == LAYOUT_BLOB) {
+      output_buffer_puts(out, "\t/* ");
+      output_buffer_puts(out, files[file_count]);
+      output_buffer_puts(out, " */\n");
+    } else {
+      output_buffer_puts(out, "/* ");
+      output_buffer_puts(out, files[file_count]);
+      output_buffer_puts(out, " */\n");
+      snprintf(line, sizeof(line),
+          "%sEMBED_ALIGNED(%zu) static const unsigned char "
+          "EMBEDDED_FILE_DATA_%zu[] = {\n",
+          placed, layout->aligns[file_count], file_count);
+      output_buffer_puts(out, line);
+    }
+    output_buffer_puts(out, "#embed \"");
+    output_buffer_puts(out, path);
+    output_buffer_puts(out, "\" suffix(,)\n\t0,");
+    if (options->layout == LAYOUT_BLOB) {
+      // Pad up to where the next file starts
+      size_t end = layout->offsets[file_count] + layout->sizes[file_count] + 1;
+      size_t next = file_count + 1;
+      while (next < layout->count && layout->data_index[next] != next) {
+        next++;
+      }
+      size_t next_offset = next < layout->count ? layout->offsets[next] : end;
+      for (size_t i = end; i < next_offset; i++) {
+        output_buffer_puts(out, "0,");
+      }
+      output_buffer_puts(out, "\n");
+    } else {
+      output_buffer_puts(out, "};\n");
+    }
+    free(path);
+  }
+  if (options->layout == LAYOUT_BLOB) {
+    output_buffer_puts(out,
+        "};\n"
+        "#define EMBEDDED_DATA_BASE ((const char*)EMBEDDED_DATA_BLOB)\n");
+  } else {
+    output_buffer_puts(out, "static const char* EMBEDDED_FILE_DATA[] = {\n");
+    for (size_t i = 0; i < layout->count; i++) {
+      snprintf(line, sizeof(line), "\t(const char*)EMBEDDED_FILE_DATA_%zu,\n",
+          layout->data_index[i]);
+      output_buffer_puts(out, line);
+    }
+    output_buffer_puts(out, "};\n");
+  }
+  output_buffer_puts(out, "\n");
+}
+
+// Data table pointing to the symbols defined outside of C for each file
+static void generate_symbol_table(struct output_buffer* out,
+    char* const* files, const struct options* options,
+    const struct data_layout* layout)
+{
+  const char* function_name = options->function_name;
+  char symbol[strlen(function_name) + 32];
+  if (options->layout == LAYOUT_BLOB) {
+    snprintf(symbol, sizeof(symbol), "%s_blob", function_name);
+    output_buffer_puts(out, "#define EMBEDDED_DATA_BASE (");
+    output_buffer_puts(out, symbol);
+    output_buffer_puts(out, ")\n\n");
+    return;
+  }
+  output_buffer_puts(out, "static const char* EMBEDDED_FILE_DATA[] = {\n");
+  for (size_t file_count = 0; files[file_count]; file_count++) {
+    snprintf(symbol, sizeof(symbol), "%s_data_%zu", function_name,
+        layout->data_index[file_count]);
+    output_buffer_puts(out, "\t/* ");
+    output_buffer_puts(out, files[file_count]);
+    output_buffer_puts(out, " */\n\t");
+    output_buffer_puts(out, symbol);
+    output_buffer_puts(out, ",\n");
+  }
+  output_buffer_puts(out, "};\n\n");
+}
+
+static void generate_incbin_data(struct output_buffer* out,
+    char* const* files, const struct options* options,
+    const struct data_layout* layout)
+{
+  const char* function_name = options->function_name;
+  char symbol[strlen(function_name) + 32];
+  char line[64];
+  const char* section = options->section;
+  char macho_section[MAX_SECTION_NAME + 32];
+  snprintf(macho_section, sizeof(macho_section), ".section __TEXT,%s",
+      section ? section : "");
+  char macros[4096];
+  snprintf(macros, sizeof(macros), incbin_macros,
+      section ? macho_section : ".const_data", section ? section : ".rdata",
+      section ? section : ".rodata", section ? ",\\\"a\\\"" : "");
+  output_buffer_puts(out, macros);
+  if (options->layout == LAYOUT_BLOB) {
+    // One symbol for all files, aligned the same way as the offsets table
+    snprintf(symbol, sizeof(symbol), "%s_blob", function_name);
+    output_buffer_puts(out, "__asm__(EMBED_INCBIN_SECTION EMBED_INCBIN_LABEL(");
+    output_buffer_puts(out, symbol);
+    snprintf(line, sizeof(line), ", %zu)\n", layout->align);
+    output_buffer_puts(out, line);
+  }
+  for (size_t file_count = 0; files[file_count]; file_count++) {
+    if (layout->data_index[file_count] != file_count) {
+      continue;
+    }
+    char* path = absolute_path(files[file_count]);
+    // The path is escaped once for the assembler and again for C
+    char* asm_path = c_string_escape(path);
+    char* c_path = c_string_escape(asm_path);
+    if (options->layout == LAYOUT_BLOB) {
+      snprintf(line, sizeof(line), "    \".balign %zu\\n.incbin \\\"",
+          layout->aligns[file_count]);
+      output_buffer_puts(out, line);
+      output_buffer_puts(out, c_path);
+      output_buffer_puts(out, "\\\"\\n.byte 0\\n\"\n");
+    } else {
+      snprintf(
+          symbol, sizeof(symbol), "%s_data_%zu", function_name, file_count);
+      output_buffer_puts(out, "EMBED_INCBIN(");
+      output_buffer_puts(out, symbol);
+      output_buffer_puts(out, ", \"");
+      output_buffer_puts(out, c_path);
+      snprintf(line, sizeof(line), "\", %zu);\n", layout->aligns[file_count]);
+      output_buffer_puts(out, line);
+    }
+    free(c_path);
+    free(asm_path);
+    free(path);
+  }
+  if (options->layout == LAYOUT_BLOB) {
+    output_buffer_puts(out, "    EMBED_INCBIN_END);\nextern const char ");
+    output_buffer_puts(out, symbol);
+    output_buffer_puts(out, "[];\n");
+  }
+  generate_symbol_table(out, files, options, layout);
+}
+
+// Writes the array data into the shard sources, each of which compiles on
+// its own, and the tables pointing at it into the main source
+static void generate_shards(struct output_buffer* out, char* const* files,
+    const struct options* options, const struct data_layout* layout)
+{
+  size_t shard_count = layout->shard_count;
+  struct output_buffer* shard_outs = malloc(sizeof(*shard_outs) * shard_count);
+  if (!shard_outs) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < shard_count; i++) {
+    FILE* fd = fopen(options->shard_files[i], "w");
+    if (!fd) {
+      fprintf(stderr, "Could not open output source file '%s'\n",
+          options->shard_files[i]);
+      exit(1);
+    }
+    output_buffer_init(&shard_outs[i], fd);
+    output_buffer_puts(&shard_outs[i], "#include <stdint.h>\n");
+    output_buffer_puts(&shard_outs[i], align_macro);
+    output_section_macro(&shard_outs[i], options);
+    output_buffer_puts(&shard_outs[i], options->format->preamble);
+  }
+  generate_array_data(out, shard_outs, files, options, layout);
+  for (size_t i = 0; i < shard_count; i++) {
+    FILE* fd = shard_outs[i].fd;
+    output_buffer_free(&shard_outs[i]);
+    fclose(fd);
+  }
+  free(shard_outs);
+}
+
+// Generate the file data. The embed and incbin backends check that the
+// toolchain supports them, otherwise falling back to the next backend and
+// finally to arrays unless fallback is disabled
+void generate_file_data(FILE* fd, char* const* files,
+    const struct options* options, const struct data_layout* layout)
+{
+  // Compressed data is reached through the decompression cache
+  const char* data_macro
+      = layout->compressed_count ? "EMBEDDED_PAYLOAD" : "EMBEDDED_DATA";
+  struct output_buffer out;
+  output_buffer_init(&out, fd);
+  if (options->backend == BACKEND_ARRAY && options->shards) {
+    generate_shards(&out, files, options, layout);
+  } else if (options->backend == BACKEND_ARRAY) {
+    generate_array_data(&out, NULL, files, options, layout);
+  } else if (options->backend == BACKEND_OBJECT) {
+    // The data lives in the object file, declare its symbols
+    const char* function_name = options->function_name;
+    char symbol[strlen(function_name) + 32];
+    if (options->layout == LAYOUT_BLOB) {
+      snprintf(symbol, sizeof(symbol), "%s_blob", function_name);
+      output_buffer_puts(&out, "extern const char ");
+      output_buffer_puts(&out, symbol);
+      output_buffer_puts(&out, "[];\n");
+    } else {
+      for (size_t file_count = 0; files[file_count]; file_count++) {
+        if (layout->data_index[file_count] != file_count) {
+          continue;
+        }
+        snprintf(
+            symbol, sizeof(symbol), "%s_data_%zu", function_name, file_count);
+        output_buffer_puts(&out, "extern const char ");
+        output_buffer_puts(&out, symbol);
+        output_buffer_puts(&out, "[];\n");
+      }
+    }
+    generate_symbol_table(&out, files, options, layout);
+  } else if (options->backend == BACKEND_PACK) {
+    // The data is in the pack, mapped on first use by the code from
+    // generate_pack_access
+  } else {
+    if (options->backend == BACKEND_EMBED) {
+      output_buffer_puts(&out, "#if defined(__has_embed)\n");
+      generate_embed_data(&out, files, options, layout);
+      output_buffer_puts(&out, "#elif " INCBIN_CONDITION "\n");
+    } else {
+      output_buffer_puts(&out, "#if " INCBIN_CONDITION "\n");
+    }
+    generate_incbin_data(&out, files, options, layout);
+    output_buffer_puts(&out, "#else\n");
+    if (options->fallback) {
+      generate_array_data(&out, NULL, files, options, layout);
+    } else {
+      output_buffer_puts(&out,
+          "#error \"The toolchain supports neither #embed nor .incbin\"\n");
+    }
+    output_buffer_puts(&out, "#endif\n");
+  }
+  if (options->layout == LAYOUT_BLOB || options->backend == BACKEND_PACK) {
+    char line[128];
+    snprintf(line, sizeof(line),
+        "static const %s EMBEDDED_FILE_DATA_OFFSETS[] = {",
+        offset_type(layout->size));
+    output_buffer_puts(&out, line);
+    for (size_t i = 0; i < layout->count; i++) {
+      snprintf(line, sizeof(line), "%s%zu,", (i % 8) == 0 ? "\n\t" : "",
+          layout->offsets[i]);
+      output_buffer_puts(&out, line);
+    }
+    output_buffer_puts(&out, "\n};\n\n#define ");
+    output_buffer_puts(&out, data_macro);
+    // Without the pack there is no data, rather than data at an offset
+    output_buffer_puts(&out,
+        options->shards
+            ? "(i) \\\n"
+              "  (EMBEDDED_SHARD_DATA[EMBEDDED_FILE_SHARDS[i]] \\\n"
+              "      + EMBEDDED_FILE_DATA_OFFSETS[i])\n\n"
+        : options->backend == BACKEND_PACK
+            ? "(i) \\\n"
+              "  (embedded_pack_file(EMBEDDED_FILE_DATA_OFFSETS[i]))\n\n"
+            : "(i) \\\n"
+              "  (EMBEDDED_DATA_BASE + EMBEDDED_FILE_DATA_OFFSETS[i])\n\n");
+  } else {
+    output_buffer_puts(&out, "#define ");
+    output_buffer_puts(&out, data_macro);
+    output_buffer_puts(&out, "(i) (EMBEDDED_FILE_DATA[i])\n\n");
+  }
+  output_buffer_free(&out);
+}
+
+// Object files that can be written directly
+enum object_kind {
+  OBJECT_ELF,
+  OBJECT_COFF,
+  OBJECT_MACHO,
+};
+
+struct object_format {
+  const char* name;
+  enum object_kind kind;
+  // ELF class, 32 or 64
+  int bits;
+  // ELF e_machine, COFF Machine or Mach-O cputype
+  uint32_t machine;
+  // ELF e_flags or Mach-O cpusubtype
+  uint32_t flags;
+  // Prefix the platform's C compiler adds to symbol names
+  const char* symbol_prefix;
+};
+
+static const struct object_format object_formats[] = {
+  { "elf64-x86-64", OBJECT_ELF, 64, 62, 0, "" },
+  { "elf32-i386", OBJECT_ELF, 32, 3, 0, "" },
+  { "elf64-aarch64", OBJECT_ELF, 64, 183, 0, "" },
+  // EABI version 5
+  { "elf32-arm", OBJECT_ELF, 32, 40, 0x05000000, "" },
+  // RVC with the double float ABI, as used by Linux distributions
+  { "elf64-riscv", OBJECT_ELF, 64, 243, 0x5, "" },
+  { "coff-x86-64", OBJECT_COFF, 64, 0x8664, 0, "" },
+  { "coff-i386", OBJECT_COFF, 32, 0x14c, 0, "_" },
+  { "coff-arm64", OBJECT_COFF, 64, 0xAA64, 0, "" },
+  { "macho-x86-64", OBJECT_MACHO, 64, 0x01000007, 3, "_" },
+  { "macho-arm64", OBJECT_MACHO, 64, 0x0100000C, 0, "_" },
+};
+
+static const struct object_format* find_object_format(const char* name)
+{
+  for (size_t i = 0; i < sizeof(object_formats) / sizeof(object_formats[0]);
+       i++) {
+    if (0 == strcmp(name, object_formats[i].name)) {
+      return &object_formats[i];
+    }
+  }
+  return NULL;
+}
+
+// Writes a little endian integer of `bytes` bytes
+static void output_le(struct output_buffer* out, uint64_t value, int bytes)
+{
+  char data[8];
+  for (int i = 0; i < bytes; i++) {
+    data[i] = (char)(value >> (8 * i));
+  }
+  output_buffer_write(out, data, bytes);
+}
+
+static void output_zeros(struct output_buffer* out, size_t count)
+{
+  static const char zeros[64];
+  while (count > 0) {
+    size_t chunk = count < sizeof(zeros) ? count : sizeof(zeros);
+    output_buffer_write(out, zeros, chunk);
+    count -= chunk;
+  }
+}
+
+// Writes a fixed size, zero padded name field
+static void output_name_field(
+    struct output_buffer* out, const char* name, size_t size)
+{
+  size_t length = strlen(name);
+  output_buffer_write(out, name, length);
+  output_zeros(out, size - length);
+}
+
+// Writes the data stored for every file at its offset, each followed by a
+// null terminator. Duplicates share the data of the file they duplicate.
+static void output_section_data(
+    struct output_buffer* out, const struct data_layout* layout)
+{
+  size_t position = 0;
+  for (size_t i = 0; i < layout->count; i++) {
+    if (layout->data_index[i] != i) {
+      continue;
+    }
+    output_zeros(out, layout->offsets[i] - position);
+    if (layout->sizes[i] > 0) {
+      output_buffer_write(
+          out, (const char*)stored_data(layout, i), layout->sizes[i]);
+    }
+    output_zeros(out, 1);
+    position = layout->offsets[i] + layout->sizes[i] + 1;
+  }
+}
+
+// Builds the symbol string table, returning each symbol's offset into it
+static char* object_string_table(char* const* files, const char* begin,
+    const char* prefix, const char* function_name, size_t* offsets,
+    size_t* size)
+{
+  size_t file_count = 0;
+  while (files[file_count]) {
+    file_count++;
+  }
+  size_t begin_length = strlen(begin) + 1;
+  size_t symbol_size = strlen(prefix) + strlen(function_name) + 32;
+  char* table = malloc(begin_length + symbol_size * (file_count + 1));
+  if (!table) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  memcpy(table, begin, begin_length);
+  size_t length = begin_length;
+  for (size_t i = 0; i < file_count; i++) {
+    offsets[i] = length;
+    length += snprintf(&table[length], symbol_size, "%s%s_data_%zu", prefix,
+                  function_name, i)
+        + 1;
+  }
+  // Followed by the symbol spanning the data of all files
+  offsets[file_count] = length;
+  length += snprintf(&table[length], symbol_size, "%s%s_blob", prefix,
+                function_name)
+      + 1;
+  *size = length;
+  return table;
+}
+
+// Writes the data of all files into an ELF relocatable object
+static void generate_elf_object(struct output_buffer* out,
+    const struct object_format* format, char* const* files,
+    const char* function_name, const char* section,
+    const struct data_layout* layout)
+{
+  const size_t* sizes = layout->sizes;
+  const size_t* offsets = layout->offsets;
+  size_t file_count = layout->count;
+  size_t data_size = layout->size;
+  bool is64 = format->bits == 64;
+  int word = is64 ? 8 : 4;
+  size_t ehdr_size = is64 ? 64 : 52;
+  size_t shdr_size = is64 ? 64 : 40;
+  size_t sym_size = is64 ? 24 : 16;
+  // Section names, the data's first
+  static const char other_names[]
+      = "\0.symtab\0.strtab\0.note.GNU-stack\0.shstrtab";
+  // x86-64 code only reaches 2 GiB of small data, larger data goes in a large
+  // section that -mcmodel=medium programs address with 64 bit relocations
+  bool large = format->machine == 62 && data_size > INT32_MAX;
+  uint64_t flags = large ? 0x10000002 : 2;
+  section = section ? section : large ? ".lrodata" : ".rodata";
+  size_t names_start = strlen(section) + 1;
+  char shstrtab[MAX_SECTION_NAME + sizeof(other_names) + 1];
+  size_t shstrtab_size = names_start + sizeof(other_names);
+  shstrtab[0] = '\0';
+  memcpy(shstrtab + 1, section, names_start - 1);
+  memcpy(shstrtab + names_start, other_names, sizeof(other_names));
+  size_t* name_offsets = malloc(sizeof(size_t) * (file_count + 2));
+  size_t strtab_size;
+  char* strtab = object_string_table(files, "", format->symbol_prefix,
+      function_name, name_offsets, &strtab_size);
+  // Null and section symbols, then a global for each file and the blob
+  size_t symbol_count = 2 + file_count + 1;
+  size_t data_offset = align_up(ehdr_size, layout->align);
+  size_t symtab_offset = align_up(data_offset + data_size, 8);
+  size_t strtab_offset = symtab_offset + symbol_count * sym_size;
+  size_t shstrtab_offset = strtab_offset + strtab_size;
+  size_t shdr_offset = align_up(shstrtab_offset + shstrtab_size, 8);
+  if (!is64 && shdr_offset + 6 * shdr_size > UINT32_MAX) {
+    fprintf(stderr,
+        "32 bit ELF objects can not hold more than 4 GiB of data\n");
+    exit(1);
+  }
+
+  // ELF header
+  output_buffer_write(out, "\x7f" "ELF", 4);
+  output_le(out, is64 ? 2 : 1, 1);
+  output_le(out, 1, 1); // Little endian
+  output_le(out, 1, 1); // Version
+  output_zeros(out, 9);
+  output_le(out, 1, 2); // ET_REL
+  output_le(out, format->machine, 2);
+  output_le(out, 1, 4);
+  output_le(out, 0, word); // Entry
+  output_le(out, 0, word); // Program headers
+  output_le(out, shdr_offset, word);
+  output_le(out, format->flags, 4);
+  output_le(out, ehdr_size, 2);
+  output_le(out, 0, 2);
+  output_le(out, 0, 2);
+  output_le(out, shdr_size, 2);
+  output_le(out, 6, 2); // Section count
+  output_le(out, 5, 2); // Section name table index
+  output_zeros(out, data_offset - ehdr_size);
+
+  // .rodata
+  output_section_data(out, layout);
+  output_zeros(out, symtab_offset - (data_offset + data_size));
+
+  // .symtab
+  for (size_t i = 0; i < symbol_count; i++) {
+    size_t name = 0;
+    int info = 0;
+    int other = 0;
+    int section = 0;
+    size_t value = 0;
+    size_t size = 0;
+    if (i == 1) {
+      info = 3; // STB_LOCAL, STT_SECTION
+      section = 1;
+    } else if (i > 1) {
+      name = name_offsets[i - 2];
+      info = 0x11; // STB_GLOBAL, STT_OBJECT
+      other = 2; // STV_HIDDEN
+      section = 1;
+      if (i - 2 < file_count) {
+        value = offsets[i - 2];
+        size = sizes[i - 2] + 1;
+      } else {
+        size = data_size;
+      }
+    }
+    output_le(out, name, 4);
+    if (is64) {
+      output_le(out, info, 1);
+      output_le(out, other, 1);
+      output_le(out, section, 2);
+      output_le(out, value, 8);
+      output_le(out, size, 8);
+    } else {
+      output_le(out, value, 4);
+      output_le(out, size, 4);
+      output_le(out, info, 1);
+      output_le(out, other, 1);
+      output_le(out, section, 2);
+    }
+  }
+  output_buffer_write(out, strtab, strtab_size);
+  output_buffer_write(out, shstrtab, shstrtab_size);
+  output_zeros(out, shdr_offset - (shstrtab_offset + shstrtab_size));
+
+  // Section headers: name, type, flags, offset, size, link, info, alignment
+  // and entry size
+  struct {
+    uint32_t name;
+    uint32_t type;
+    uint64_t flags;
+    uint64_t offset;
+    uint64_t size;
+    uint32_t link;
+    uint32_t info;
+    uint64_t align;
+    uint64_t entry_size;
+  } sections[6] = {
+    { 0 },
+    { 1, 1, flags, data_offset, data_size, 0, 0, layout->align, 0 },
+    { names_start + 1, 2, 0, symtab_offset, symbol_count * sym_size, 3, 2,
+        word, sym_size },
+    { names_start + 9, 3, 0, strtab_offset, strtab_size, 0, 0, 1, 0 },
+    { names_start + 17, 1, 0, shstrtab_offset, 0, 0, 0, 1, 0 },
+    { names_start + 33, 3, 0, shstrtab_offset, shstrtab_size, 0, 0, 1, 0 },
+  };
+  for (int i = 0; i < 6; i++) {
+    output_le(out, sections[i].name, 4);
+    output_le(out, sections[i].type, 4);
+    output_le(out, sections[i].flags, word);
+    output_le(out, 0, word); // Address
+    output_le(out, sections[i].offset, word);
+    output_le(out, sections[i].size, word);
+    output_le(out, sections[i].link, 4);
+    output_le(out, sections[i].info, 4);
+    output_le(out, sections[i].align, word);
+    output_le(out, sections[i].entry_size, word);
+  }
+  free(strtab);
+  free(name_offsets);
+}
+
+// Writes the data of all files into a COFF object
+static void generate_coff_object(struct output_buffer* out,
+    const struct object_format* format, char* const* files,
+    const char* function_name, const char* section,
+    const struct data_layout* layout)
+{
+  const size_t* offsets = layout->offsets;
+  size_t file_count = layout->count;
+  size_t data_size = layout->size;
+  if (data_size > UINT32_MAX) {
+    fprintf(stderr, "COFF objects can not hold more than 4 GiB of data\n");
+    exit(1);
+  }
+  size_t* name_offsets = malloc(sizeof(size_t) * (file_count + 2));
+  size_t strtab_size;
+  // The string table starts with its size, reserve space for it
+  char* strtab = object_string_table(files, "...", format->symbol_prefix,
+      function_name, name_offsets, &strtab_size);
+  // Section alignment is limited to 8 KiB
+  if (layout->align > 8192) {
+    fprintf(stderr, "COFF objects can not align data to more than 8192\n");
+    exit(1);
+  }
+  // Longer section names would need the string table
+  if (section && strlen(section) > 8) {
+    fprintf(stderr, "COFF section names can not be longer than 8\n");
+    exit(1);
+  }
+  size_t data_offset = align_up(20 + 40, layout->align);
+  size_t symtab_offset = data_offset + data_size;
+
+  // File header
+  output_le(out, format->machine, 2);
+  output_le(out, 1, 2); // Section count
+  output_le(out, 0, 4); // Timestamp
+  output_le(out, symtab_offset, 4);
+  output_le(out, file_count + 1, 4);
+  output_le(out, 0, 2); // Optional header size
+  output_le(out, 0, 2); // Characteristics
+
+  // Section header for .rdata, initialized read only data
+  output_name_field(out, section ? section : ".rdata", 8);
+  output_le(out, 0, 4);
+  output_le(out, 0, 4);
+  output_le(out, data_size, 4);
+  output_le(out, data_offset, 4);
+  output_le(out, 0, 4); // Relocations
+  output_le(out, 0, 4); // Line numbers
+  output_le(out, 0, 2);
+  output_le(out, 0, 2);
+  output_le(out, 0x40000040 | (log2_size(layout->align) + 1) << 20, 4);
+  output_zeros(out, data_offset - (20 + 40));
+
+  output_section_data(out, layout);
+
+  // External symbols, all named through the string table
+  for (size_t i = 0; i <= file_count; i++) {
+    output_le(out, 0, 4);
+    output_le(out, name_offsets[i], 4);
+    output_le(out, i < file_count ? offsets[i] : 0, 4);
+    output_le(out, 1, 2); // Section number
+    output_le(out, 0, 2); // Type
+    output_le(out, 2, 1); // IMAGE_SYM_CLASS_EXTERNAL
+    output_le(out, 0, 1); // Auxiliary symbols
+  }
+  output_le(out, strtab_size, 4);
+  output_buffer_write(out, strtab + 4, strtab_size - 4);
+  free(strtab);
+  free(name_offsets);
+}
+
+// Writes the data of all files into a 64 bit Mach-O object
+static void generate_macho_object(struct output_buffer* out,
+    const struct object_format* format, char* const* files,
+    const char* function_name, const char* section,
+    const struct data_layout* layout)
+{
+  const size_t* offsets = layout->offsets;
+  size_t file_count = layout->count;
+  size_t data_size = layout->size;
+  size_t* name_offsets = malloc(sizeof(size_t) * (file_count + 2));
+  size_t strtab_size;
+  char* strtab = object_string_table(files, "", format->symbol_prefix,
+      function_name, name_offsets, &strtab_size);
+  // Segment with one section, build version, symbol table and dynamic symbol
+  // table commands
+  size_t commands_size = (72 + 80) + 24 + 24 + 80;
+  size_t data_offset = align_up(32 + commands_size, layout->align);
+  size_t symtab_offset = align_up(data_offset + data_size, 8);
+  size_t strtab_offset = symtab_offset + 16 * (file_count + 1);
+  if (strtab_offset + strtab_size > UINT32_MAX) {
+    fprintf(stderr, "Mach-O objects can not hold more than 4 GiB of data\n");
+    exit(1);
+  }
+
+  // Header
+  output_le(out, 0xfeedfacf, 4);
+  output_le(out, format->machine, 4);
+  output_le(out, format->flags, 4);
+  output_le(out, 1, 4); // MH_OBJECT
+  output_le(out, 4, 4); // Command count
+  output_le(out, commands_size, 4);
+  // No MH_SUBSECTIONS_VIA_SYMBOLS, the blob symbol overlaps the others so
+  // the section must stay in one piece
+  output_le(out, 0, 4);
+  output_le(out, 0, 4);
+
+  // LC_SEGMENT_64 with __TEXT,__const or the section asked for
+  output_le(out, 0x19, 4);
+  output_le(out, 72 + 80, 4);
+  output_zeros(out, 16);
+  output_le(out, 0, 8);
+  output_le(out, data_size, 8);
+  output_le(out, data_offset, 8);
+  output_le(out, data_size, 8);
+  output_le(out, 7, 4);
+  output_le(out, 7, 4);
+  output_le(out, 1, 4);
+  output_le(out, 0, 4);
+  output_name_field(out, section ? section : "__const", 16);
+  output_name_field(out, "__TEXT", 16);
+  output_le(out, 0, 8);
+  output_le(out, data_size, 8);
+  output_le(out, data_offset, 4);
+  output_le(out, log2_size(layout->align), 4); // Power of two alignment
+  output_zeros(out, 4 * 6); // Relocations, flags and reserved fields
+
+  // LC_BUILD_VERSION for macOS 10.13 or 11.0 on arm64
+  output_le(out, 0x32, 4);
+  output_le(out, 24, 4);
+  output_le(out, 1, 4);
+  output_le(out, format->machine == 0x0100000C ? 0x000B0000 : 0x000A0D00, 4);
+  output_le(out, 0, 4);
+  output_le(out, 0, 4);
+
+  // LC_SYMTAB
+  output_le(out, 0x2, 4);
+  output_le(out, 24, 4);
+  output_le(out, symtab_offset, 4);
+  output_le(out, file_count + 1, 4);
+  output_le(out, strtab_offset, 4);
+  output_le(out, strtab_size, 4);
+
+  // LC_DYSYMTAB with every symbol external and defined
+  output_le(out, 0xB, 4);
+  output_le(out, 80, 4);
+  output_le(out, 0, 4);
+  output_le(out, 0, 4);
+  output_le(out, 0, 4);
+  output_le(out, file_count + 1, 4);
+  output_le(out, file_count + 1, 4);
+  output_le(out, 0, 4);
+  output_zeros(out, 4 * 12);
+  output_zeros(out, data_offset - (32 + commands_size));
+
+  output_section_data(out, layout);
+  output_zeros(out, symtab_offset - (data_offset + data_size));
+
+  for (size_t i = 0; i <= file_count; i++) {
+    output_le(out, name_offsets[i], 4);
+    output_le(out, 0x1f, 1); // N_SECT | N_EXT | N_PEXT
+    output_le(out, 1, 1); // Section
+    output_le(out, 0, 2);
+    output_le(out, i < file_count ? offsets[i] : 0, 8);
+  }
+  output_buffer_write(out, strtab, strtab_size);
+  free(strtab);
+  free(name_offsets);
+}
+
+// Generate an object file defining a symbol for each file's data, and one
+// for the data of all files
+void generate_object(
+    char* const* files, const struct options* options,
+    const struct data_layout* layout)
+{
+  const struct object_format* format = options->object_format;
+  const char* function_name = options->function_name;
+  FILE* fd = fopen(options->object_file, "wb");
+  if (!fd) {
+    fprintf(stderr, "Could not open output object file '%s'\n",
+        options->object_file);
+    exit(1);
+  }
+  struct output_buffer out;
+  output_buffer_init(&out, fd);
+  switch (format->kind) {
+  case OBJECT_ELF:
+    generate_elf_object(
+        &out, format, files, function_name, options->section, layout);
+    break;
+  case OBJECT_COFF:
+    generate_coff_object(
+        &out, format, files, function_name, options->section, layout);
+    break;
+  case OBJECT_MACHO:
+    generate_macho_object(
+        &out, format, files, function_name, options->section, layout);
+    break;
+  }
+  output_buffer_free(&out);
+  if (fclose(fd) != 0) {
+    fprintf(stderr, "Could not write output object file '%s'\n",
+        options->object_file);
+    exit(1);
+  }
+}
+
+// A pack file starts with a header of the magic, an id the source checks,
+// the number of files, where the data starts and its size. A table of each
+// file's offset into the data and stored size follows, then the data aligned
+// to at least a page so each file's pages line up with the mapping.
+#define PACK_MAGIC "EMBEDPK1"
+#define PACK_HEADER_SIZE 40
+#define PACK_ENTRY_SIZE 16
+#define PACK_DATA_ALIGN 4096
+
+// Where the data starts in the pack
+static size_t pack_data_offset(const struct data_layout* layout)
+{
+  size_t align = layout->align > PACK_DATA_ALIGN ? layout->align
+                                                 : PACK_DATA_ALIGN;
+  return align_up(PACK_HEADER_SIZE + PACK_ENTRY_SIZE * layout->count, align);
+}
+
+// Id of a pack, from its table and the data it stores, so the source does
+// not use a pack written for other files
+static uint64_t pack_id(const struct data_layout* layout)
+{
+  uint64_t id = xxh64((const unsigned char*)PACK_MAGIC, 8, layout->count);
+  for (size_t i = 0; i < layout->count; i++) {
+    unsigned char entry[24];
+    for (int b = 0; b < 8; b++) {
+      entry[b] = (unsigned char)(layout->offsets[i] >> (8 * b));
+      entry[8 + b] = (unsigned char)(layout->sizes[i] >> (8 * b));
+      entry[16 + b] = (unsigned char)(layout->original_sizes[i] >> (8 * b));
+    }
+    id = xxh64(entry, sizeof(entry), id);
+    if (layout->data_index[i] == i && layout->sizes[i] > 0) {
+      id = xxh64(stored_data(layout, i), layout->sizes[i], id);
+    }
+  }
+  return id;
+}
+
+// Writes the data of all files into a pack file for the source to map
+void generate_pack(
+    const struct options* options, const struct data_layout* layout)
+{
+  FILE* fd = fopen(options->pack_file, "wb");
+  if (!fd) {
+    fprintf(stderr, "Could not open output pack file '%s'\n",
+        options->pack_file);
+    exit(1);
+  }
+  struct output_buffer out;
+  output_buffer_init(&out, fd);
+  size_t data_offset = pack_data_offset(layout);
+  output_buffer_write(&out, PACK_MAGIC, 8);
+  output_le(&out, pack_id(layout), 8);
+  output_le(&out, layout->count, 8);
+  output_le(&out, data_offset, 8);
+  output_le(&out, layout->size, 8);
+  for (size_t i = 0; i < layout->count; i++) {
+    output_le(&out, layout->offsets[i], 8);
+    output_le(&out, layout->sizes[i], 8);
+  }
+  output_zeros(&out,
+      data_offset - PACK_HEADER_SIZE - PACK_ENTRY_SIZE * layout->count);
+  output_section_data(&out, layout);
+  output_buffer_free(&out);
+  if (fclose(fd) != 0) {
+    fprintf(stderr, "Could not write output pack file '%s'\n",
+        options->pack_file);
+    exit(1);
+  }
+}
+
+// Generate the file data sizes
+void generate_file_data_sizes(FILE* fd, char* const* files,
+    const struct options* options, const struct data_layout* layout)
+{
+  fprintf(fd, "static %s EMBEDDED_FILE_DATA_SIZES[] = {\n  ",
+      options->layout == LAYOUT_BLOB ? offset_type(layout->original_size)
+                                     : "size_t");
+  for (size_t file_count = 0; *files; file_count++) {
+    const char* input_file = *files;
+    size_t length = layout->original_sizes[file_count];
+    if (file_count != 0) {
+      fprintf(fd, ",\n");
+    }
+    fprintf(fd, "\t/* %s */\n", input_file);
+    fprintf(fd, "\t%zu", length);
+    files++;
+  }
+  fprintf(fd, "\n};\n\n");
+  fprintf(fd,
+      "#define EMBEDDED_SIZE(i) (EMBEDDED_FILE_DATA_SIZES[i])\n"
+      "#define EMBEDDED_FILE_COUNT %zu\n\n",
+      layout->count);
+}
+
+static const char* lz4_source
+    = "// Decodes an LZ4 block, returning whether it filled the output\n"
+      "// exactly\n"
+      "static int embedded_lz4(const unsigned char* in, size_t in_size,\n"
+      "    unsigned char* out, size_t out_size) {\n"
+      "  const unsigned char* end = in + in_size;\n"
+      "  size_t o = 0;\n"
+      "  while (in < end) {\n"
+      "    unsigned token = *in++;\n"
+      "    size_t length = token >> 4;\n"
+      "    if (length == 15) {\n"
+      "      unsigned char b;\n"
+      "      do {\n"
+      "        if (in == end) {\n"
+      "          return 0;\n"
+      "        }\n"
+      "        b = *in++;\n"
+      "        length += b;\n"
+      "      } while (b == 255);\n"
+      "    }\n"
+      "    if (length > (size_t)(end - in) || length > out_size - o) {\n"
+      "      return 0;\n"
+      "    }\n"
+      "    memcpy(out + o, in, length);\n"
+      "    in += length;\n"
+      "    o += length;\n"
+      "    if (in == end) {\n"
+      "      break;\n"
+      "    }\n"
+      "    if (end - in < 2) {\n"
+      "      return 0;\n"
+      "    }\n"
+      "    size_t offset = in[0] | (size_t)in[1] << 8;\n"
+      "    in += 2;\n"
+      "    length = token & 15;\n"
+      "    if (length == 15) {\n"
+      "      unsigned char b;\n"
+      "      do {\n"
+      "        if (in == end) {\n"
+      "          return 0;\n"
+      "        }\n"
+      "        b = *in++;\n"
+      "        length += b;\n"
+      "      } while (b == 255);\n"
+      "    }\n"
+      "    length += 4;\n"
+      "    if (offset == 0 || offset > o || length > out_size - o) {\n"
+      "      return 0;\n"
+      "    }\n"
+      "    if (offset >= length) {\n"
+      "      memcpy(out + o, out + o - offset, length);\n"
+      "      o += length;\n"
+      "    } else {\n"
+      "      for (; length > 0; length--, o++) {\n"
+      "        out[o] = out[o - offset];\n"
+      "      }\n"
+      "    }\n"
+      "  }\n"
+      "  return o == out_size;\n"
+      "}\n";
+
+static const char* inflate_source
+    = "// Decodes a raw deflate stream, returning whether it filled the\n"
+      "// output exactly\n"
+      "struct embedded_inflate {\n"
+      "  const unsigned char* in;\n"
+      "  size_t in_size;\n"
+      "  size_t in_pos;\n"
+      "  uint64_t bits;\n"
+      "  unsigned count;\n"
+      "  int error;\n"
+      "};\n"
+      "\n"
+      "// Canonical Huffman code with a table for codes of up to 9 bits\n"
+      "struct embedded_huffman {\n"
+      "  uint16_t counts[16];\n"
+      "  uint16_t symbols[288];\n"
+      "  uint16_t fast[512];\n"
+      "};\n"
+      "\n"
+      "static unsigned embedded_bits(\n"
+      "    struct embedded_inflate* s, unsigned n) {\n"
+      "  while (s->count < n) {\n"
+      "    if (s->in_pos == s->in_size) {\n"
+      "      s->error = 1;\n"
+      "      return 0;\n"
+      "    }\n"
+      "    s->bits |= (uint64_t)s->in[s->in_pos++] << s->count;\n"
+      "    s->count += 8;\n"
+      "  }\n"
+      "  unsigned value = (unsigned)(s->bits & ((1u << n) - 1));\n"
+      "  s->bits >>= n;\n"
+      "  s->count -= n;\n"
+      "  return value;\n"
+      "}\n"
+      "\n"
+      "static int embedded_huffman_build(struct embedded_huffman* h,\n"
+      "    const unsigned char* lengths, unsigned n) {\n"
+      "  uint16_t offsets[16];\n"
+      "  memset(h->counts, 0, sizeof(h->counts));\n"
+      "  memset(h->fast, 0, sizeof(h->fast));\n"
+      "  for (unsigned i = 0; i < n; i++) {\n"
+      "    h->counts[lengths[i]]++;\n"
+      "  }\n"
+      "  h->counts[0] = 0;\n"
+      "  int left = 1;\n"
+      "  offsets[1] = 0;\n"
+      "  for (unsigned len = 1; len < 16; len++) {\n"
+      "    left = (left << 1) - h->counts[len];\n"
+      "    if (left < 0) {\n"
+      "      return 0;\n"
+      "    }\n"
+      "    if (len < 15) {\n"
+      "      offsets[len + 1] = offsets[len] + h->counts[len];\n"
+      "    }\n"
+      "  }\n"
+      "  for (unsigned i = 0; i < n; i++) {\n"
+      "    if (lengths[i]) {\n"
+      "      h->symbols[offsets[lengths[i]]++] = (uint16_t)i;\n"
+      "    }\n"
+      "  }\n"
+      "  // Fill the table with the bit reversed codes of short symbols\n"
+      "  unsigned code = 0;\n"
+      "  unsigned index = 0;\n"
+      "  for (unsigned len = 1; len <= 9; len++) {\n"
+      "    for (unsigned i = 0; i < h->counts[len]; i++, code++, index++) {\n"
+      "      unsigned reversed = 0;\n"
+      "      for (unsigned bit = 0; bit < len; bit++) {\n"
+      "        reversed |= ((code >> bit) & 1) << (len - 1 - bit);\n"
+      "      }\n"
+      "      for (unsigned fill = reversed; fill < 512; fill += 1u << len) {\n"
+      "        h->fast[fill] = (uint16_t)(h->symbols[index] << 4 | len);\n"
+      "      }\n"
+      "    }\n"
+      "    code <<= 1;\n"
+      "  }\n"
+      "  return 1;\n"
+      "}\n"
+      "\n"
+      "static int embedded_decode(\n"
+      "    struct embedded_inflate* s, const struct embedded_huffman* h) {\n"
+      "  while (s->count < 9 && s->in_pos < s->in_size) {\n"
+      "    s->bits |= (uint64_t)s->in[s->in_pos++] << s->count;\n"
+      "    s->count += 8;\n"
+      "  }\n"
+      "  unsigned entry = h->fast[s->bits & 511];\n"
+      "  if ((entry & 15) && (entry & 15) <= s->count) {\n"
+      "    s->bits >>= entry & 15;\n"
+      "    s->count -= entry & 15;\n"
+      "    return entry >> 4;\n"
+      "  }\n"
+      "  int code = 0;\n"
+      "  int first = 0;\n"
+      "  int index = 0;\n"
+      "  for (unsigned len = 1; len < 16; len++) {\n"
+      "    code |= (int)embedded_bits(s, 1);\n"
+      "    int count = h->counts[len];\n"
+      "    if (code - count < first) {\n"
+      "      return h->symbols[index + (code - first)];\n"
+      "    }\n"
+      "    index += count;\n"
+      "    first = (first + count) << 1;\n"
+      "    code <<= 1;\n"
+      "  }\n"
+      "  s->error = 1;\n"
+      "  return 0;\n"
+      "}\n"
+      "\n"
+      "static int embedded_inflate(const unsigned char* in, size_t in_size,\n"
+      "    unsigned char* out, size_t out_size) {\n"
+      "  static const uint16_t length_base[29] = { 3, 4, 5, 6, 7, 8, 9, 10,\n"
+      "    11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115,\n"
+      "    131, 163, 195, 227, 258 };\n"
+      "  static const unsigned char length_extra[29] = { 0, 0, 0, 0, 0, 0, 0,\n"
+      "    0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5,\n"
+      "    0 };\n"
+      "  static const uint16_t distance_base[30] = { 1, 2, 3, 4, 5, 7, 9, 13,\n"
+      "    17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537,\n"
+      "    2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };\n"
+      "  static const unsigned char distance_extra[30] = { 0, 0, 0, 0, 1, 1,\n"
+      "    2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11,\n"
+      "    12, 12, 13, 13 };\n"
+      "  static const unsigned char order[19] = { 16, 17, 18, 0, 8, 7, 9, 6,\n"
+      "    10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };\n"
+      "  struct embedded_inflate s = { in, in_size, 0, 0, 0, 0 };\n"
+      "  struct embedded_huffman* codes\n"
+      "      = (struct embedded_huffman*)malloc(2 * sizeof(*codes));\n"
+      "  if (!codes) {\n"
+      "    return 0;\n"
+      "  }\n"
+      "  struct embedded_huffman* litlen = &codes[0];\n"
+      "  struct embedded_huffman* distance = &codes[1];\n"
+      "  size_t o = 0;\n"
+      "  int last;\n"
+      "  do {\n"
+      "    last = (int)embedded_bits(&s, 1);\n"
+      "    unsigned type = embedded_bits(&s, 2);\n"
+      "    if (type == 0) {\n"
+      "      // Stored block, aligned to a byte boundary\n"
+      "      embedded_bits(&s, s.count & 7);\n"
+      "      unsigned length = embedded_bits(&s, 16);\n"
+      "      unsigned check = embedded_bits(&s, 16);\n"
+      "      if (s.error || length != (~check & 0xffff)\n"
+      "          || length > out_size - o) {\n"
+      "        s.error = 1;\n"
+      "        break;\n"
+      "      }\n"
+      "      for (; length > 0 && s.count > 0; length--) {\n"
+      "        out[o++] = (unsigned char)embedded_bits(&s, 8);\n"
+      "      }\n"
+      "      if (length > s.in_size - s.in_pos) {\n"
+      "        s.error = 1;\n"
+      "        break;\n"
+      "      }\n"
+      "      memcpy(out + o, s.in + s.in_pos, length);\n"
+      "      s.in_pos += length;\n"
+      "      o += length;\n"
+      "      continue;\n"
+      "    }\n"
+      "    unsigned char lengths[288 + 32];\n"
+      "    if (type == 1) {\n"
+      "      unsigned i = 0;\n"
+      "      for (; i < 144; i++) {\n"
+      "        lengths[i] = 8;\n"
+      "      }\n"
+      "      for (; i < 256; i++) {\n"
+      "        lengths[i] = 9;\n"
+      "      }\n"
+      "      for (; i < 280; i++) {\n"
+      "        lengths[i] = 7;\n"
+      "      }\n"
+      "      for (; i < 288; i++) {\n"
+      "        lengths[i] = 8;\n"
+      "      }\n"
+      "      embedded_huffman_build(litlen, lengths, 288);\n"
+      "      memset(lengths, 5, 30);\n"
+      "      embedded_huffman_build(distance, lengths, 30);\n"
+      "    } else if (type == 2) {\n"
+      "      unsigned litlen_count = embedded_bits(&s, 5) + 257;\n"
+      "      unsigned distance_count = embedded_bits(&s, 5) + 1;\n"
+      "      unsigned run_count = embedded_bits(&s, 4) + 4;\n"
+      "      if (litlen_count > 286 || distance_count > 30) {\n"
+      "        s.error = 1;\n"
+      "        break;\n"
+      "      }\n"
+      "      unsigned char run_lengths[19] = { 0 };\n"
+      "      for (unsigned i = 0; i < run_count; i++) {\n"
+      "        run_lengths[order[i]] = (unsigned char)embedded_bits(&s, 3);\n"
+      "      }\n"
+      "      if (!embedded_huffman_build(litlen, run_lengths, 19)) {\n"
+      "        s.error = 1;\n"
+      "        break;\n"
+      "      }\n"
+      "      unsigned total = litlen_count + distance_count;\n"
+      "      for (unsigned i = 0; i < total && !s.error;) {\n"
+      "        int symbol = embedded_decode(&s, litlen);\n"
+      "        unsigned repeat;\n"
+      "        unsigned char value = 0;\n"
+      "        if (symbol < 16) {\n"
+      "          lengths[i++] = (unsigned char)symbol;\n"
+      "          continue;\n"
+      "        } else if (symbol == 16) {\n"
+      "          if (i == 0) {\n"
+      "            s.error = 1;\n"
+      "            break;\n"
+      "          }\n"
+      "          value = lengths[i - 1];\n"
+      "          repeat = 3 + embedded_bits(&s, 2);\n"
+      "        } else if (symbol == 17) {\n"
+      "          repeat = 3 + embedded_bits(&s, 3);\n"
+      "        } else {\n"
+      "          repeat = 11 + embedded_bits(&s, 7);\n"
+      "        }\n"
+      "        if (repeat > total - i) {\n"
+      "          s.error = 1;\n"
+      "          break;\n"
+      "        }\n"
+      "        for (; repeat > 0; repeat--) {\n"
+      "          lengths[i++] = value;\n"
+      "        }\n"
+      "      }\n"
+      "      if (s.error\n"
+      "          || !embedded_huffman_build(litlen, lengths, litlen_count)\n"
+      "          || !embedded_huffman_build(\n"
+      "              distance, lengths + litlen_count, distance_count)) {\n"
+      "        s.error = 1;\n"
+      "        break;\n"
+      "      }\n"
+      "    } else {\n"
+      "      s.error = 1;\n"
+      "      break;\n"
+      "    }\n"
+      "    for (;;) {\n"
+      "      int symbol = embedded_decode(&s, litlen);\n"
+      "      if (s.error) {\n"
+      "        break;\n"
+      "      }\n"
+      "      if (symbol < 256) {\n"
+      "        if (o == out_size) {\n"
+      "          s.error = 1;\n"
+      "          break;\n"
+      "        }\n"
+      "        out[o++] = (unsigned char)symbol;\n"
+      "        continue;\n"
+      "      }\n"
+      "      if (symbol == 256) {\n"
+      "        break;\n"
+      "      }\n"
+      "      symbol -= 257;\n"
+      "      if (symbol >= 29) {\n"
+      "        s.error = 1;\n"
+      "        break;\n"
+      "      }\n"
+      "      size_t length = length_base[symbol]\n"
+      "          + embedded_bits(&s, length_extra[symbol]);\n"
+      "      symbol = embedded_decode(&s, distance);\n"
+      "      if (symbol >= 30) {\n"
+      "        s.error = 1;\n"
+      "        break;\n"
+      "      }\n"
+      "      size_t offset = distance_base[symbol]\n"
+      "          + embedded_bits(&s, distance_extra[symbol]);\n"
+      "      if (s.error || offset > o || length > out_size - o) {\n"
+      "        s.error = 1;\n"
+      "        break;\n"
+      "      }\n"
+      "      if (offset >= length) {\n"
+      "        memcpy(out + o, out + o - offset, length);\n"
+      "        o += length;\n"
+      "      } else {\n"
+      "        for (; length > 0; length--, o++) {\n"
+      "          out[o] = out[o - offset];\n"
+      "        }\n"
+      "      }\n"
+      "    }\n"
+      "  } while (!last && !s.error);\n"
+      "  free(codes);\n"
+      "  return last && !s.error && o == out_size;\n"
+      "}\n";
+
+// Atomic pointer slots, filled once with a compare and swap
+static const char* slot_source
+    = "// Decompressed files and the pack's mapping are published with an\n"
+      "// atomic compare and swap. Concurrent first calls may both do the\n"
+      "// work, the loser frees its copy.\n"
+      "#if defined(_MSC_VER) && !defined(__clang__)\n"
+      "#include <intrin.h>\n"
+      "typedef void* volatile embedded_slot;\n"
+      "static char* embedded_slot_load(embedded_slot* slot) {\n"
+      "  return (char*)_InterlockedCompareExchangePointer(slot, NULL, NULL);\n"
+      "}\n"
+      "static int embedded_slot_publish(embedded_slot* slot, char* data) {\n"
+      "  return _InterlockedCompareExchangePointer(slot, data, NULL) == NULL;\n"
+      "}\n"
+      "#elif defined(__GNUC__) || defined(__clang__)\n"
+      "typedef char* embedded_slot;\n"
+      "static char* embedded_slot_load(embedded_slot* slot) {\n"
+      "  return __atomic_load_n(slot, __ATOMIC_ACQUIRE);\n"
+      "}\n"
+      "static int embedded_slot_publish(embedded_slot* slot, char* data) {\n"
+      "  char* expected = NULL;\n"
+      "  return __atomic_compare_exchange_n(\n"
+      "      slot, &expected, data, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);\n"
+      "}\n"
+      "#else\n"
+      "#include <stdatomic.h>\n"
+      "typedef _Atomic(char*) embedded_slot;\n"
+      "static char* embedded_slot_load(embedded_slot* slot) {\n"
+      "  return atomic_load_explicit(slot, memory_order_acquire);\n"
+      "}\n"
+      "static int embedded_slot_publish(embedded_slot* slot, char* data) {\n"
+      "  char* expected = NULL;\n"
+      "  return atomic_compare_exchange_strong(slot, &expected, data);\n"
+      "}\n"
+      "#endif\n"
+      "\n";
+
+static const char* file_cache_source
+    = "static embedded_slot EMBEDDED_FILE_CACHE[EMBEDDED_FILE_COUNT];\n"
+      "\n"
+      "// Returns a file's data, decompressing it on first use into memory\n"
+      "// that is kept for the life of the program\n"
+      "static const char* embedded_file_data(size_t i) {\n"
+      "  unsigned compression = EMBEDDED_FILE_COMPRESSION[i];\n"
+      "  if (compression == 0) {\n"
+      "    return EMBEDDED_PAYLOAD(i);\n"
+      "  }\n"
+      "  char* data = embedded_slot_load(&EMBEDDED_FILE_CACHE[i]);\n"
+      "  if (data) {\n"
+      "    return data;\n"
+      "  }\n"
+      "  size_t size = EMBEDDED_SIZE(i);\n"
+      "  size_t align = EMBEDDED_FILE_ALIGNS[i];\n"
+      "  char* block = (char*)malloc(size + align);\n"
+      "  if (!block) {\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  data = block + (align - (uintptr_t)block % align) % align;\n"
+      "  const unsigned char* in = (const unsigned char*)EMBEDDED_PAYLOAD(i);\n"
+      "  size_t in_size = EMBEDDED_FILE_STORED_SIZES[i];\n";
+
+// Decompresses a block compressed file block by block
+static const char* file_blocks_source
+    = "  int ok = 1;\n"
+      "  size_t block_size = EMBEDDED_FILE_BLOCK_SIZES[i];\n"
+      "  if (block_size) {\n"
+      "    for (size_t b = 0; ok && b * block_size < size; b++) {\n"
+      "      ok = embedded_decompress_block(\n"
+      "          i, b, (unsigned char*)data + b * block_size);\n"
+      "    }\n"
+      "  } else {\n"
+      "    ok = embedded_decompress(\n"
+      "        compression, in, in_size, (unsigned char*)data, size);\n"
+      "  }\n";
+
+static const char* file_whole_source
+    = "  int ok = embedded_decompress(\n"
+      "      compression, in, in_size, (unsigned char*)data, size);\n";
+
+static const char* file_cache_end_source
+    = "  if (!ok) {\n"
+      "    free(block);\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  data[size] = '\\0';\n"
+      "  if (!embedded_slot_publish(&EMBEDDED_FILE_CACHE[i], data)) {\n"
+      "    free(block);\n"
+      "    data = embedded_slot_load(&EMBEDDED_FILE_CACHE[i]);\n"
+      "  }\n"
+      "  return data;\n"
+      "}\n\n"
+      "#define EMBEDDED_DATA(i) (embedded_file_data(i))\n\n";
+
+// Decompresses a single block of a block compressed file
+static const char* decompress_block_source
+    = "// Decompresses block `b` of file `i` into `out`\n"
+      "static int embedded_decompress_block(\n"
+      "    size_t i, size_t b, unsigned char* out) {\n"
+      "  size_t block_size = EMBEDDED_FILE_BLOCK_SIZES[i];\n"
+      "  size_t start = b * block_size;\n"
+      "  size_t size = EMBEDDED_SIZE(i) - start < block_size\n"
+      "      ? EMBEDDED_SIZE(i) - start\n"
+      "      : block_size;\n"
+      "  size_t first = EMBEDDED_FILE_FIRST_BLOCK[i] + b;\n"
+      "  const unsigned char* in = (const unsigned char*)EMBEDDED_PAYLOAD(i);\n"
+      "  if (!in) {\n"
+      "    return 0;\n"
+      "  }\n"
+      "  in += EMBEDDED_BLOCK_OFFSETS[first];\n"
+      "  return embedded_decompress(EMBEDDED_FILE_COMPRESSION[i], in,\n"
+      "      EMBEDDED_BLOCK_OFFSETS[first + 1] - EMBEDDED_BLOCK_OFFSETS[first],\n"
+      "      out, size);\n"
+      "}\n\n";
+
+// Spin lock shared by the block cache and the overlay, held only for short
+// copies. The atomics come from slot_source or overlay_source.
+static const char* spin_lock_source
+    = "#if defined(_MSC_VER) && !defined(__clang__)\n"
+      "static volatile long embedded_lock_flag;\n"
+      "static void embedded_lock(void) {\n"
+      "  while (_InterlockedExchange(&embedded_lock_flag, 1)) {\n"
+      "  }\n"
+      "}\n"
+      "static void embedded_unlock(void) {\n"
+      "  _InterlockedExchange(&embedded_lock_flag, 0);\n"
+      "}\n"
+      "#elif defined(__GNUC__) || defined(__clang__)\n"
+      "static char embedded_lock_flag;\n"
+      "static void embedded_lock(void) {\n"
+      "  while (__atomic_test_and_set(&embedded_lock_flag, __ATOMIC_ACQUIRE)) "
+      "{\n"
+      "  }\n"
+      "}\n"
+      "static void embedded_unlock(void) {\n"
+      "  __atomic_clear(&embedded_lock_flag, __ATOMIC_RELEASE);\n"
+      "}\n"
+      "#else\n"
+      "static atomic_flag embedded_lock_flag = ATOMIC_FLAG_INIT;\n"
+      "static void embedded_lock(void) {\n"
+      "  while (atomic_flag_test_and_set_explicit(\n"
+      "      &embedded_lock_flag, memory_order_acquire)) {\n"
+      "  }\n"
+      "}\n"
+      "static void embedded_unlock(void) {\n"
+      "  atomic_flag_clear_explicit(&embedded_lock_flag, "
+      "memory_order_release);\n"
+      "}\n"
+      "#endif\n\n";
+
+// Reads ranges of block compressed files through a small cache of the most
+// recently used blocks, guarded by the spin lock
+static const char* block_cache_source
+    = "// Blocks of block compressed files kept for reads, define it as 0 to\n"
+      "// decompress the blocks of every read\n"
+      "#ifndef EMBEDDED_BLOCK_CACHE_SIZE\n"
+      "#define EMBEDDED_BLOCK_CACHE_SIZE 4\n"
+      "#endif\n\n"
+      "struct embedded_cached_block {\n"
+      "  size_t file;\n"
+      "  size_t block;\n"
+      "  unsigned char* data;\n"
+      "  unsigned long long used;\n"
+      "};\n\n"
+      "static struct embedded_cached_block\n"
+      "    EMBEDDED_BLOCK_CACHE[EMBEDDED_BLOCK_CACHE_SIZE > 0 ? "
+      "EMBEDDED_BLOCK_CACHE_SIZE : 1];\n"
+      "static unsigned long long embedded_block_clock;\n\n"
+      "// Copies `length` bytes from `offset` in block `b` of file `i`\n"
+      "static int embedded_copy_block(size_t i, size_t b, size_t offset,\n"
+      "    char* buffer, size_t length) {\n"
+      "  embedded_lock();\n"
+      "  for (size_t c = 0; c < EMBEDDED_BLOCK_CACHE_SIZE; c++) {\n"
+      "    struct embedded_cached_block* cached = &EMBEDDED_BLOCK_CACHE[c];\n"
+      "    if (cached->data && cached->file == i && cached->block == b) {\n"
+      "      memcpy(buffer, cached->data + offset, length);\n"
+      "      cached->used = ++embedded_block_clock;\n"
+      "      embedded_unlock();\n"
+      "      return 1;\n"
+      "    }\n"
+      "  }\n"
+      "  embedded_unlock();\n"
+      "  unsigned char* data\n"
+      "      = (unsigned char*)malloc(EMBEDDED_FILE_BLOCK_SIZES[i]);\n"
+      "  if (!data || !embedded_decompress_block(i, b, data)) {\n"
+      "    free(data);\n"
+      "    return 0;\n"
+      "  }\n"
+      "  memcpy(buffer, data + offset, length);\n"
+      "  // The least recently used block makes way for this one\n"
+      "  embedded_lock();\n"
+      "  size_t oldest = 0;\n"
+      "  for (size_t c = 1; c < EMBEDDED_BLOCK_CACHE_SIZE; c++) {\n"
+      "    if (EMBEDDED_BLOCK_CACHE[c].used < EMBEDDED_BLOCK_CACHE[oldest].used) "
+      "{\n"
+      "      oldest = c;\n"
+      "    }\n"
+      "  }\n"
+      "  if (EMBEDDED_BLOCK_CACHE_SIZE > 0) {\n"
+      "    struct embedded_cached_block* cached = &EMBEDDED_BLOCK_CACHE[oldest];\n"
+      "    unsigned char* evicted = cached->data;\n"
+      "    cached->file = i;\n"
+      "    cached->block = b;\n"
+      "    cached->data = data;\n"
+      "    cached->used = ++embedded_block_clock;\n"
+      "    data = evicted;\n"
+      "  }\n"
+      "  embedded_unlock();\n"
+      "  free(data);\n"
+      "  return 1;\n"
+      "}\n\n"
+      "// Reads part of a block compressed file, only decompressing the blocks\n"
+      "// covering it unless the whole file already is\n"
+      "static size_t embedded_read_blocks(\n"
+      "    size_t i, size_t offset, void* buffer, size_t length) {\n"
+      "  const char* data = embedded_slot_load(&EMBEDDED_FILE_CACHE[i]);\n"
+      "  if (data) {\n"
+      "    memcpy(buffer, data + offset, length);\n"
+      "    return length;\n"
+      "  }\n"
+      "  size_t block_size = EMBEDDED_FILE_BLOCK_SIZES[i];\n"
+      "  size_t done = 0;\n"
+      "  while (done < length) {\n"
+      "    size_t start = (offset + done) % block_size;\n"
+      "    size_t size = block_size - start < length - done\n"
+      "        ? block_size - start\n"
+      "        : length - done;\n"
+      "    if (!embedded_copy_block(i, (offset + done) / block_size, start,\n"
+      "            (char*)buffer + done, size)) {\n"
+      "      break;\n"
+      "    }\n"
+      "    done += size;\n"
+      "  }\n"
+      "  return done;\n"
+      "}\n\n";
+
+// Writes a table of one number per file
+static void output_file_table(struct output_buffer* out, const char* type,
+    const char* name, const size_t* values, size_t count)
+{
+  char line[128];
+  snprintf(line, sizeof(line), "static const %s %s[] = {", type, name);
+  output_buffer_puts(out, line);
+  for (size_t i = 0; i < count; i++) {
+    snprintf(line, sizeof(line), "%s%zu,", (i % 8) == 0 ? "\n\t" : "",
+        values[i]);
+    output_buffer_puts(out, line);
+  }
+  output_buffer_puts(out, "\n};\n\n");
+}
+
+// Generate the decoders for the compression used and the function that
+// decompresses and caches files on first access
+void generate_decompression(
+    FILE* fd, const struct options* options, const struct data_layout* layout)
+{
+  if (!layout->compressed_count) {
+    return;
+  }
+  struct output_buffer out;
+  output_buffer_init(&out, fd);
+  bool used[sizeof(compression_names) / sizeof(compression_names[0])]
+      = { false };
+  size_t* values = calloc(layout->count + 1, sizeof(size_t));
+  if (!values) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  bool blocks = false;
+  size_t block_count = 0;
+  size_t largest = 0;
+  for (size_t i = 0; i < layout->count; i++) {
+    values[i] = layout->compression[i];
+    used[layout->compression[i]] = true;
+    if (layout->block_offsets[i]) {
+      blocks = true;
+      block_count += (layout->original_sizes[i] + layout->block_sizes[i] - 1)
+              / layout->block_sizes[i]
+          + 1;
+      if (layout->sizes[i] > largest) {
+        largest = layout->sizes[i];
+      }
+    }
+  }
+  output_file_table(&out, "unsigned char", "EMBEDDED_FILE_COMPRESSION",
+      values, layout->count);
+  output_file_table(&out,
+      options->layout == LAYOUT_BLOB ? offset_type(layout->size) : "size_t",
+      "EMBEDDED_FILE_STORED_SIZES", layout->sizes, layout->count);
+  output_file_table(&out, "uint32_t", "EMBEDDED_FILE_ALIGNS",
+      layout->aligns, layout->count);
+  if (blocks) {
+    // Block offsets of each block compressed file, followed by the size of
+    // its payload. Duplicates use the offsets of the file they duplicate.
+    size_t* offsets = malloc(sizeof(size_t) * (block_count + 1));
+    size_t* first_blocks = malloc(sizeof(size_t) * (layout->count + 1));
+    if (!offsets || !first_blocks) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+    size_t offset_count = 0;
+    for (size_t i = 0; i < layout->count; i++) {
+      first_blocks[i] = 0;
+      if (layout->block_offsets[i]) {
+        first_blocks[i] = offset_count;
+        size_t count
+            = (layout->original_sizes[i] + layout->block_sizes[i] - 1)
+                / layout->block_sizes[i]
+            + 1;
+        memcpy(offsets + offset_count, layout->block_offsets[i],
+            sizeof(size_t) * count);
+        offset_count += count;
+      }
+    }
+    for (size_t i = 0; i < layout->count; i++) {
+      first_blocks[i] = first_blocks[layout->data_index[i]];
+    }
+    output_file_table(&out, "uint32_t", "EMBEDDED_FILE_BLOCK_SIZES",
+        layout->block_sizes, layout->count);
+    output_file_table(&out, offset_type(block_count),
+        "EMBEDDED_FILE_FIRST_BLOCK", first_blocks, layout->count);
+    output_file_table(&out, offset_type(largest), "EMBEDDED_BLOCK_OFFSETS",
+        offsets, offset_count);
+    free(first_blocks);
+    free(offsets);
+  }
+  free(values);
+  if (used[COMPRESS_LZ4]) {
+    output_buffer_puts(&out, lz4_source);
+    output_buffer_puts(&out, "\n");
+  }
+  if (used[COMPRESS_DEFLATE]) {
+    output_buffer_puts(&out, inflate_source);
+    output_buffer_puts(&out, "\n");
+  }
+  if (used[COMPRESS_ZSTD]) {
+    output_buffer_puts(&out, "#include <zstd.h>\n\n");
+  }
+  output_buffer_puts(&out,
+      "static int embedded_decompress(unsigned compression,\n"
+      "    const unsigned char* in, size_t in_size, unsigned char* data,\n"
+      "    size_t size) {\n"
+      "  int ok = 0;\n"
+      "  switch (compression) {\n");
+  char line[256];
+  if (used[COMPRESS_LZ4]) {
+    snprintf(line, sizeof(line),
+        "  case %d:\n"
+        "    ok = embedded_lz4(in, in_size, data, size);\n"
+        "    break;\n",
+        COMPRESS_LZ4);
+    output_buffer_puts(&out, line);
+  }
+  if (used[COMPRESS_DEFLATE]) {
+    snprintf(line, sizeof(line),
+        "  case %d:\n"
+        "    ok = embedded_inflate(in, in_size, data, size);\n"
+        "    break;\n",
+        COMPRESS_DEFLATE);
+    output_buffer_puts(&out, line);
+  }
+  if (used[COMPRESS_ZSTD]) {
+    snprintf(line, sizeof(line),
+        "  case %d: {\n"
+        "    size_t result = ZSTD_decompress(data, size, in, in_size);\n"
+        "    ok = !ZSTD_isError(result) && result == size;\n"
+        "    break;\n"
+        "  }\n",
+        COMPRESS_ZSTD);
+    output_buffer_puts(&out, line);
+  }
+  output_buffer_puts(&out,
+      "  }\n"
+      "  return ok;\n"
+      "}\n\n");
+  if (blocks) {
+    output_buffer_puts(&out, decompress_block_source);
+  }
+  // The pack's code already has the atomics, and its data is NULL when the
+  // pack is missing
+  if (options->backend != BACKEND_PACK) {
+    output_buffer_puts(&out, slot_source);
+  }
+  output_buffer_puts(&out, file_cache_source);
+  if (options->backend == BACKEND_PACK) {
+    output_buffer_puts(&out,
+        "  if (!in) {\n"
+        "    free(block);\n"
+        "    return NULL;\n"
+        "  }\n");
+  }
+  output_buffer_puts(&out, blocks ? file_blocks_source : file_whole_source);
+  output_buffer_puts(&out, file_cache_end_source);
+  if (blocks) {
+    output_buffer_puts(&out, spin_lock_source);
+    output_buffer_puts(&out, block_cache_source);
+  }
+  output_buffer_free(&out);
+}
+
+// Opens, maps or reads files of the overlay and loads them again when they
+// change. Mapped files end in zeros up to the end of their page, files
+// filling their last page are read instead, so the data is null terminated
+// like the embedded copies.
+static const char* overlay_source
+    = "// What tells versions of a file apart, to notice when it changes\n"
+      "struct embedded_overlay_stamp {\n"
+      "  unsigned long long size;\n"
+      "  unsigned long long modified;\n"
+      "  unsigned long long id;\n"
+      "};\n\n"
+      "struct embedded_overlay_file {\n"
+      "  struct embedded_overlay_stamp stamp;\n"
+      "  const char* data;\n"
+      "};\n\n"
+      "static struct embedded_overlay_file\n"
+      "    EMBEDDED_OVERLAY_FILES[EMBEDDED_FILE_COUNT];\n"
+      "static char* embedded_overlay_directory;\n"
+      "static int embedded_overlay_ready;\n\n"
+      "// Joins `directory` and `name`, or copies `directory` without a name\n"
+      "static char* embedded_overlay_path(\n"
+      "    const char* directory, const char* name) {\n"
+      "  size_t length = directory ? strlen(directory) : 0;\n"
+      "  size_t name_length = name ? strlen(name) : 0;\n"
+      "  char* path\n"
+      "      = directory ? (char*)malloc(length + name_length + 2) : NULL;\n"
+      "  if (path) {\n"
+      "    memcpy(path, directory, length);\n"
+      "    path[length] = '/';\n"
+      "    memcpy(path + length + 1, name, name_length);\n"
+      "    path[length + (name ? name_length + 1 : 0)] = '\\0';\n"
+      "  }\n"
+      "  return path;\n"
+      "}\n\n"
+      "#ifdef _WIN32\n"
+      "static const char* embedded_overlay_load(const char* path,\n"
+      "    const struct embedded_overlay_file* cached,\n"
+      "    struct embedded_overlay_stamp* stamp) {\n"
+      "  HANDLE file = CreateFileA(path, GENERIC_READ,\n"
+      "      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,\n"
+      "      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);\n"
+      "  if (file == INVALID_HANDLE_VALUE) {\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  BY_HANDLE_FILE_INFORMATION info;\n"
+      "  const char* data = NULL;\n"
+      "  if (GetFileInformationByHandle(file, &info)\n"
+      "      && !(info.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {\n"
+      "    SYSTEM_INFO system;\n"
+      "    GetSystemInfo(&system);\n"
+      "    stamp->size = (unsigned long long)info.nFileSizeHigh << 32\n"
+      "        | info.nFileSizeLow;\n"
+      "    FILETIME modified = info.ftLastWriteTime;\n"
+      "    stamp->modified = (unsigned long long)modified.dwHighDateTime << 32\n"
+      "        | modified.dwLowDateTime;\n"
+      "    stamp->id = (unsigned long long)info.nFileIndexHigh << 32\n"
+      "        | info.nFileIndexLow;\n"
+      "    if (cached->data\n"
+      "        && 0 == memcmp(stamp, &cached->stamp, sizeof(*stamp))) {\n"
+      "      data = cached->data;\n"
+      "    } else if (stamp->size < (size_t)-1\n"
+      "        && stamp->size % system.dwPageSize) {\n"
+      "      HANDLE mapping\n"
+      "          = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);\n"
+      "      if (mapping) {\n"
+      "        data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, "
+      "0);\n"
+      "        CloseHandle(mapping);\n"
+      "      }\n"
+      "    } else if (stamp->size < (size_t)-1) {\n"
+      "      char* copy = (char*)malloc((size_t)stamp->size + 1);\n"
+      "      size_t done = 0;\n"
+      "      DWORD length = 1;\n"
+      "      while (copy && done < stamp->size && length) {\n"
+      "        DWORD want = stamp->size - done < 1u << 30\n"
+      "            ? (DWORD)(stamp->size - done)\n"
+      "            : 1u << 30;\n"
+      "        length = 0;\n"
+      "        ReadFile(file, copy + done, want, &length, NULL);\n"
+      "        done += length;\n"
+      "      }\n"
+      "      if (copy && done == stamp->size) {\n"
+      "        copy[done] = '\\0';\n"
+      "        data = copy;\n"
+      "      } else {\n"
+      "        free(copy);\n"
+      "      }\n"
+      "    }\n"
+      "  }\n"
+      "  CloseHandle(file);\n"
+      "  return data;\n"
+      "}\n"
+      "#else\n"
+      "static const char* embedded_overlay_load(const char* path,\n"
+      "    const struct embedded_overlay_file* cached,\n"
+      "    struct embedded_overlay_stamp* stamp) {\n"
+      "  int fd = open(path, O_RDONLY);\n"
+      "  if (fd < 0) {\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  struct stat st;\n"
+      "  const char* data = NULL;\n"
+      "  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {\n"
+      "    stamp->size = (unsigned long long)st.st_size;\n"
+      "    stamp->modified = (unsigned long long)st.st_mtime;\n"
+      "    stamp->id = (unsigned long long)st.st_ino;\n"
+      "    if (cached->data\n"
+      "        && 0 == memcmp(stamp, &cached->stamp, sizeof(*stamp))) {\n"
+      "      data = cached->data;\n"
+      "    } else if (stamp->size < (size_t)-1\n"
+      "        && stamp->size % (unsigned long long)sysconf(_SC_PAGESIZE)) {\n"
+      "      void* mapped = mmap(\n"
+      "          NULL, (size_t)stamp->size, PROT_READ, MAP_PRIVATE, fd, 0);\n"
+      "      data = mapped == MAP_FAILED ? NULL : (const char*)mapped;\n"
+      "    } else if (stamp->size < (size_t)-1) {\n"
+      "      char* copy = (char*)malloc((size_t)stamp->size + 1);\n"
+      "      size_t done = 0;\n"
+      "      ssize_t length = 1;\n"
+      "      while (copy && done < stamp->size && length > 0) {\n"
+      "        length = read(fd, copy + done, (size_t)stamp->size - done);\n"
+      "        done += length > 0 ? (size_t)length : 0;\n"
+      "      }\n"
+      "      if (copy && done == stamp->size) {\n"
+      "        copy[done] = '\\0';\n"
+      "        data = copy;\n"
+      "      } else {\n"
+      "        free(copy);\n"
+      "      }\n"
+      "    }\n"
+      "  }\n"
+      "  close(fd);\n"
+      "  return data;\n"
+      "}\n"
+      "#endif\n\n"
+      "// Returns file `i` from the overlay directory, or NULL to use the\n"
+      "// embedded copy. Earlier versions of a file that changed are kept for\n"
+      "// callers still holding them.\n"
+      "static const char* embedded_overlay(size_t i, size_t* length) {\n"
+      "  embedded_lock();\n"
+      "  if (!embedded_overlay_ready) {\n"
+      "    const char* directory = getenv(EMBEDDED_OVERLAY_VARIABLE);\n"
+      "    embedded_overlay_directory = embedded_overlay_path(directory, NULL);\n"
+      "    embedded_overlay_ready = 1;\n"
+      "  }\n"
+      "  char* path = embedded_overlay_path(\n"
+      "      embedded_overlay_directory, EMBEDDED_NAME(i));\n"
+      "  struct embedded_overlay_file cached = EMBEDDED_OVERLAY_FILES[i];\n"
+      "  embedded_unlock();\n"
+      "  if (!path) {\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  struct embedded_overlay_file loaded;\n"
+      "  loaded.data = embedded_overlay_load(path, &cached, &loaded.stamp);\n"
+      "  free(path);\n"
+      "  if (!loaded.data) {\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  if (loaded.data != cached.data) {\n"
+      "    embedded_lock();\n"
+      "    EMBEDDED_OVERLAY_FILES[i] = loaded;\n"
+      "    embedded_unlock();\n"
+      "  }\n"
+      "  if (length) {\n"
+      "    *length = (size_t)loaded.stamp.size;\n"
+      "  }\n"
+      "  return loaded.data;\n"
+      "}\n"
+      "#endif\n\n";
+
+// Simply make it upper case and replace everything not a letter with _
+// Makes no attempt to deal with character encoding
+void generate_define_name(const char* filename, char* output_file)
+{
+  const char* c = filename;
+  char* o = output_file;
+  while (*c != '\0') {
+    if (*c >= 'A' && *c <= 'Z') {
+      *o = *c;
+    } else if (*c >= 'a' && *c <= 'z') {
+      *o = *c - ('a' - 'A');
+    } else {
+      *o = '_';
+    }
+    o++;
+    c++;
+  }
+  *o = '\0';
+}
+
+// As generate_define_name but keeping digits, for the names of generated
+// identifiers and environment variables
+void generate_identifier_name(const char* filename, char* output_file)
+{
+  const char* c = filename;
+  char* o = output_file;
+  while (*c != '\0') {
+    if ((*c >= 'A' && *c <= 'Z') || (*c >= '0' && *c <= '9')) {
+      *o = *c;
+    } else if (*c >= 'a' && *c <= 'z') {
+      *o = *c - ('a' - 'A');
+    } else {
+      *o = '_';
+    }
+    o++;
+    c++;
+  }
+  *o = '\0';
+}
+
+// Whether any file is compressed in blocks
+static bool has_blocks(const struct data_layout* layout)
+{
+  for (size_t i = 0; i < layout->count; i++) {
+    if (layout->block_offsets[i]) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// With --overlay, the functions serve files from a directory on disk in
+// place of the embedded copies, unless the source is compiled with
+// EMBEDDED_OVERLAY defined as 0, as it is by default with NDEBUG
+void generate_overlay(
+    FILE* fd, const struct options* options, const struct data_layout* layout)
+{
+  if (!options->overlay) {
+    return;
+  }
+  const char* function_name = options->function_name;
+  char variable[strlen(function_name) + 1];
+  generate_identifier_name(function_name, variable);
+  fprintf(fd,
+      "// Files are served from the directory in %s_OVERLAY or given to\n"
+      "// %s_set_overlay() when they are there. Builds with NDEBUG leave\n"
+      "// this out unless EMBEDDED_OVERLAY is defined as 1.\n"
+      "#ifndef EMBEDDED_OVERLAY\n"
+      "#ifdef NDEBUG\n"
+      "#define EMBEDDED_OVERLAY 0\n"
+      "#else\n"
+      "#define EMBEDDED_OVERLAY 1\n"
+      "#endif\n"
+      "#endif\n\n"
+      "#if EMBEDDED_OVERLAY\n"
+      "#if defined(_MSC_VER) && !defined(__clang__)\n"
+      "#include <intrin.h>\n"
+      "#elif !defined(__GNUC__) && !defined(__clang__)\n"
+      "#include <stdatomic.h>\n"
+      "#endif\n"
+      "#ifdef _WIN32\n"
+      "#include <windows.h>\n"
+      "#else\n"
+      "#include <fcntl.h>\n"
+      "#include <sys/mman.h>\n"
+      "#include <sys/stat.h>\n"
+      "#include <unistd.h>\n"
+      "#endif\n"
+      "#define EMBEDDED_OVERLAY_VARIABLE \"%s_OVERLAY\"\n\n",
+      variable, function_name, variable);
+  if (!has_blocks(layout)) {
+    fputs(spin_lock_source, fd);
+  }
+  fputs(overlay_source, fd);
+  fprintf(fd,
+      "void %s_set_overlay(const char* directory) {\n"
+      "#if EMBEDDED_OVERLAY\n"
+      "  char* copy = embedded_overlay_path(directory, NULL);\n"
+      "  embedded_lock();\n"
+      "  char* previous = embedded_overlay_directory;\n"
+      "  embedded_overlay_directory = copy;\n"
+      "  embedded_overlay_ready = 1;\n"
+      "  embedded_unlock();\n"
+      "  free(previous);\n"
+      "#else\n"
+      "  (void)directory;\n"
+      "#endif\n"
+      "}\n\n",
+      function_name);
+}
+
+// Maps the pack read only, checking it has the size the source expects
+static const char* pack_map_source
+    = "#ifdef _WIN32\n"
+      "static char* embedded_pack_map(const char* path) {\n"
+      "  HANDLE file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,\n"
+      "      OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);\n"
+      "  if (file == INVALID_HANDLE_VALUE) {\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  LARGE_INTEGER size;\n"
+      "  char* data = NULL;\n"
+      "  if (GetFileSizeEx(file, &size)\n"
+      "      && (unsigned long long)size.QuadPart == EMBEDDED_PACK_SIZE) {\n"
+      "    HANDLE mapping\n"
+      "        = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);\n"
+      "    if (mapping) {\n"
+      "      data = (char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);\n"
+      "      CloseHandle(mapping);\n"
+      "    }\n"
+      "  }\n"
+      "  CloseHandle(file);\n"
+      "  return data;\n"
+      "}\n"
+      "static void embedded_pack_unmap(char* data) {\n"
+      "  UnmapViewOfFile(data);\n"
+      "}\n"
+      "#else\n"
+      "static char* embedded_pack_map(const char* path) {\n"
+      "  int fd = open(path, O_RDONLY);\n"
+      "  if (fd < 0) {\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  struct stat st;\n"
+      "  char* data = NULL;\n"
+      "  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)\n"
+      "      && (unsigned long long)st.st_size == EMBEDDED_PACK_SIZE\n"
+      "      && EMBEDDED_PACK_SIZE <= (size_t)-1) {\n"
+      "    void* mapped = mmap(\n"
+      "        NULL, (size_t)EMBEDDED_PACK_SIZE, PROT_READ, MAP_PRIVATE, fd, 0);\n"
+      "    data = mapped == MAP_FAILED ? NULL : (char*)mapped;\n"
+      "  }\n"
+      "  close(fd);\n"
+      "  return data;\n"
+      "}\n"
+      "static void embedded_pack_unmap(char* data) {\n"
+      "  munmap(data, (size_t)EMBEDDED_PACK_SIZE);\n"
+      "}\n"
+      "#endif\n\n"
+      "// Maps the pack on first use and keeps it mapped, returning where its\n"
+      "// data starts, or NULL while it is missing or written for other files\n"
+      "static const char* embedded_pack_data(void) {\n"
+      "  char* pack = embedded_slot_load(&embedded_pack);\n"
+      "  if (pack) {\n"
+      "    return pack + EMBEDDED_PACK_DATA_OFFSET;\n"
+      "  }\n"
+      "  const char* path = embedded_slot_load(&embedded_pack_path);\n"
+      "  if (!path) {\n"
+      "    path = getenv(EMBEDDED_PACK_VARIABLE);\n"
+      "  }\n"
+      "  pack = embedded_pack_map(path ? path : EMBEDDED_PACK_PATH);\n"
+      "  if (!pack) {\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  if (0 != memcmp(pack, EMBEDDED_PACK_HEADER, "
+      "sizeof(EMBEDDED_PACK_HEADER))) {\n"
+      "    embedded_pack_unmap(pack);\n"
+      "    return NULL;\n"
+      "  }\n"
+      "  if (!embedded_slot_publish(&embedded_pack, pack)) {\n"
+      "    embedded_pack_unmap(pack);\n"
+      "    pack = embedded_slot_load(&embedded_pack);\n"
+      "  }\n"
+      "  return pack + EMBEDDED_PACK_DATA_OFFSET;\n"
+      "}\n\n"
+      "static const char* embedded_pack_file(size_t offset) {\n"
+      "  const char* data = embedded_pack_data();\n"
+      "  return data ? data + offset : NULL;\n"
+      "}\n\n";
+
+// With --pack, the code mapping the pack the first time a file is retrieved.
+// The header the pack starts with is checked so a stale pack is not used.
+void generate_pack_access(
+    FILE* fd, const struct options* options, const struct data_layout* layout)
+{
+  if (options->backend != BACKEND_PACK) {
+    return;
+  }
+  const char* function_name = options->function_name;
+  char variable[strlen(function_name) + 1];
+  generate_identifier_name(function_name, variable);
+  char* path = c_string_escape(options->pack_file);
+  uint64_t id = pack_id(layout);
+  fprintf(fd,
+      "#ifdef _WIN32\n"
+      "#include <windows.h>\n"
+      "#else\n"
+      "#include <fcntl.h>\n"
+      "#include <sys/mman.h>\n"
+      "#include <sys/stat.h>\n"
+      "#include <unistd.h>\n"
+      "#endif\n\n");
+  fputs(slot_source, fd);
+  fprintf(fd,
+      "// The pack is read from %s_PACK or the path given to\n"
+      "// %s_set_pack() when they are set\n"
+      "#ifndef EMBEDDED_PACK_PATH\n"
+      "#define EMBEDDED_PACK_PATH \"%s\"\n"
+      "#endif\n"
+      "#define EMBEDDED_PACK_VARIABLE \"%s_PACK\"\n"
+      "#define EMBEDDED_PACK_SIZE %zuULL\n"
+      "#define EMBEDDED_PACK_DATA_OFFSET %zu\n\n"
+      "static const unsigned char EMBEDDED_PACK_HEADER[16] = {",
+      variable, function_name, path, variable,
+      pack_data_offset(layout) + layout->size, pack_data_offset(layout));
+  for (int i = 0; i < 16; i++) {
+    unsigned char byte = i < 8 ? (unsigned char)PACK_MAGIC[i]
+                               : (unsigned char)(id >> (8 * (i - 8)));
+    fprintf(fd, "%s0x%02x,", i % 8 == 0 ? "\n\t" : " ", byte);
+  }
+  fprintf(fd,
+      "\n};\n\n"
+      "static embedded_slot embedded_pack;\n"
+      "static embedded_slot embedded_pack_path;\n\n");
+  fputs(pack_map_source, fd);
+  fprintf(fd,
+      "// The path is published like the mapping, so it is never freed while\n"
+      "// another thread maps the pack, and only the first path given counts\n"
+      "void %s_set_pack(const char* path) {\n"
+      "  char* copy = path ? (char*)malloc(strlen(path) + 1) : NULL;\n"
+      "  if (copy) {\n"
+      "    strcpy(copy, path);\n"
+      "    if (!embedded_slot_publish(&embedded_pack_path, copy)) {\n"
+      "      free(copy);\n"
+      "    }\n"
+      "  }\n"
+      "}\n\n",
+      function_name);
+  free(path);
+}
+
+// Code returning file `index` from the overlay when it is there, indented by
+// `indent`, or nothing without --overlay
+static void overlay_check(char* text, size_t size,
+    const struct options* options, int indent, const char* index)
+{
+  text[0] = '\0';
+  if (options->overlay) {
+    snprintf(text, size,
+        "#if EMBEDDED_OVERLAY\n"
+        "%*sconst char* overlay = embedded_overlay(%s, length);\n"
+        "%*sif (overlay) {\n"
+        "%*s  return overlay;\n"
+        "%*s}\n"
+        "#endif\n",
+        indent, "", index, indent, "", indent, "", indent, "");
+  }
+}
+
+struct sorted_file {
+  char* path;
+  const char* name;
+  size_t length;
+  size_t index;
+};
+
+// Orders names by length, then by their bytes, which lets a search skip the
+// memcmp when lengths differ. Equal names keep their command line order.
+static int compare_sorted_file(const void* a, const void* b)
+{
+  const struct sorted_file* left = a;
+  const struct sorted_file* right = b;
+  if (left->length != right->length) {
+    return left->length < right->length ? -1 : 1;
+  }
+  int order = memcmp(left->name, right->name, left->length);
+  if (order != 0) {
+    return order;
+  }
+  return left->index < right->index ? -1 : (left->index > right->index);
+}
+
+// Sorts the file list and the options of each file for the sorted lookup
+static void sort_files(
+    char** files, struct file_options* file_options, bool preserve_paths)
+{
+  size_t file_count = 0;
+  while (files[file_count]) {
+    file_count++;
+  }
+  struct sorted_file* sorted = malloc(sizeof(*sorted) * (file_count + 1));
+  struct file_options* sorted_options
+      = malloc(sizeof(*sorted_options) * (file_count + 1));
+  if (!sorted || !sorted_options) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < file_count; i++) {
+    sorted[i].path = files[i];
+    sorted[i].name = file_name(files[i], preserve_paths);
+    sorted[i].length = strlen(sorted[i].name);
+    sorted[i].index = i;
+  }
+  qsort(sorted, file_count, sizeof(*sorted), compare_sorted_file);
+  for (size_t i = 0; i < file_count; i++) {
+    files[i] = sorted[i].path;
+    sorted_options[i] = file_options[sorted[i].index];
+  }
+  memcpy(file_options, sorted_options, sizeof(*file_options) * file_count);
+  free(sorted_options);
+  free(sorted);
+}
+
+// Hash for file names, the generated code carries the same function. FNV-1a
+// finished with the murmur3 mixer so every bit of the result is usable
+static uint64_t name_hash(const char* name, size_t length, uint64_t seed)
+{
+  uint64_t h = seed ^ 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < length; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 0x100000001b3ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+static const char* name_hash_source
+    = "static uint64_t embedded_name_hash(const char* name, size_t length) {\n"
+      "  uint64_t h = EMBEDDED_HASH_SEED ^ 0xcbf29ce484222325ULL;\n"
+      "  for (size_t i = 0; i < length; i++) {\n"
+      "    h ^= (unsigned char)name[i];\n"
+      "    h *= 0x100000001b3ULL;\n"
+      "  }\n"
+      "  h ^= h >> 33;\n"
+      "  h *= 0xff51afd7ed558ccdULL;\n"
+      "  h ^= h >> 33;\n"
+      "  h *= 0xc4ceb9fe1a85ec53ULL;\n"
+      "  h ^= h >> 33;\n"
+      "  return h;\n"
+      "}\n\n";
+
+// Keys per bucket of the perfect hash, more is smaller but slower to build
+#define HASH_BUCKET_SIZE 4
+
+// Splits a name hash into its bucket and the two values for the displacement
+#define HASH_BUCKET(h, buckets) ((uint32_t)((h) >> 32) % (buckets))
+#define HASH_F1(h) ((uint32_t)(h))
+#define HASH_F2(h) ((uint32_t)(((h) * 0x9E3779B97F4A7C15ULL) >> 32))
+#define HASH_SLOT(h, d1, d2, count) \
+  (((uint64_t)HASH_F1(h) + (uint64_t)(d1) * HASH_F2(h) + (d2)) % (count))
+
+// A minimal perfect hash over file names using hash and displace: names are
+// spread over buckets, then buckets are placed largest first by searching for
+// a displacement (d1, d2) that lands all their names on free slots
+struct perfect_hash {
+  uint64_t seed;
+  size_t count;
+  size_t buckets;
+  // d1, d2 pairs for each bucket
+  uint32_t* displacements;
+  // Index of the file for each slot
+  uint32_t* slots;
+};
+
+struct hash_bucket {
+  size_t index;
+  size_t size;
+  size_t first;
+};
+
+static int compare_bucket_size(const void* a, const void* b)
+{
+  const struct hash_bucket* left = a;
+  const struct hash_bucket* right = b;
+  if (left->size != right->size) {
+    return left->size < right->size ? 1 : -1;
+  }
+  return left->index < right->index ? -1 : (left->index > right->index);
+}
+
+static bool try_perfect_hash(struct perfect_hash* hash, const uint64_t* hashes,
+    const uint32_t* keys, size_t count)
+{
+  size_t buckets = hash->buckets;
+  struct hash_bucket* order = calloc(buckets, sizeof(*order));
+  // Keys sorted by bucket
+  uint32_t* bucket_keys = malloc(sizeof(uint32_t) * count);
+  // Generation each slot was tried in while placing a bucket
+  size_t* tried = calloc(count, sizeof(size_t));
+  uint32_t* positions = malloc(sizeof(uint32_t) * count);
+  bool* used = calloc(count, sizeof(bool));
+  if (!order || !bucket_keys || !tried || !positions || !used) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  for (size_t b = 0; b < buckets; b++) {
+    order[b].index = b;
+  }
+  for (size_t i = 0; i < count; i++) {
+    order[HASH_BUCKET(hashes[i], buckets)].size++;
+  }
+  size_t first = 0;
+  for (size_t b = 0; b < buckets; b++) {
+    order[b].first = first;
+    first += order[b].size;
+    order[b].size = 0;
+  }
+  for (size_t i = 0; i < count; i++) {
+    struct hash_bucket* bucket = &order[HASH_BUCKET(hashes[i], buckets)];
+    bucket_keys[bucket->first + bucket->size++] = i;
+  }
+  qsort(order, buckets, sizeof(*order), compare_bucket_size);
+  bool found = true;
+  size_t generation = 0;
+  for (size_t b = 0; b < buckets && found && order[b].size > 0; b++) {
+    const uint32_t* members = &bucket_keys[order[b].first];
+    found = false;
+    for (uint32_t d1 = 0; d1 < count && !found; d1++) {
+      for (uint32_t d2 = 0; d2 < count && !found; d2++) {
+        generation++;
+        size_t placed = 0;
+        for (; placed < order[b].size; placed++) {
+          uint64_t h = hashes[members[placed]];
+          uint32_t slot = HASH_SLOT(h, d1, d2, count);
+          if (used[slot] || tried[slot] == generation) {
+            break;
+          }
+          tried[slot] = generation;
+          positions[placed] = slot;
+        }
+        if (placed == order[b].size) {
+          for (size_t k = 0; k < placed; k++) {
+            used[positions[k]] = true;
+            hash->slots[positions[k]] = keys[members[k]];
+          }
+          hash->displacements[order[b].index * 2] = d1;
+          hash->displacements[order[b].index * 2 + 1] = d2;
+          found = true;
+        }
+      }
+    }
+  }
+  free(order);
+  free(bucket_keys);
+  free(tried);
+  free(positions);
+  free(used);
+  return found;
+}
+
+struct name_hash_entry {
+  uint64_t hash;
+  uint32_t file;
+};
+
+static int compare_name_hash(const void* a, const void* b)
+{
+  const struct name_hash_entry* left = a;
+  const struct name_hash_entry* right = b;
+  if (left->hash != right->hash) {
+    return left->hash < right->hash ? -1 : 1;
+  }
+  return left->file < right->file ? -1 : (left->file > right->file);
+}
+
+// Builds a perfect hash over the names of the files. Only the first file with
+// a given name takes part, as the linear lookup would never find the others
+static void build_perfect_hash(
+    struct perfect_hash* hash, char* const* files, bool preserve_paths)
+{
+  size_t file_count = 0;
+  while (files[file_count]) {
+    file_count++;
+  }
+  struct name_hash_entry* entries
+      = malloc(sizeof(struct name_hash_entry) * (file_count + 1));
+  uint32_t* keys = malloc(sizeof(uint32_t) * (file_count + 1));
+  uint64_t* hashes = malloc(sizeof(uint64_t) * (file_count + 1));
+  if (!entries || !keys || !hashes) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  hash->seed = 0;
+  for (int attempt = 0;; attempt++) {
+    for (size_t i = 0; i < file_count; i++) {
+      const char* name = file_name(files[i], preserve_paths);
+      entries[i].hash = name_hash(name, strlen(name), hash->seed);
+      entries[i].file = i;
+    }
+    // Sorting puts equal hashes next to each other, with the first file of a
+    // duplicated name leading
+    qsort(entries, file_count, sizeof(*entries), compare_name_hash);
+    size_t count = 0;
+    bool collision = false;
+    for (size_t i = 0; i < file_count && !collision; i++) {
+      if (count > 0 && hashes[count - 1] == entries[i].hash) {
+        const char* name = file_name(files[entries[i].file], preserve_paths);
+        const char* other = file_name(files[keys[count - 1]], preserve_paths);
+        // Equal full hashes for different names need a new seed
+        collision = 0 != strcmp(name, other);
+        continue;
+      }
+      keys[count] = entries[i].file;
+      hashes[count] = entries[i].hash;
+      count++;
+    }
+    if (!collision) {
+      hash->count = count;
+      hash->buckets = (count + HASH_BUCKET_SIZE - 1) / HASH_BUCKET_SIZE;
+      hash->displacements = calloc(hash->buckets * 2 + 2, sizeof(uint32_t));
+      hash->slots = calloc(count + 1, sizeof(uint32_t));
+      if (!hash->displacements || !hash->slots) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+      }
+      if (try_perfect_hash(hash, hashes, keys, count)) {
+        break;
+      }
+      free(hash->displacements);
+      free(hash->slots);
+    }
+    if (attempt == 100) {
+      fprintf(stderr, "Could not build a perfect hash of the file names\n");
+      exit(1);
+    }
+    hash->seed = name_hash((const char*)&hash->seed, sizeof(hash->seed), 1);
+  }
+  free(entries);
+  free(keys);
+  free(hashes);
+}
+
+// An empty set has no tables, only the hash of names for <function>_hash()
+static void generate_hash_tables(FILE* fd, const struct perfect_hash* hash)
+{
+  struct output_buffer out;
+  output_buffer_init(&out, fd);
+  char line[256];
+  snprintf(line, sizeof(line), "#define EMBEDDED_HASH_SEED 0x%016llXULL\n",
+      (unsigned long long)hash->seed);
+  output_buffer_puts(&out, line);
+  if (!hash->count) {
+    output_buffer_puts(&out, name_hash_source);
+    output_buffer_free(&out);
+    return;
+  }
+  snprintf(line, sizeof(line),
+      "#define EMBEDDED_HASH_BUCKETS %zu\n"
+      "#define EMBEDDED_HASH_COUNT %zu\n",
+      hash->buckets, hash->count);
+  output_buffer_puts(&out, line);
+  output_buffer_puts(&out, name_hash_source);
+  output_buffer_puts(&out,
+      "static const uint32_t EMBEDDED_HASH_DISPLACEMENTS[][2] = {");
+  for (size_t b = 0; b < hash->buckets; b++) {
+    snprintf(line, sizeof(line), "%s{%u,%u},", (b % 8) == 0 ? "\n\t" : "",
+        hash->displacements[b * 2], hash->displacements[b * 2 + 1]);
+    output_buffer_puts(&out, line);
+  }
+  output_buffer_puts(&out, "\n};\n\n");
+  output_buffer_puts(&out, "static const uint32_t EMBEDDED_HASH_SLOTS[] = {");
+  for (size_t i = 0; i < hash->count; i++) {
+    snprintf(line, sizeof(line), "%s%u,", (i % 16) == 0 ? "\n\t" : "",
+        hash->slots[i]);
+    output_buffer_puts(&out, line);
+  }
+  output_buffer_puts(&out, "\n};\n\n");
+  output_buffer_free(&out);
+}
+
+// Generate the function for getting file data
+void generate_function(
+    FILE* fd, char* const* files, const struct options* options)
+{
+  const char* function_name = options->function_name;
+  enum lookup lookup = options->lookup;
+  bool preserve_paths = options->preserve_paths;
+  if (lookup == LOOKUP_HASH) {
+    struct perfect_hash hash;
+    build_perfect_hash(&hash, files, preserve_paths);
+    generate_hash_tables(fd, &hash);
+    free(hash.displacements);
+    free(hash.slots);
+    char overlay[256];
+    overlay_check(overlay, sizeof(overlay), options, 4, "i");
+    // No name is found in an empty set, which has no buckets to divide by
+    if (!hash.count) {
+      fprintf(fd,
+          "const char* %s_hashed(uint64_t h, const char* filename,\n"
+          "    size_t name_length, size_t* length) {\n"
+          "  (void)h;\n"
+          "  (void)filename;\n"
+          "  (void)name_length;\n"
+          "  (void)length;\n"
+          "  return NULL;\n"
+          "}\n\n",
+          function_name);
+    } else {
+      fprintf(fd,
+          "const char* %s_hashed(uint64_t h, const char* filename,\n"
+          "    size_t name_length, size_t* length) {\n"
+          "  const uint32_t* d = EMBEDDED_HASH_DISPLACEMENTS[\n"
+          "      (uint32_t)(h >> 32) %% EMBEDDED_HASH_BUCKETS];\n"
+          "  uint64_t f1 = (uint32_t)h;\n"
+          "  uint64_t f2 = (uint32_t)((h * 0x9E3779B97F4A7C15ULL) >> 32);\n"
+          "  uint32_t i\n"
+          "      = EMBEDDED_HASH_SLOTS[(f1 + d[0] * f2 + d[1]) %% "
+          "EMBEDDED_HASH_COUNT];\n"
+          "  if (EMBEDDED_FILE_NAME_LENGTHS[i] == name_length\n"
+          "      && 0 == memcmp(filename, EMBEDDED_NAME(i), name_length)) "
+          "{\n"
+          "%s"
+          "    if (length) {\n"
+          "      *length = EMBEDDED_SIZE(i);\n"
+          "    }\n"
+          "    return EMBEDDED_DATA(i);\n"
+          "  }\n"
+          "  return NULL;\n"
+          "}\n\n",
+          function_name, overlay);
+    }
+    fprintf(fd,
+        "uint64_t %s_hash(const char* filename, size_t name_length) {\n"
+        "  return embedded_name_hash(filename, name_length);\n"
+        "}\n\n"
+        "const char* %s_n(\n"
+        "    const char* filename, size_t name_length, size_t* length) {\n"
+        "  return %s_hashed(embedded_name_hash(filename, name_length),\n"
+        "      filename, name_length, length);\n"
+        "}\n\n"
+        "const char* %s(const char* filename, size_t* length) {\n"
+        "  return %s_n(filename, strlen(filename), length);\n"
+        "}\n\n",
+        function_name, function_name, function_name, function_name,
+        function_name);
+    return;
+  }
+  char overlay[256];
+  if (lookup == LOOKUP_SORTED) {
+    // Finds the first entry not ordered before the name, so the first of
+    // several files with the same name is the one found
+    overlay_check(overlay, sizeof(overlay), options, 4, "low");
+    fprintf(fd,
+        "const char* %s_n(\n"
+        "    const char* filename, size_t name_length, size_t* length) {\n"
+        "  size_t count = sizeof(EMBEDDED_FILE_DATA_SIZES)\n"
+        "      / sizeof(EMBEDDED_SIZE(0));\n"
+        "  size_t low = 0;\n"
+        "  size_t high = count;\n"
+        "  while (low < high) {\n"
+        "    size_t mid = low + (high - low) / 2;\n"
+        "    size_t mid_length = EMBEDDED_FILE_NAME_LENGTHS[mid];\n"
+        "    if (mid_length < name_length\n"
+        "        || (mid_length == name_length\n"
+        "            && memcmp(EMBEDDED_NAME(mid), filename, name_length)\n"
+        "                < 0)) {\n"
+        "      low = mid + 1;\n"
+        "    } else {\n"
+        "      high = mid;\n"
+        "    }\n"
+        "  }\n"
+        "  if (low < count && EMBEDDED_FILE_NAME_LENGTHS[low] == name_length\n"
+        "      && 0 == memcmp(EMBEDDED_NAME(low), filename, name_length)) "
+        "{\n"
+        "%s"
+        "    if (length) {\n"
+        "      *length = EMBEDDED_SIZE(low);\n"
+        "    }\n"
+        "    return EMBEDDED_DATA(low);\n"
+        "  }\n"
+        "  return NULL;\n"
+        "}\n\n"
+        "const char* %s(const char* filename, size_t* length) {\n"
+        "  return %s_n(filename, strlen(filename), length);\n"
+        "}\n\n",
+        function_name, overlay, function_name, function_name);
+    return;
+  }
+  overlay_check(overlay, sizeof(overlay), options, 7, "i");
+  fprintf(fd,
+      "const char* %s(const char* filename, size_t* length) {\n"
+      "  for (size_t i = 0; i < sizeof(EMBEDDED_FILE_DATA_SIZES)\n"
+      "      / sizeof(EMBEDDED_SIZE(0)); i++) {\n"
+      "     if (0 == strcmp(filename, EMBEDDED_NAME(i))) {\n"
+      "%s"
+      "       if (length) {\n"
+      "         *length = EMBEDDED_SIZE(i);\n"
+      "       }\n"
+      "       return EMBEDDED_DATA(i);\n"
+      "     }\n"
+      "  }\n"
+      "  return NULL;\n"
+      "}\n\n",
+      function_name, overlay);
+  // Names are compared by length first, which also keeps memcmp within them
+  overlay_check(overlay, sizeof(overlay), options, 6, "i");
+  fprintf(fd,
+      "const char* %s_n(\n"
+      "    const char* filename, size_t name_length, size_t* length) {\n"
+      "  for (size_t i = 0; i < EMBEDDED_FILE_COUNT; i++) {\n"
+      "    if (EMBEDDED_FILE_NAME_LENGTHS[i] == name_length\n"
+      "        && 0 == memcmp(filename, EMBEDDED_NAME(i), name_length)) {\n"
+      "%s"
+      "      if (length) {\n"
+      "        *length = EMBEDDED_SIZE(i);\n"
+      "      }\n"
+      "      return EMBEDDED_DATA(i);\n"
+      "    }\n"
+      "  }\n"
+      "  return NULL;\n"
+      "}\n\n",
+      function_name, overlay);
+}
+
+static const char* overlay_size_source
+    = "#if EMBEDDED_OVERLAY\n"
+      "  size_t length;\n"
+      "  if (index < EMBEDDED_FILE_COUNT && embedded_overlay(index, &length)) "
+      "{\n"
+      "    return length;\n"
+      "  }\n"
+      "#endif\n";
+
+static const char* overlay_read_source
+    = "#if EMBEDDED_OVERLAY\n"
+      "  size_t size;\n"
+      "  const char* overlay\n"
+      "      = index < EMBEDDED_FILE_COUNT ? embedded_overlay(index, &size) "
+      ": NULL;\n"
+      "  if (overlay) {\n"
+      "    if (offset >= size) {\n"
+      "      return 0;\n"
+      "    }\n"
+      "    length = length < size - offset ? length : size - offset;\n"
+      "    memcpy(buffer, overlay + offset, length);\n"
+      "    return length;\n"
+      "  }\n"
+      "#endif\n";
+
+// Functions going through the files by index, for the accessors declared in
+// the header and for reading large files a piece at a time
+void generate_index_function(
+    FILE* fd, const struct options* options, const struct data_layout* layout)
+{
+  const char* function_name = options->function_name;
+  bool blocks = has_blocks(layout);
+  char overlay[256];
+  overlay_check(overlay, sizeof(overlay), options, 2, "index");
+  fprintf(fd,
+      "const char* %s_at(size_t index, size_t* length) {\n"
+      "  if (index >= EMBEDDED_FILE_COUNT) {\n"
+      "    return NULL;\n"
+      "  }\n"
+      "%s"
+      "  if (length) {\n"
+      "    *length = EMBEDDED_SIZE(index);\n"
+      "  }\n"
+      "  return EMBEDDED_DATA(index);\n"
+      "}\n\n"
+      "size_t %s_count(void) {\n"
+      "  return EMBEDDED_FILE_COUNT;\n"
+      "}\n\n"
+      "const char* %s_name_at(size_t index) {\n"
+      "  return index < EMBEDDED_FILE_COUNT ? EMBEDDED_NAME(index) : NULL;\n"
+      "}\n\n"
+      "size_t %s_size_at(size_t index) {\n"
+      "%s"
+      "  return index < EMBEDDED_FILE_COUNT ? EMBEDDED_SIZE(index) : 0;\n"
+      "}\n\n"
+      "size_t %s_read(size_t index, size_t offset, void* buffer, "
+      "size_t length) {\n"
+      "%s"
+      "  if (index >= EMBEDDED_FILE_COUNT || offset >= EMBEDDED_SIZE(index)) "
+      "{\n"
+      "    return 0;\n"
+      "  }\n"
+      "  if (length > EMBEDDED_SIZE(index) - offset) {\n"
+      "    length = EMBEDDED_SIZE(index) - offset;\n"
+      "  }\n"
+      "%s"
+      "  const char* data = EMBEDDED_DATA(index);\n"
+      "  if (!data) {\n"
+      "    return 0;\n"
+      "  }\n"
+      "  memcpy(buffer, data + offset, length);\n"
+      "  return length;\n"
+      "}\n\n",
+      function_name, overlay, function_name, function_name, function_name,
+      options->overlay ? overlay_size_source : "", function_name,
+      options->overlay ? overlay_read_source : "",
+      blocks ? "  if (EMBEDDED_FILE_BLOCK_SIZES[index]) {\n"
+               "    return embedded_read_blocks(index, offset, buffer, "
+               "length);\n"
+               "  }\n"
+             : "");
+}
+
+// CRC32C of retrieved data with the SSE 4.2 or ARMv8 CRC instructions when
+// the processor has them, checked at run time on x86, and a table otherwise
+static const char* verify_source
+    = "#if (defined(__GNUC__) || defined(__clang__)) \\\n"
+      "    && (defined(__x86_64__) || defined(__i386__))\n"
+      "#include <nmmintrin.h>\n"
+      "#define EMBEDDED_CRC32C_X86 __attribute__((target(\"sse4.2\")))\n"
+      "static int embedded_crc32c_hw_ready(void) {\n"
+      "  return __builtin_cpu_supports(\"sse4.2\");\n"
+      "}\n"
+      "#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))\n"
+      "#include <intrin.h>\n"
+      "#include <nmmintrin.h>\n"
+      "#define EMBEDDED_CRC32C_X86\n"
+      "static int embedded_crc32c_hw_ready(void) {\n"
+      "  int info[4];\n"
+      "  __cpuid(info, 1);\n"
+      "  return (info[2] >> 20) & 1;\n"
+      "}\n"
+      "#elif defined(__ARM_FEATURE_CRC32) && !defined(__ARM_BIG_ENDIAN)\n"
+      "#include <arm_acle.h>\n"
+      "#define EMBEDDED_CRC32C_ARM\n"
+      "#endif\n\n"
+      "#if defined(EMBEDDED_CRC32C_X86)\n"
+      "EMBEDDED_CRC32C_X86 static uint32_t embedded_crc32c_hw(\n"
+      "    uint32_t crc, const unsigned char* data, size_t size) {\n"
+      "#if defined(__x86_64__) || defined(_M_X64)\n"
+      "  for (; size >= 8; data += 8, size -= 8) {\n"
+      "    unsigned long long word;\n"
+      "    memcpy(&word, data, 8);\n"
+      "    crc = (uint32_t)_mm_crc32_u64(crc, word);\n"
+      "  }\n"
+      "#endif\n"
+      "  for (; size >= 4; data += 4, size -= 4) {\n"
+      "    unsigned int word;\n"
+      "    memcpy(&word, data, 4);\n"
+      "    crc = _mm_crc32_u32(crc, word);\n"
+      "  }\n"
+      "  for (; size > 0; data++, size--) {\n"
+      "    crc = _mm_crc32_u8(crc, *data);\n"
+      "  }\n"
+      "  return crc;\n"
+      "}\n"
+      "#elif defined(EMBEDDED_CRC32C_ARM)\n"
+      "static int embedded_crc32c_hw_ready(void) {\n"
+      "  return 1;\n"
+      "}\n"
+      "static uint32_t embedded_crc32c_hw(\n"
+      "    uint32_t crc, const unsigned char* data, size_t size) {\n"
+      "  for (; size >= 8; data += 8, size -= 8) {\n"
+      "    uint64_t word;\n"
+      "    memcpy(&word, data, 8);\n"
+      "    crc = __crc32cd(crc, word);\n"
+      "  }\n"
+      "  for (; size > 0; data++, size--) {\n"
+      "    crc = __crc32cb(crc, *data);\n"
+      "  }\n"
+      "  return crc;\n"
+      "}\n"
+      "#endif\n\n"
+      "static uint32_t embedded_crc32c(const unsigned char* data, size_t size) "
+      "{\n"
+      "  uint32_t crc = 0xFFFFFFFF;\n"
+      "#if defined(EMBEDDED_CRC32C_X86) || defined(EMBEDDED_CRC32C_ARM)\n"
+      "  if (embedded_crc32c_hw_ready()) {\n"
+      "    return ~embedded_crc32c_hw(crc, data, size);\n"
+      "  }\n"
+      "#endif\n"
+      "  for (; size > 0; data++, size--) {\n"
+      "    crc = crc >> 8 ^ EMBEDDED_CRC32C_TABLE[(crc ^ *data) & 0xFF];\n"
+      "  }\n"
+      "  return ~crc;\n"
+      "}\n\n";
+
+// With --verify, functions checking the data retrieved for each file, from
+// the pack, the overlay or decompression, against the checksum of the input
+void generate_verify(
+    FILE* fd, const struct options* options, const struct data_layout* layout)
+{
+  if (!options->verify) {
+    return;
+  }
+  const char* function_name = options->function_name;
+  fprintf(fd, "static const uint32_t EMBEDDED_FILE_CHECKSUMS[] = {");
+  for (size_t i = 0; i < layout->count; i++) {
+    fprintf(fd, "%s0x%08x,", (i % 8) == 0 ? "\n\t" : " ",
+        (unsigned)layout->checksums[i]);
+  }
+  fprintf(fd, "\n};\n\nstatic const uint32_t EMBEDDED_CRC32C_TABLE[256] = {");
+  for (int i = 0; i < 256; i++) {
+    fprintf(fd, "%s0x%08x,", (i % 8) == 0 ? "\n\t" : " ",
+        (unsigned)crc32c_table[0][i]);
+  }
+  fprintf(fd, "\n};\n\n");
+  fputs(verify_source, fd);
+  fprintf(fd,
+      "int %s_verify_at(size_t index) {\n"
+      "  size_t length = 0;\n"
+      "  const char* data = %s_at(index, &length);\n"
+      "  return data && length == EMBEDDED_SIZE(index)\n"
+      "      && embedded_crc32c((const unsigned char*)data, length)\n"
+      "          == EMBEDDED_FILE_CHECKSUMS[index];\n"
+      "}\n\n"
+      "int %s_verify(const char* filename) {\n"
+      "  size_t name_length = strlen(filename);\n"
+      "  for (size_t i = 0; i < EMBEDDED_FILE_COUNT; i++) {\n"
+      "    if (EMBEDDED_FILE_NAME_LENGTHS[i] == name_length\n"
+      "        && 0 == memcmp(filename, EMBEDDED_NAME(i), name_length)) {\n"
+      "      return %s_verify_at(i);\n"
+      "    }\n"
+      "  }\n"
+      "  return 0;\n"
+      "}\n\n"
+      "size_t %s_verify_all(void) {\n"
+      "  size_t failed = 0;\n"
+      "  for (size_t i = 0; i < EMBEDDED_FILE_COUNT; i++) {\n"
+      "    failed += !%s_verify_at(i);\n"
+      "  }\n"
+      "  return failed;\n"
+      "}\n\n",
+      function_name, function_name, function_name, function_name,
+      function_name, function_name);
+}
+
+// With placement=hot files, a function advising the system to read the data
+// of the hot files, which are placed first, in one go
+void generate_prefetch(
+    FILE* fd, const struct options* options, const struct data_layout* layout)
+{
+  if (!options->hot_count) {
+    return;
+  }
+  fprintf(fd,
+      "#if defined(__unix__) || defined(__APPLE__)\n"
+      "#include <sys/mman.h>\n"
+      "#include <unistd.h>\n"
+      "#elif defined(_WIN32)\n"
+      "#include <windows.h>\n"
+      "#endif\n\n"
+      "void %s_prefetch_hot(void) {\n"
+      "  uintptr_t start = UINTPTR_MAX;\n"
+      "  uintptr_t end = 0;\n"
+      "  for (size_t i = 0; i < %zu; i++) {\n"
+      "    uintptr_t data = (uintptr_t)%s(i);\n"
+      "%s"
+      "    uintptr_t data_end = data + %s;\n"
+      "    start = data < start ? data : start;\n"
+      "    end = data_end > end ? data_end : end;\n"
+      "  }\n"
+      "#if (defined(__unix__) || defined(__APPLE__)) "
+      "&& defined(MADV_WILLNEED)\n"
+      "  start -= start %% (uintptr_t)sysconf(_SC_PAGESIZE);\n"
+      "  madvise((void*)start, end - start, MADV_WILLNEED);\n"
+      "#elif defined(_WIN32) && defined(_WIN32_WINNT) "
+      "&& _WIN32_WINNT >= 0x0602\n"
+      "  WIN32_MEMORY_RANGE_ENTRY range = { (void*)start, end - start };\n"
+      "  PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);\n"
+      "#else\n"
+      "  (void)start;\n"
+      "  (void)end;\n"
+      "#endif\n"
+      "}\n\n",
+      options->function_name, options->hot_count,
+      layout->compressed_count ? "EMBEDDED_PAYLOAD" : "EMBEDDED_DATA",
+      options->backend == BACKEND_PACK ? "    if (!data) {\n"
+                                         "      return;\n"
+                                         "    }\n"
+                                       : "",
+      layout->compressed_count ? "EMBEDDED_FILE_STORED_SIZES[i]"
+                               : "EMBEDDED_SIZE(i) + 1");
+}
+
+// With --incremental a manifest next to the source records what the outputs
+// were generated from: the embed that generated them, the command line, and
+// the size and content hash of every input. When it still matches, the
+// outputs are left untouched so their timestamps do not trigger rebuilds.
+#define MANIFEST_HEADER "embed manifest 2\n"
+
+// Tells versions of embed apart, so outputs are generated again after embed
+// changes and may generate different code. The Makefile and meson define
+// EMBED_BUILD_ID to a hash of this source, rebuilding the same source keeps
+// it and with it every manifest.
+#ifndef EMBED_BUILD_ID
+#define EMBED_BUILD_ID "unknown"
+#endif
+#ifdef EMBED_HAVE_ZSTD
+#define MANIFEST_GENERATOR "generator " EMBED_BUILD_ID " zstd\n"
+#else
+#define MANIFEST_GENERATOR "generator " EMBED_BUILD_ID "\n"
+#endif
+
+static uint64_t hash_arguments(int argc, char** argv)
+{
+  uint64_t h = 0;
+  for (int i = 1; i < argc; i++) {
+    h = xxh64((const unsigned char*)argv[i], strlen(argv[i]) + 1, h);
+  }
+  return h;
+}
+
+struct manifest_context {
+  const struct input_data* inputs;
+  uint64_t* hashes;
+};
+
+static void hash_input_task(void* data, size_t i)
+{
+  struct manifest_context* context = data;
+  context->hashes[i]
+      = xxh64(context->inputs[i].data, context->inputs[i].size, 0);
+}
+
+static void build_manifest(struct output_buffer* out, char* const* files,
+    const struct input_data* inputs, uint64_t arguments_hash,
+    const struct options* options)
+{
+  size_t count = 0;
+  while (files[count]) {
+    count++;
+  }
+  uint64_t* hashes = malloc(sizeof(uint64_t) * (count + 1));
+  if (!hashes) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  struct manifest_context context = { inputs, hashes };
+  run_parallel(count, options->jobs, hash_input_task, &context);
+  char line[64];
+  output_buffer_puts(out, MANIFEST_HEADER);
+  output_buffer_puts(out, MANIFEST_GENERATOR);
+  snprintf(line, sizeof(line), "%016llx\n", (unsigned long long)arguments_hash);
+  output_buffer_puts(out, line);
+  // What other sets share decides which of the data is in this set's source
+  if (options->cache && options->cache->shared_file) {
+    snprintf(line, sizeof(line), "shared %016llx\n",
+        (unsigned long long)options->cache->shared_hash);
+    output_buffer_puts(out, line);
+  }
+  for (size_t i = 0; i < count; i++) {
+    snprintf(line, sizeof(line), "%016llx %zu ", (unsigned long long)hashes[i],
+        inputs[i].size);
+    output_buffer_puts(out, line);
+    output_buffer_puts(out, files[i]);
+    output_buffer_puts(out, "\n");
+  }
+  free(hashes);
+}
+
+// Whether a file exists holding exactly `size` bytes of `data`
+static bool file_matches(const char* path, const char* data, size_t size)
+{
+  FILE* fd = fopen(path, "rb");
+  if (!fd) {
+    return false;
+  }
+  char block[4096];
+  size_t offset = 0;
+  bool matches = true;
+  for (;;) {
+    size_t read = fread(block, 1, sizeof(block), fd);
+    if (read == 0) {
+      break;
+    }
+    if (read > size - offset || memcmp(block, data + offset, read) != 0) {
+      matches = false;
+      break;
+    }
+    offset += read;
+  }
+  matches = matches && offset == size && !ferror(fd);
+  fclose(fd);
+  return matches;
+}
+
+static bool file_exists(const char* path)
+{
+  FILE* fd = fopen(path, "rb");
+  if (fd) {
+    fclose(fd);
+  }
+  return fd != NULL;
+}
+
+static void write_file(const char* path, const char* data, size_t size)
+{
+  FILE* fd = fopen(path, "wb");
+  if (!fd || fwrite(data, 1, size, fd) != size || fclose(fd) != 0) {
+    fprintf(stderr, "Could not write file '%s'\n", path);
+    exit(1);
+  }
+}
+
+// Writes a path escaped for a make rule
+static void output_make_path(struct output_buffer* out, const char* path)
+{
+  for (; *path; path++) {
+    if (*path == '$') {
+      output_buffer_puts(out, "$$");
+      continue;
+    }
+    if (*path == ' ' || *path == '#') {
+      output_buffer_puts(out, "\\");
+    }
+    output_buffer_write(out, path, 1);
+  }
+}
+
+// Writes a make style dependency file, as compilers do for -MD, with a rule
+// making the outputs depend on every input
+static void write_depfile(const char* depfile, const char* const* outputs,
+    size_t output_count, char* const* files,
+    const struct file_options* file_options, char* const* dependencies)
+{
+  struct output_buffer out;
+  output_buffer_init(&out, NULL);
+  for (size_t i = 0; i < output_count; i++) {
+    if (outputs[i]) {
+      output_make_path(&out, outputs[i]);
+      output_buffer_puts(&out, " ");
+    }
+  }
+  output_buffer_puts(&out, ":");
+  for (size_t i = 0; files[i]; i++) {
+    // stdin leaves nothing to depend on, archives are listed with the
+    // dependencies
+    const char* path = input_path(files, file_options, i);
+    if (0 == strcmp(path, "-") || file_options[i].member.archive) {
+      continue;
+    }
+    output_buffer_puts(&out, " \\\n  ");
+    output_make_path(&out, path);
+  }
+  for (size_t i = 0; dependencies && dependencies[i]; i++) {
+    output_buffer_puts(&out, " \\\n  ");
+    output_make_path(&out, dependencies[i]);
+  }
+  output_buffer_puts(&out, "\n");
+  write_file(depfile, out.data, out.length);
+  free(out.data);
+}
+
+static void init_stats(struct stats* stats, size_t count)
+{
+  memset(stats, 0, sizeof(*stats));
+  stats->count = count;
+  stats->input_bytes = calloc(count + 1, sizeof(size_t));
+  stats->stored_bytes = calloc(count + 1, sizeof(size_t));
+  stats->output_bytes = calloc(count + 1, sizeof(size_t));
+  stats->compression = calloc(count + 1, 1);
+  stats->duplicate = calloc(count + 1, sizeof(bool));
+  stats->compress_seconds = calloc(count + 1, sizeof(double));
+  stats->encode_seconds = calloc(count + 1, sizeof(double));
+  if (!stats->input_bytes || !stats->stored_bytes || !stats->output_bytes
+      || !stats->compression || !stats->duplicate || !stats->compress_seconds
+      || !stats->encode_seconds) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+}
+
+static void free_stats(struct stats* stats)
+{
+  free(stats->input_bytes);
+  free(stats->stored_bytes);
+  free(stats->output_bytes);
+  free(stats->compression);
+  free(stats->duplicate);
+  free(stats->compress_seconds);
+  free(stats->encode_seconds);
+}
+
+// Keeps what the layout decided about each file. Data in an object file or
+// a pack is counted as output as it is.
+static void record_layout_stats(struct stats* stats,
+    const struct data_layout* layout, const struct options* options)
+{
+  for (size_t i = 0; i < layout->count; i++) {
+    stats->input_bytes[i] = layout->original_sizes[i];
+    stats->duplicate[i] = layout->data_index[i] != i;
+    stats->stored_bytes[i] = stats->duplicate[i] ? 0 : layout->sizes[i];
+    stats->compression[i] = (unsigned char)layout->compression[i];
+    if (options->backend == BACKEND_OBJECT
+        || options->backend == BACKEND_PACK) {
+      stats->output_bytes[i] = stats->stored_bytes[i];
+    }
+  }
+}
+
+// Adds the time since `start` to a phase, returning the time now
+static double record_phase(
+    struct stats* stats, enum stats_phase phase, double start)
+{
+  double now = clock_seconds();
+  if (stats) {
+    stats->phase_seconds[phase] += now - start;
+  }
+  return now;
+}
+
+// Size of a written output, 0 if it can not be read
+static size_t output_file_size(const char* path)
+{
+  FILE* fd = fopen(path, "rb");
+  if (!fd) {
+    return 0;
+  }
+  long size = fseek(fd, 0, SEEK_END) == 0 ? ftell(fd) : 0;
+  fclose(fd);
+  return size > 0 ? (size_t)size : 0;
+}
+
+static double compression_ratio(const struct stats* stats, size_t i)
+{
+  return stats->input_bytes[i]
+      ? (double)stats->stored_bytes[i] / (double)stats->input_bytes[i]
+      : 1;
+}
+
+struct stats_order {
+  const struct stats* stats;
+  size_t index;
+};
+
+// Slowest files first
+static int compare_stats_order(const void* a, const void* b)
+{
+  const struct stats_order* left = a;
+  const struct stats_order* right = b;
+  double left_seconds = left->stats->compress_seconds[left->index]
+      + left->stats->encode_seconds[left->index];
+  double right_seconds = right->stats->compress_seconds[right->index]
+      + right->stats->encode_seconds[right->index];
+  if (left_seconds != right_seconds) {
+    return left_seconds < right_seconds ? 1 : -1;
+  }
+  return left->index < right->index ? -1 : left->index > right->index;
+}
+
+// Prints the report of --stats, the slowest files first
+static void print_stats(const struct stats* stats, char* const* files,
+    const char* const* outputs, size_t output_count, double total_seconds)
+{
+  size_t input_bytes = 0;
+  size_t stored_bytes = 0;
+  size_t output_bytes = 0;
+  int width = 4;
+  struct stats_order* order = malloc(sizeof(*order) * (stats->count + 1));
+  if (!order) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  for (size_t i = 0; i < stats->count; i++) {
+    input_bytes += stats->input_bytes[i];
+    stored_bytes += stats->stored_bytes[i];
+    int length = (int)strlen(files[i]);
+    width = length > width ? (length < 48 ? length : 48) : width;
+    order[i].stats = stats;
+    order[i].index = i;
+  }
+  for (size_t i = 0; i < output_count; i++) {
+    output_bytes += outputs[i] ? output_file_size(outputs[i]) : 0;
+  }
+  qsort(order, stats->count, sizeof(*order), compare_stats_order);
+  fprintf(stderr,
+      "embed: %zu files, %zu bytes read, %zu stored, %zu written in %.3f s\n",
+      stats->count, input_bytes, stored_bytes, output_bytes, total_seconds);
+  fprintf(stderr, "  %-*s %12s %12s %7s %8s %12s %12s %12s\n", width, "file",
+      "input", "stored", "ratio", "method", "compress ms", "encode ms",
+      "output");
+  for (size_t n = 0; n < stats->count; n++) {
+    size_t i = order[n].index;
+    fprintf(stderr, "  %-*s %12zu %12zu %6.1f%% %8s %12.3f %12.3f %12zu\n",
+        width, files[i], stats->input_bytes[i], stats->stored_bytes[i],
+        compression_ratio(stats, i) * 100,
+        stats->duplicate[i] ? "same" : compression_names[stats->compression[i]],
+        stats->compress_seconds[i] * 1000, stats->encode_seconds[i] * 1000,
+        stats->output_bytes[i]);
+  }
+  fprintf(stderr, "  %-26s %12s\n", "phase", "seconds");
+  for (size_t i = 0; i < PHASE_COUNT; i++) {
+    fprintf(stderr, "  %-26s %12.6f\n", phase_names[i],
+        stats->phase_seconds[i]);
+  }
+  fprintf(stderr, "  %-26s %12.6f (part of the phases)\n", "write",
+      output_write_seconds);
+  free(order);
+}
+
+// Writes a string for JSON with its quotes
+static void output_json_string(struct output_buffer* out, const char* text)
+{
+  output_buffer_puts(out, "\"");
+  for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+    char escape[8];
+    if (*c == '"' || *c == '\\') {
+      snprintf(escape, sizeof(escape), "\\%c", *c);
+    } else if (*c < 0x20) {
+      snprintf(escape, sizeof(escape), "\\u%04x", *c);
+    } else {
+      snprintf(escape, sizeof(escape), "%c", *c);
+    }
+    output_buffer_puts(out, escape);
+  }
+  output_buffer_puts(out, "\"");
+}
+
+// Writes the report of --stats-json, with files in the order they were given,
+// to a file or to stdout for -
+static void write_stats_json(const char* path, const struct stats* stats,
+    char* const* files, const struct options* options,
+    const char* const* outputs, size_t output_count, double total_seconds)
+{
+  struct output_buffer out;
+  output_buffer_init(&out, NULL);
+  char line[256];
+  output_buffer_puts(&out, "{\n  \"files\": [");
+  for (size_t i = 0; i < stats->count; i++) {
+    output_buffer_puts(&out, i ? ",\n    {\"path\": " : "\n    {\"path\": ");
+    output_json_string(&out, files[i]);
+    output_buffer_puts(&out, ", \"name\": ");
+    output_json_string(&out, file_name(files[i], options->preserve_paths));
+    snprintf(line, sizeof(line),
+        ", \"input_bytes\": %zu, \"stored_bytes\": %zu, "
+        "\"output_bytes\": %zu, \"compression\": \"%s\", "
+        "\"duplicate\": %s, \"ratio\": %.6f, \"compress_seconds\": %.9f, "
+        "\"encode_seconds\": %.9f}",
+        stats->input_bytes[i], stats->stored_bytes[i], stats->output_bytes[i],
+        compression_names[stats->compression[i]],
+        stats->duplicate[i] ? "true" : "false", compression_ratio(stats, i),
+        stats->compress_seconds[i], stats->encode_seconds[i]);
+    output_buffer_puts(&out, line);
+  }
+  output_buffer_puts(&out, "\n  ],\n  \"phases\": {");
+  for (size_t i = 0; i < PHASE_COUNT; i++) {
+    snprintf(line, sizeof(line), "\n    \"%s\": %.9f,", phase_names[i],
+        stats->phase_seconds[i]);
+    output_buffer_puts(&out, line);
+  }
+  snprintf(line, sizeof(line),
+      "\n    \"write\": %.9f,\n    \"total\": %.9f\n  },\n"
+      "  \"outputs\": [",
+      output_write_seconds, total_seconds);
+  output_buffer_puts(&out, line);
+  bool first = true;
+  for (size_t i = 0; i < output_count; i++) {
+    if (!outputs[i]) {
+      continue;
+    }
+    output_buffer_puts(&out, first ? "\n    {\"path\": " : ",\n    {\"path\": ");
+    output_json_string(&out, outputs[i]);
+    snprintf(line, sizeof(line), ", \"bytes\": %zu}",
+        output_file_size(outputs[i]));
+    output_buffer_puts(&out, line);
+    first = false;
+  }
+  output_buffer_puts(&out, "\n  ]\n}\n");
+  if (0 == strcmp(path, "-")) {
+    fwrite(out.data, 1, out.length, stdout);
+  } else {
+    write_file(path, out.data, out.length);
+  }
+  free(out.data);
+}
+
+// Parses an alignment, returning 0 unless it is a power of two no larger than
+// MAX_DATA_ALIGN
+static size_t parse_align(const char* text)
+{
+  char* end;
+  unsigned long long align = strtoull(text, &end, 10);
+  if (end == text || *end != '\0' || align == 0 || align > MAX_DATA_ALIGN
+      || (align & (align - 1)) != 0) {
+    return 0;
+  }
+  return (size_t)align;
+}
+
+// Whether a section name is short and plain enough for every object format
+// and assembler
+static bool valid_section(const char* name)
+{
+  size_t length = strlen(name);
+  if (length == 0 || length > MAX_SECTION_NAME) {
+    return false;
+  }
+  for (const char* c = name; *c; c++) {
+    if (!((*c >= 'a' && *c <= 'z') || (*c >= 'A' && *c <= 'Z')
+            || (*c >= '0' && *c <= '9') || *c == '_' || *c == '.'
+            || *c == '$')) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Parses a number of threads, 0 meaning one for every processor
+static bool parse_jobs(const char* text, unsigned* jobs)
+{
+  char* end;
+  unsigned long value = strtoul(text, &end, 10);
+  if (end == text || *end != '\0' || value > 1024) {
+    return false;
+  }
+  *jobs = value ? (unsigned)value : processor_count();
+  return true;
+}
+
+// Parses a number of bytes, which may be followed by K, M or G for KiB, MiB
+// or GiB
+static bool parse_memory_size(const char* text, size_t* size)
+{
+  char* end;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text || value == 0) {
+    return false;
+  }
+  const char* units = "KMG";
+  const char* unit = *end ? strchr(units, *end) : NULL;
+  if (unit) {
+    for (const char* u = units; u <= unit; u++) {
+      if (value > SIZE_MAX >> 10) {
+        return false;
+      }
+      value <<= 10;
+    }
+    end++;
+  }
+  if (*end != '\0' || value > SIZE_MAX) {
+    return false;
+  }
+  *size = (size_t)value;
+  return true;
+}
+
+// Parses a number of shards
+static bool parse_shards(const char* text, unsigned* shards)
+{
+  char* end;
+  unsigned long value = strtoul(text, &end, 10);
+  if (end == text || *end != '\0' || value == 0 || value > UINT16_MAX) {
+    return false;
+  }
+  *shards = (unsigned)value;
+  return true;
+}
+
+// Name of a shard's source, the main source's name with _<index> before its
+// extension
+static char* shard_file_name(const char* source_file, size_t index)
+{
+  const char* extension = strrchr(source_file, '.');
+  const char* separator = strrchr(source_file, PATH_SEPARATOR);
+  const char* slash = strrchr(source_file, '/');
+  if (!extension || (separator && separator > extension)
+      || (slash && slash > extension)) {
+    extension = source_file + strlen(source_file);
+  }
+  size_t stem = extension - source_file;
+  char* name = malloc(strlen(source_file) + 32);
+  if (!name) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  memcpy(name, source_file, stem);
+  sprintf(name + stem, "_%zu%s", index, extension);
+  return name;
+}
+
+// Smallest and largest blocks files can be compressed in
+#define MIN_BLOCK_SIZE 1024
+#define MAX_BLOCK_SIZE (1 << 30)
+
+// Parses a block size, 0 meaning files are compressed whole
+static bool parse_block_size(const char* text, size_t* block_size)
+{
+  char* end;
+  unsigned long long value = strtoull(text, &end, 10);
+  if (end == text || *end != '\0'
+      || (value != 0 && (value < MIN_BLOCK_SIZE || value > MAX_BLOCK_SIZE))) {
+    return false;
+  }
+  *block_size = (size_t)value;
+  return true;
+}
+
+// Parses a whole percentage
+static bool parse_percent(const char* text, unsigned* percent)
+{
+  char* end;
+  unsigned long value = strtoul(text, &end, 10);
+  if (end == text || *end != '\0' || value > 100) {
+    return false;
+  }
+  *percent = (unsigned)value;
+  return true;
+}
+
+// Splits the options off an input file given as path:name=value,name=value,
+// leaving the path in place. A path is only split where everything after its
+// last colon looks like options, so paths containing colons still work. The
+// name option comes last and takes the rest, separators and commas included.
+static void split_file_options(char* path, struct file_options* file_options)
+{
+  char* colon = strrchr(path, ':');
+  if (!colon) {
+    return;
+  }
+  char* name = strstr(colon, "name=");
+  while (name && name[-1] != ':' && name[-1] != ',') {
+    name = strstr(name + 1, "name=");
+  }
+  char* end = name ? name : colon + strlen(colon);
+  if (colon == path || !strchr(colon, '=')) {
+    return;
+  }
+  for (char* c = colon; c < end; c++) {
+    if (*c == '/' || *c == PATH_SEPARATOR) {
+      return;
+    }
+  }
+  *colon = '\0';
+  for (char* option = colon + 1; option;) {
+    char* next = option == name ? NULL : strchr(option, ',');
+    if (next) {
+      *next++ = '\0';
+    }
+    char* value = strchr(option, '=');
+    if (value) {
+      *value++ = '\0';
+    }
+    if (value && 0 == strcmp(option, "align")) {
+      file_options->align = parse_align(value);
+      if (!file_options->align) {
+        fprintf(stderr, "Invalid alignment '%s' for file '%s'\n", value, path);
+        exit(1);
+      }
+    } else if (value && 0 == strcmp(option, "compress")) {
+      file_options->has_compress = true;
+      if (!find_compression(value, &file_options->compress)) {
+        fprintf(stderr, "Unknown compression '%s' for file '%s'\n", value,
+            path);
+        exit(1);
+      }
+    } else if (value && 0 == strcmp(option, "compress-threshold")) {
+      file_options->has_compress_threshold = true;
+      if (!parse_percent(value, &file_options->compress_threshold)) {
+        fprintf(stderr, "Invalid compression threshold '%s' for file '%s'\n",
+            value, path);
+        exit(1);
+      }
+    } else if (value && 0 == strcmp(option, "placement")) {
+      if (!find_placement(value, &file_options->placement)) {
+        fprintf(stderr, "Unknown placement '%s' for file '%s'\n", value,
+            path);
+        exit(1);
+      }
+    } else if (value && 0 == strcmp(option, "name")) {
+      if (!*value) {
+        fprintf(stderr, "Empty name for file '%s'\n", path);
+        exit(1);
+      }
+      file_options->name = value;
+    } else if (value && 0 == strcmp(option, "block-size")) {
+      file_options->has_block_size = true;
+      if (!parse_block_size(value, &file_options->block_size)) {
+        fprintf(stderr, "Invalid block size '%s' for file '%s'\n", value,
+            path);
+        exit(1);
+      }
+    } else {
+      fprintf(stderr, "Unknown option '%s' for file '%s'\n", option, path);
+      exit(1);
+    }
+    option = next;
+  }
+}
+
+// Growable list of strings, kept NULL terminated
+struct string_list {
+  char** items;
+  size_t count;
+  size_t capacity;
+};
+
+static void string_list_add(struct string_list* list, char* item)
+{
+  if (list->count + 1 >= list->capacity) {
+    list->capacity = list->capacity ? list->capacity * 2 : 64;
+    list->items = realloc(list->items, sizeof(char*) * list->capacity);
+    if (!list->items) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+  }
+  list->items[list->count++] = item;
+  list->items[list->count] = NULL;
+}
+
+static void string_list_free(struct string_list* list)
+{
+  for (size_t i = 0; i < list->count; i++) {
+    free(list->items[i]);
+  }
+  free(list->items);
+}
+
+static char* copy_string(const char* text)
+{
+  char* copy = malloc(strlen(text) + 1);
+  if (!copy) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  strcpy(copy, text);
+  return copy;
+}
+
+static int compare_strings(const void* a, const void* b)
+{
+  return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Path of `name` inside `directory`, where an empty directory is the current
+// one
+static char* join_path(const char* directory, const char* name)
+{
+  size_t length = strlen(directory);
+  char* path = malloc(length + strlen(name) + 2);
+  if (!path) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  memcpy(path, directory, length);
+  if (length && directory[length - 1] != PATH_SEPARATOR
+      && directory[length - 1] != '/') {
+    path[length++] = PATH_SEPARATOR;
+  }
+  strcpy(path + length, name);
+  return path;
+}
+
+// Entries of a directory, split into files and subdirectories. Names
+// starting with . are left out, as a shell would, and so are directories
+// reached through links, which could lead back to a parent.
+struct directory_listing {
+  const char* path;
+  struct string_list files;
+  struct string_list directories;
+  bool failed;
+};
+
+#ifdef _WIN32
+static void list_directory(struct directory_listing* listing)
+{
+  char* pattern = join_path(*listing->path ? listing->path : ".", "*");
+  WIN32_FIND_DATAA entry;
+  HANDLE find = FindFirstFileA(pattern, &entry);
+  free(pattern);
+  if (find == INVALID_HANDLE_VALUE) {
+    listing->failed = GetLastError() != ERROR_FILE_NOT_FOUND;
+    return;
+  }
+  do {
+    if (entry.cFileName[0] == '.') {
+      continue;
+    }
+    DWORD attributes = entry.dwFileAttributes;
+    if (!(attributes & FILE_ATTRIBUTE_DIRECTORY)) {
+      string_list_add(
+          &listing->files, join_path(listing->path, entry.cFileName));
+    } else if (!(attributes & FILE_ATTRIBUTE_REPARSE_POINT)) {
+      string_list_add(
+          &listing->directories, join_path(listing->path, entry.cFileName));
+    }
+  } while (FindNextFileA(find, &entry));
+  FindClose(find);
+}
+#else
+// Sorts a path into a file, a directory or neither, counting links to files
+// as files
+static void classify_path(const char* path, bool* is_file, bool* is_directory)
+{
+  struct stat info;
+  *is_file = false;
+  *is_directory = false;
+  if (lstat(path, &info) != 0) {
+    return;
+  }
+  *is_directory = S_ISDIR(info.st_mode);
+  *is_file = S_ISREG(info.st_mode)
+      || (S_ISLNK(info.st_mode) && stat(path, &info) == 0
+          && S_ISREG(info.st_mode));
+}
+
+static void list_directory(struct directory_listing* listing)
+{
+  DIR* directory = opendir(*listing->path ? listing->path : ".");
+  if (!directory) {
+    listing->failed = true;
+    return;
+  }
+  struct dirent* entry;
+  while ((entry = readdir(directory))) {
+    if (entry->d_name[0] == '.') {
+      continue;
+    }
+    char* path = join_path(listing->path, entry->d_name);
+    bool known = false;
+    bool is_file = false;
+    bool is_directory = false;
+#ifdef DT_DIR
+    // Most systems give the type with the entry, which saves a stat
+    known = entry->d_type == DT_REG || entry->d_type == DT_DIR;
+    is_file = entry->d_type == DT_REG;
+    is_directory = entry->d_type == DT_DIR;
+#endif
+    if (!known) {
+      classify_path(path, &is_file, &is_directory);
+    }
+    if (is_file) {
+      string_list_add(&listing->files, path);
+    } else if (is_directory) {
+      string_list_add(&listing->directories, path);
+    } else {
+      free(path);
+    }
+  }
+  closedir(directory);
+}
+#endif
+
+static bool is_regular_file(const char* path)
+{
+#ifdef _WIN32
+  DWORD attributes = GetFileAttributesA(path);
+  return attributes != INVALID_FILE_ATTRIBUTES
+      && !(attributes & FILE_ATTRIBUTE_DIRECTORY);
+#else
+  struct stat info;
+  return stat(path, &info) == 0 && S_ISREG(info.st_mode);
+#endif
+}
+
+static void free_directory_listing(struct directory_listing* listing)
+{
+  string_list_free(&listing->files);
+  string_list_free(&listing->directories);
+}
+
+static bool is_pattern(const char* text)
+{
+  return strpbrk(text, "*?[") != NULL;
+}
+
+// Matches a name against a shell style pattern of *, ? and [] sets, as in
+// [a-z] or [!0-9]
+static bool match_pattern(const char* pattern, const char* name)
+{
+  const char* star = NULL;
+  const char* resume = NULL;
+  while (*name) {
+    bool matched = false;
+    const char* next = pattern + 1;
+    if (*pattern == '*') {
+      star = pattern++;
+      resume = name;
+      continue;
+    } else if (*pattern == '?') {
+      matched = true;
+    } else if (*pattern == '[') {
+      const char* c = pattern + 1;
+      bool negate = *c == '!' || *c == '^';
+      c += negate;
+      bool in_set = false;
+      // A ] right after the [ is part of the set
+      do {
+        if (c[1] == '-' && c[2] && c[2] != ']') {
+          in_set = in_set || (*name >= c[0] && *name <= c[2]);
+          c += 3;
+        } else {
+          in_set = in_set || *name == *c;
+          c++;
+        }
+      } while (*c && *c != ']');
+      if (*c == ']') {
+        matched = in_set != negate;
+        next = c + 1;
+      } else {
+        matched = *name == '[';
+      }
+    } else {
+      matched = *pattern == *name;
+    }
+    if (matched) {
+      pattern = next;
+      name++;
+    } else if (star) {
+      pattern = star + 1;
+      name = ++resume;
+    } else {
+      return false;
+    }
+  }
+  while (*pattern == '*') {
+    pattern++;
+  }
+  return *pattern == '\0';
+}
+
+// Everything gathered from the input arguments, response files, directories
+// and patterns
+struct input_list {
+  struct string_list files;
+  struct file_options* options;
+  size_t options_capacity;
+  // Response files and directories read, which the depfile lists
+  struct string_list dependencies;
+  // Hash of the arguments and the response files' contents
+  uint64_t hash;
+  unsigned jobs;
+  // Whether a file is read from stdin, which can only be done once
+  bool reads_stdin;
+  // Archives read with --archive, kept open for their members' data
+  struct input_data** archives;
+  size_t archive_count;
+};
+
+static void add_input(struct input_list* list, char* path,
+    const struct file_options* file_options)
+{
+  if (list->files.count + 1 >= list->options_capacity) {
+    list->options_capacity
+        = list->options_capacity ? list->options_capacity * 2 : 64;
+    list->options = realloc(list->options,
+        sizeof(struct file_options) * list->options_capacity);
+    if (!list->options) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+  }
+  list->options[list->files.count] = *file_options;
+  memset(&list->options[list->files.count + 1], 0,
+      sizeof(struct file_options));
+  string_list_add(&list->files, path);
+}
+
+// Adds the files found by a pattern from its component `component` on,
+// below `directory`
+static void expand_pattern_from(struct input_list* list,
+    struct string_list* matches, const char* directory, char** components,
+    size_t component, size_t component_count)
+{
+  char* name = components[component];
+  bool last = component + 1 == component_count;
+  if (!is_pattern(name)) {
+    char* path = join_path(directory, name);
+    if (!last) {
+      expand_pattern_from(list, matches, path, components, component + 1,
+          component_count);
+      free(path);
+      return;
+    }
+    if (is_regular_file(path)) {
+      string_list_add(matches, path);
+    } else {
+      free(path);
+    }
+    return;
+  }
+  struct directory_listing listing = { directory, { 0 }, { 0 }, false };
+  list_directory(&listing);
+  if (!listing.failed) {
+    string_list_add(&list->dependencies,
+        copy_string(*directory ? directory : "."));
+  }
+  // ** matches any number of directories, none included
+  if (0 == strcmp(name, "**")) {
+    if (!last) {
+      expand_pattern_from(list, matches, directory, components,
+          component + 1, component_count);
+    }
+    for (size_t i = 0; i < listing.directories.count; i++) {
+      expand_pattern_from(list, matches, listing.directories.items[i],
+          components, component, component_count);
+    }
+    if (last) {
+      for (size_t i = 0; i < listing.files.count; i++) {
+        string_list_add(matches, copy_string(listing.files.items[i]));
+      }
+    }
+  } else if (last) {
+    for (size_t i = 0; i < listing.files.count; i++) {
+      if (match_pattern(name, plain_name(listing.files.items[i]))) {
+        string_list_add(matches, copy_string(listing.files.items[i]));
+      }
+    }
+  } else {
+    for (size_t i = 0; i < listing.directories.count; i++) {
+      if (match_pattern(name, plain_name(listing.directories.items[i]))) {
+        expand_pattern_from(list, matches, listing.directories.items[i],
+            components, component + 1, component_count);
+      }
+    }
+  }
+  free_directory_listing(&listing);
+}
+
+// Adds the files matching a pattern such as shaders/*.glsl or
+// assets/**/*.png, in sorted order
+static void expand_pattern(struct input_list* list, const char* pattern,
+    const struct file_options* file_options)
+{
+  char* copy = copy_string(pattern);
+  size_t component_count = 0;
+  char** components = malloc(sizeof(char*) * (strlen(pattern) + 1));
+  if (!components) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  // Leading separators of an absolute path stay on the first directory
+  char* c = copy;
+  while (*c == '/' || *c == PATH_SEPARATOR) {
+    c++;
+  }
+  char root[2] = { copy[0], '\0' };
+  const char* directory = c == copy ? "" : root;
+  while (*c) {
+    components[component_count++] = c;
+    while (*c && *c != '/' && *c != PATH_SEPARATOR) {
+      c++;
+    }
+    while (*c == '/' || *c == PATH_SEPARATOR) {
+      *c++ = '\0';
+    }
+  }
+  struct string_list matches = { 0 };
+  if (component_count) {
+    expand_pattern_from(
+        list, &matches, directory, components, 0, component_count);
+  }
+  if (!matches.count) {
+    fprintf(stderr, "No files match '%s'\n", pattern);
+    exit(1);
+  }
+  qsort(matches.items, matches.count, sizeof(char*), compare_strings);
+  for (size_t i = 0; i < matches.count; i++) {
+    if (i && 0 == strcmp(matches.items[i], matches.items[i - 1])) {
+      free(matches.items[i]);
+    } else {
+      add_input(list, matches.items[i], file_options);
+    }
+  }
+  free(matches.items);
+  free(components);
+  free(copy);
+}
+
+static void list_directory_task(void* context, size_t i)
+{
+  list_directory(&((struct directory_listing*)context)[i]);
+}
+
+// Adds every file below a directory in sorted order. Each level of the tree
+// is listed in parallel, so only one level is held at a time
+static void walk_directory(struct input_list* list, const char* root,
+    const struct file_options* file_options)
+{
+  struct string_list level = { 0 };
+  struct string_list found = { 0 };
+  string_list_add(&level, copy_string(root));
+  while (level.count) {
+    struct directory_listing* listings
+        = calloc(level.count, sizeof(struct directory_listing));
+    if (!listings) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+    for (size_t i = 0; i < level.count; i++) {
+      listings[i].path = level.items[i];
+    }
+    run_parallel(level.count, list->jobs, list_directory_task, listings);
+    struct string_list next = { 0 };
+    for (size_t i = 0; i < level.count; i++) {
+      if (listings[i].failed) {
+        fprintf(stderr, "Could not read directory: '%s'\n", level.items[i]);
+        exit(1);
+      }
+      for (size_t f = 0; f < listings[i].files.count; f++) {
+        string_list_add(&found, listings[i].files.items[f]);
+      }
+      for (size_t d = 0; d < listings[i].directories.count; d++) {
+        string_list_add(&next, listings[i].directories.items[d]);
+      }
+      free(listings[i].files.items);
+      free(listings[i].directories.items);
+      string_list_add(&list->dependencies, level.items[i]);
+    }
+    free(listings);
+    free(level.items);
+    level = next;
+  }
+  free(level.items);
+  qsort(found.items, found.count, sizeof(char*), compare_strings);
+  for (size_t i = 0; i < found.count; i++) {
+    add_input(list, found.items[i], file_options);
+  }
+  free(found.items);
+}
+
+// Adds a member of an archive as an input named by its path in the archive
+static void add_archive_member(struct input_list* list, const char* name,
+    size_t name_length, const struct archive_member* member,
+    const struct file_options* file_options)
+{
+  // Leading ./ and / are left off so names match the extracted files
+  while (name_length && (name[0] == '/' || name[0] == PATH_SEPARATOR)) {
+    name++;
+    name_length--;
+  }
+  while (name_length > 2 && name[0] == '.'
+      && (name[1] == '/' || name[1] == PATH_SEPARATOR)) {
+    name += 2;
+    name_length -= 2;
+  }
+  if (!name_length) {
+    return;
+  }
+  char* copy = malloc(name_length + 1);
+  if (!copy) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  memcpy(copy, name, name_length);
+  copy[name_length] = '\0';
+  struct file_options options = *file_options;
+  options.member = *member;
+  add_input(list, copy, &options);
+}
+
+static void corrupt_archive(const char* path)
+{
+  fprintf(stderr, "Corrupt or truncated archive: '%s'\n", path);
+  exit(1);
+}
+
+// Tar archives are 512 byte blocks, each file a header block followed by its
+// data
+#define TAR_BLOCK_SIZE 512
+
+// Parses a number field of a tar header, octal text or, for sizes of 8 GiB
+// and more, big endian binary flagged by the high bit
+static bool tar_number(
+    const unsigned char* field, size_t length, uint64_t* value)
+{
+  *value = 0;
+  if (field[0] & 0x80) {
+    *value = field[0] & 0x7f;
+    for (size_t i = 1; i < length; i++) {
+      if (*value >> 56) {
+        return false;
+      }
+      *value = *value << 8 | field[i];
+    }
+    return true;
+  }
+  size_t i = 0;
+  while (i < length && field[i] == ' ') {
+    i++;
+  }
+  for (; i < length && field[i] >= '0' && field[i] <= '7'; i++) {
+    if (*value >> 61) {
+      return false;
+    }
+    *value = *value << 3 | (uint64_t)(field[i] - '0');
+  }
+  return i == length || field[i] == ' ' || field[i] == '\0';
+}
+
+// Whether a block is a tar header, whose checksum counts its own field as
+// spaces
+static bool is_tar_header(const unsigned char* block)
+{
+  uint64_t checksum;
+  if (!tar_number(block + 148, 8, &checksum)) {
+    return false;
+  }
+  uint64_t sum = 8 * ' ';
+  for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+    sum += i < 148 || i >= 156 ? block[i] : 0;
+  }
+  return sum == checksum;
+}
+
+// Length of a field that is null terminated unless it fills its space
+static size_t field_length(const unsigned char* field, size_t size)
+{
+  const unsigned char* end = memchr(field, '\0', size);
+  return end ? (size_t)(end - field) : size;
+}
+
+// Takes the path and size out of the records of a pax extended header, each
+// written as "<length> <key>=<value>\n"
+static void read_pax_header(const char* path, const unsigned char* data,
+    size_t size, char** name, uint64_t* member_size, bool* has_size)
+{
+  for (size_t offset = 0; offset < size;) {
+    size_t length = 0;
+    size_t i = offset;
+    while (i < size && data[i] >= '0' && data[i] <= '9') {
+      length = length * 10 + (size_t)(data[i++] - '0');
+    }
+    if (i == size || data[i] != ' ' || length > size - offset
+        || length <= i - offset + 1) {
+      corrupt_archive(path);
+    }
+    const char* key = (const char*)data + i + 1;
+    const char* end = (const char*)data + offset + length - 1;
+    offset += length;
+    const char* value = memchr(key, '=', end - key);
+    if (!value) {
+      corrupt_archive(path);
+    }
+    value++;
+    if ((size_t)(value - key) == 5 && 0 == memcmp(key, "path=", 5)) {
+      free(*name);
+      *name = malloc(end - value + 1);
+      if (!*name) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+      }
+      memcpy(*name, value, end - value);
+      (*name)[end - value] = '\0';
+    } else if ((size_t)(value - key) == 5 && 0 == memcmp(key, "size=", 5)) {
+      *member_size = 0;
+      for (const char* c = value; c < end; c++) {
+        if (*c < '0' || *c > '9' || *member_size > (UINT64_MAX - 9) / 10) {
+          corrupt_archive(path);
+        }
+        *member_size = *member_size * 10 + (uint64_t)(*c - '0');
+      }
+      *has_size = true;
+    }
+  }
+}
+
+// Adds the regular files of a ustar, GNU or pax tar archive. Long names come
+// from GNU L entries and pax headers, which also hold sizes too large for
+// the header.
+static void read_tar(struct input_list* list, const char* path,
+    const struct input_data* archive, const struct file_options* file_options)
+{
+  char* long_name = NULL;
+  uint64_t pax_size = 0;
+  bool has_pax_size = false;
+  size_t offset = 0;
+  // The archive ends with zero blocks, or just ends
+  while (offset + TAR_BLOCK_SIZE <= archive->size
+      && archive->data[offset] != '\0') {
+    const unsigned char* header = archive->data + offset;
+    uint64_t size;
+    if (!is_tar_header(header) || !tar_number(header + 124, 12, &size)) {
+      corrupt_archive(path);
+    }
+    char type = (char)header[156];
+    if (has_pax_size && type != 'x' && type != 'g') {
+      size = pax_size;
+    }
+    size_t data = offset + TAR_BLOCK_SIZE;
+    if (size > archive->size - data) {
+      corrupt_archive(path);
+    }
+    offset = data + align_up((size_t)size, TAR_BLOCK_SIZE);
+    if (type == 'x') {
+      read_pax_header(path, archive->data + data, (size_t)size, &long_name,
+          &pax_size, &has_pax_size);
+      continue;
+    }
+    if (type == 'L') {
+      size_t length = field_length(archive->data + data, (size_t)size);
+      free(long_name);
+      long_name = malloc(length + 1);
+      if (!long_name) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+      }
+      memcpy(long_name, archive->data + data, length);
+      long_name[length] = '\0';
+      continue;
+    }
+    // Global headers and link names of the next entry do not name a file
+    if (type == 'g' || type == 'K') {
+      continue;
+    }
+    // Regular files, leaving out directories, links and devices
+    if (type == '0' || type == '\0' || type == '7') {
+      struct archive_member member
+          = { archive, data, (size_t)size, false, (size_t)size };
+      if (long_name) {
+        add_archive_member(
+            list, long_name, strlen(long_name), &member, file_options);
+      } else {
+        // ustar splits long paths into a prefix and a name
+        char name[155 + 1 + 100];
+        size_t length = 0;
+        if (0 == memcmp(header + 257, "ustar", 5)) {
+          length = field_length(header + 345, 155);
+          memcpy(name, header + 345, length);
+          if (length) {
+            name[length++] = '/';
+          }
+        }
+        size_t name_length = field_length(header, 100);
+        memcpy(name + length, header, name_length);
+        add_archive_member(
+            list, name, length + name_length, &member, file_options);
+      }
+    }
+    free(long_name);
+    long_name = NULL;
+    has_pax_size = false;
+  }
+  free(long_name);
+}
+
+#define ZIP_LOCAL_HEADER 0x04034b50
+#define ZIP_CENTRAL_HEADER 0x02014b50
+#define ZIP_END 0x06054b50
+#define ZIP64_END 0x06064b50
+#define ZIP64_END_LOCATOR 0x07064b50
+
+static unsigned read_le16(const unsigned char* data)
+{
+  return (unsigned)data[0] | (unsigned)data[1] << 8;
+}
+
+// Finds the end of central directory record, which is followed by a comment
+// of up to 64 KiB
+static size_t find_zip_end(const char* path, const struct input_data* archive)
+{
+  if (archive->size < 22) {
+    corrupt_archive(path);
+  }
+  for (size_t i = archive->size - 22;; i--) {
+    if (read_le32(archive->data + i) == ZIP_END) {
+      return i;
+    }
+    if (i == 0 || archive->size - i >= 22 + 65535) {
+      corrupt_archive(path);
+    }
+  }
+}
+
+// Adds the files of a zip archive from its central directory. Zip64
+// archives are read too, members must be stored or deflated.
+static void read_zip(struct input_list* list, const char* path,
+    const struct input_data* archive, const struct file_options* file_options)
+{
+  const unsigned char* data = archive->data;
+  size_t size = archive->size;
+  size_t end = find_zip_end(path, archive);
+  uint64_t count = read_le16(data + end + 10);
+  uint64_t directory = read_le32(data + end + 16);
+  if ((count == 0xffff || directory == 0xffffffff) && end >= 20
+      && read_le32(data + end - 20) == ZIP64_END_LOCATOR) {
+    uint64_t record = load_le64(data + end - 12);
+    if (size < 56 || record > size - 56
+        || read_le32(data + record) != ZIP64_END) {
+      corrupt_archive(path);
+    }
+    count = load_le64(data + record + 32);
+    directory = load_le64(data + record + 48);
+  }
+  uint64_t entry = directory;
+  for (uint64_t i = 0; i < count; i++) {
+    if (size < 46 || entry > size - 46
+        || read_le32(data + entry) != ZIP_CENTRAL_HEADER) {
+      corrupt_archive(path);
+    }
+    const unsigned char* header = data + entry;
+    unsigned flags = read_le16(header + 8);
+    unsigned method = read_le16(header + 10);
+    uint64_t compressed_size = read_le32(header + 20);
+    uint64_t original_size = read_le32(header + 24);
+    size_t name_length = read_le16(header + 28);
+    size_t extra_length = read_le16(header + 30);
+    size_t comment_length = read_le16(header + 32);
+    uint64_t local = read_le32(header + 42);
+    if (name_length + extra_length + comment_length > size - entry - 46) {
+      corrupt_archive(path);
+    }
+    const char* name = (const char*)header + 46;
+    // The zip64 extra field holds the values too large for their fields, in
+    // this order
+    const unsigned char* extra = header + 46 + name_length;
+    for (size_t e = 0; e + 4 <= extra_length;) {
+      size_t length = read_le16(extra + e + 2);
+      if (length > extra_length - e - 4) {
+        break;
+      }
+      if (read_le16(extra + e) == 1) {
+        const unsigned char* field = extra + e + 4;
+        const unsigned char* field_end = field + length;
+        uint64_t* values[] = { &original_size, &compressed_size, &local };
+        for (size_t v = 0; v < 3; v++) {
+          if (*values[v] == 0xffffffff && field_end - field >= 8) {
+            *values[v] = load_le64(field);
+            field += 8;
+          }
+        }
+      }
+      e += 4 + length;
+    }
+    entry += 46 + name_length + extra_length + comment_length;
+    // Directories end with a /
+    if (name_length && name[name_length - 1] == '/') {
+      continue;
+    }
+    if (flags & 1) {
+      fprintf(stderr, "'%.*s' in '%s' is encrypted\n", (int)name_length,
+          name, path);
+      exit(1);
+    }
+    if (method != 0 && method != 8) {
+      fprintf(stderr,
+          "'%.*s' in '%s' uses compression method %u, only stored and "
+          "deflated members can be read\n",
+          (int)name_length, name, path, method);
+      exit(1);
+    }
+    if (size < 30 || local > size - 30
+        || read_le32(data + local) != ZIP_LOCAL_HEADER) {
+      corrupt_archive(path);
+    }
+    uint64_t start = local + 30 + read_le16(data + local + 26)
+        + read_le16(data + local + 28);
+    if (start > size || compressed_size > size - start
+        || original_size >= SIZE_MAX
+        || (method == 0 && compressed_size != original_size)) {
+      corrupt_archive(path);
+    }
+    struct archive_member member = { archive, (size_t)start,
+      (size_t)compressed_size, method == 8, (size_t)original_size };
+    add_archive_member(list, name, name_length, &member, file_options);
+  }
+}
+
+// Adds the regular files of a tar or zip archive, in the order they are
+// stored. The archive is kept open and its members are used where they are,
+// but for deflated zip members, which are inflated when the inputs are
+// opened.
+static void read_archive(struct input_list* list, const char* path,
+    const struct file_options* file_options)
+{
+  struct input_data* archive = malloc(sizeof(struct input_data));
+  struct input_data** archives = realloc(
+      list->archives, sizeof(struct input_data*) * (list->archive_count + 1));
+  if (!archive || !archives) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  list->archives = archives;
+  list->archives[list->archive_count++] = archive;
+  if (0 == strcmp(path, "-")) {
+    if (list->reads_stdin) {
+      fprintf(stderr, "Only one file can be read from stdin\n");
+      exit(1);
+    }
+    list->reads_stdin = true;
+  }
+  open_input_file(path, archive);
+  if (!list->reads_stdin || 0 != strcmp(path, "-")) {
+    string_list_add(&list->dependencies, copy_string(path));
+  }
+  if (archive->size >= 4
+      && (read_le32(archive->data) == ZIP_LOCAL_HEADER
+          || read_le32(archive->data) == ZIP_END)) {
+    read_zip(list, path, archive, file_options);
+  } else if (archive->size >= TAR_BLOCK_SIZE
+      && is_tar_header(archive->data)) {
+    read_tar(list, path, archive, file_options);
+  } else if (archive->size >= 2 && archive->data[0] == 0x1f
+      && archive->data[1] == 0x8b) {
+    fprintf(stderr,
+        "'%s' is compressed, pipe it in decompressed as in "
+        "gzip -dc %s | embed --archive -\n",
+        path, path);
+    exit(1);
+  } else {
+    fprintf(stderr, "Not a tar or zip archive: '%s'\n", path);
+    exit(1);
+  }
+}
+
+// Response files nested deeper than this are taken to include themselves
+#define MAX_RESPONSE_DEPTH 16
+
+static void add_input_argument(
+    struct input_list* list, const char* argument, unsigned depth);
+
+// Adds the inputs listed in a response file, one per line. Empty lines and
+// lines starting with # are skipped
+static void read_response_file(
+    struct input_list* list, const char* path, unsigned depth)
+{
+  if (depth >= MAX_RESPONSE_DEPTH) {
+    fprintf(stderr, "Response files nest too deeply at '%s'\n", path);
+    exit(1);
+  }
+  struct input_data input;
+  open_input_file(path, &input);
+  list->hash = xxh64(input.data, input.size, list->hash);
+  string_list_add(&list->dependencies, copy_string(path));
+  const char* c = (const char*)input.data;
+  const char* end = c + input.size;
+  while (c < end) {
+    const char* line_end = memchr(c, '\n', end - c);
+    if (!line_end) {
+      line_end = end;
+    }
+    size_t length = line_end - c;
+    if (length && c[length - 1] == '\r') {
+      length--;
+    }
+    if (length && c[0] != '#') {
+      char* line = malloc(length + 1);
+      if (!line) {
+        fprintf(stderr, "Could not allocate memory\n");
+        exit(1);
+      }
+      memcpy(line, c, length);
+      line[length] = '\0';
+      add_input_argument(list, line, depth + 1);
+      free(line);
+    }
+    c = line_end + 1;
+  }
+  close_input_file(&input);
+}
+
+// Adds an input file, the files matching a pattern or the inputs of an
+// @response file
+static void add_input_argument(
+    struct input_list* list, const char* argument, unsigned depth)
 {
-  fprintf(fd, "0x%02X", (unsigned char)b);
+  if (argument[0] == '@') {
+    read_response_file(list, argument + 1, depth);
+    return;
+  }
+  char* path = copy_string(argument);
+  struct file_options file_options = { 0 };
+  split_file_options(path, &file_options);
+  bool standard_input = 0 == strcmp(path, "-");
+  if (standard_input && !file_options.name) {
+    fprintf(stderr, "A file read from stdin needs a name, as in -:name=file\n");
+    exit(1);
+  }
+  if (standard_input && list->reads_stdin) {
+    fprintf(stderr, "Only one file can be read from stdin\n");
+    exit(1);
+  }
+  list->reads_stdin = list->reads_stdin || standard_input;
+  // A renamed file or one that exists is taken as it is, even with pattern
+  // characters
+  if (file_options.name) {
+    char* name = copy_string(file_options.name);
+    file_options.name = NULL;
+    file_options.path = path;
+    add_input(list, name, &file_options);
+  } else if (is_pattern(path) && !is_regular_file(path)) {
+    expand_pattern(list, path, &file_options);
+    free(path);
+  } else {
+    add_input(list, path, &file_options);
+  }
 }
 
-static const char* plain_name(const char* filename)
+// Gathers the input files, with the options of each, from the file
+// arguments, the --recursive directories and the --archive archives, which
+// may all carry options
+static void gather_input_files(struct input_list* list, char* const* args,
+    char* const* directories, char* const* archives, uint64_t arguments_hash,
+    unsigned jobs)
 {
-  const char* no_path = filename;
-  for (int i = 0; filename[i] != '\0'; i++) {
-    if (filename[i] == PATH_SEPARATOR) {
-      no_path = &(filename[i + 1]);
+  memset(list, 0, sizeof(*list));
+  list->hash = arguments_hash;
+  list->jobs = jobs;
+  for (size_t i = 0; directories && directories[i]; i++) {
+    char* directory = copy_string(directories[i]);
+    struct file_options file_options = { 0 };
+    split_file_options(directory, &file_options);
+    if (file_options.name) {
+      fprintf(stderr, "name can only be given for a single file, not '%s'\n",
+          directory);
+      exit(1);
     }
+    walk_directory(list, directory, &file_options);
+    free(directory);
   }
-  return no_path;
-}
-
-static void generate_file_list(
-    FILE* fd, char* const* files, bool preserve_paths)
-{
-  fprintf(fd, "static const char* EMBEDDED_FILE_NAMES[] = {\n");
-  for (int file_count = 0; *files; file_count++) {
-    const char* input_file = *files;
-    // If we don't preserve paths, find the name without a path
-    if (!preserve_paths) {
-      input_file = plain_name(input_file);
+  for (size_t i = 0; archives && archives[i]; i++) {
+    char* archive = copy_string(archives[i]);
+    struct file_options file_options = { 0 };
+    split_file_options(archive, &file_options);
+    if (file_options.name) {
+      fprintf(stderr, "name can only be given for a single file, not '%s'\n",
+          archive);
+      exit(1);
     }
-    fprintf(fd, "\t/* %s */\n", input_file);
-    fprintf(fd, "\t(char[]){\n\t\t");
-    for (int count = 0;; count++) {
-      char c = input_file[count];
-      if (count != 0) {
-        fprintf(fd, ", ");
-        if ((count % HEX_COLS) == 0) {
-          fprintf(fd, "\n\t\t");
-        }
-      }
-      output_hex(fd, c);
-      if (c == '\0') {
-        break;
+    read_archive(list, archive, &file_options);
+    free(archive);
+  }
+  for (size_t i = 0; args && args[i]; i++) {
+    add_input_argument(list, args[i], 0);
+  }
+  // Patterns can list a directory more than once
+  struct string_list* dependencies = &list->dependencies;
+  if (dependencies->count) {
+    qsort(dependencies->items, dependencies->count, sizeof(char*),
+        compare_strings);
+    size_t kept = 1;
+    for (size_t i = 1; i < dependencies->count; i++) {
+      if (0 == strcmp(dependencies->items[i], dependencies->items[kept - 1])) {
+        free(dependencies->items[i]);
+      } else {
+        dependencies->items[kept++] = dependencies->items[i];
       }
     }
-    fprintf(fd, "\n\t},\n");
-    files++;
+    dependencies->count = kept;
+    dependencies->items[kept] = NULL;
+  }
+  // No inputs still make an empty list
+  if (!list->files.items) {
+    list->files.items = calloc(1, sizeof(char*));
+    list->options = calloc(1, sizeof(struct file_options));
+    if (!list->files.items || !list->options) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
   }
-  fprintf(fd, "\t(char[]){0}\n");
-  fprintf(fd, "\n};\n\n");
 }
 
-// Generate the file data
-void generate_file_data(FILE* fd, char* const* files)
+// Moves the hot files to the front and the cold files to the back, keeping
+// their order otherwise, and returns the number of hot files
+static size_t place_files(char** files, struct file_options* file_options)
 {
-  fprintf(fd, "static const char* EMBEDDED_FILE_DATA[] = {\n  ");
-  for (int file_count = 0; *files; file_count++) {
-    const char* input_file = *files;
-    FILE* infd = fopen(input_file, "r");
-    if (!infd) {
-      fprintf(stderr, "Could not open file: '%s'\n", input_file);
-      exit(1);
+  size_t count = 0;
+  while (files[count]) {
+    count++;
+  }
+  char** placed_files = malloc(sizeof(char*) * (count + 1));
+  struct file_options* placed_options
+      = malloc(sizeof(struct file_options) * (count + 1));
+  if (!placed_files || !placed_options) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  static const enum placement order[]
+      = { PLACEMENT_HOT, PLACEMENT_NORMAL, PLACEMENT_COLD };
+  size_t placed = 0;
+  size_t hot_count = 0;
+  for (size_t o = 0; o < sizeof(order) / sizeof(order[0]); o++) {
+    for (size_t i = 0; i < count; i++) {
+      if (file_options[i].placement == order[o]) {
+        placed_files[placed] = files[i];
+        placed_options[placed++] = file_options[i];
+      }
     }
-    if (file_count != 0) {
-      fprintf(fd, ",\n");
+    if (order[o] == PLACEMENT_HOT) {
+      hot_count = placed;
     }
-    fprintf(fd, "\t/* %s */\n", input_file);
-    fprintf(fd, "\t(char[]){\n\t\t");
-    for (int count = 0;; count++) {
-      char c = getc(infd);
-      if (feof(infd)) {
-        break;
-      }
-      output_hex(fd, c);
-      fprintf(fd, ", ");
-      if (((count + 1) % HEX_COLS) == 0) {
-        fprintf(fd, "\n\t\t");
-      }
+  }
+  memcpy(files, placed_files, sizeof(char*) * count);
+  memcpy(file_options, placed_options, sizeof(struct file_options) * count);
+  free(placed_files);
+  free(placed_options);
+  return hot_count;
+}
+
+static void free_input_list(struct input_list* list)
+{
+  for (size_t i = 0; i < list->files.count; i++) {
+    free(list->options[i].path);
+  }
+  string_list_free(&list->files);
+  string_list_free(&list->dependencies);
+  free(list->options);
+  for (size_t i = 0; i < list->archive_count; i++) {
+    close_input_file(list->archives[i]);
+    free(list->archives[i]);
+  }
+  free(list->archives);
+}
+
+void generate_function_declaration(FILE* fd, const struct options* options)
+{
+  const char* function_name = options->function_name;
+  fprintf(fd,
+      "const char* %s(const char* filename, size_t* length);\n\n"
+      "// Looks up a name of `name_length` bytes, which need not be null\n"
+      "// terminated\n"
+      "const char* %s_n(\n"
+      "    const char* filename, size_t name_length, size_t* length);\n",
+      function_name, function_name);
+  if (options->lookup == LOOKUP_HASH) {
+    fprintf(fd,
+        "\n// Hash of a name, to compute once and look the name up with\n"
+        "// %s_hashed() without hashing it again\n"
+        "uint64_t %s_hash(const char* filename, size_t name_length);\n"
+        "const char* %s_hashed(uint64_t hash, const char* filename,\n"
+        "    size_t name_length, size_t* length);\n",
+        function_name, function_name, function_name);
+  }
+}
+
+// Set of identifiers already taken, an open addressing hash table
+struct identifier_set {
+  char** slots;
+  size_t mask;
+};
+
+// Adds `name` unless it is already taken, returning whether it was added
+static bool identifier_set_add(struct identifier_set* set, char* name)
+{
+  size_t length = strlen(name);
+  size_t slot = (size_t)name_hash(name, length, 0) & set->mask;
+  for (; set->slots[slot]; slot = (slot + 1) & set->mask) {
+    if (0 == strcmp(set->slots[slot], name)) {
+      return false;
     }
-    output_hex(fd, 0);
-    fprintf(fd, "\n\t}");
-    files++;
-    fclose(infd);
   }
-  fprintf(fd, "\n};\n\n");
+  set->slots[slot] = name;
+  return true;
 }
 
-// Generate the file data sizes
-void generate_file_data_sizes(FILE* fd, char* const* files)
+// Identifier for every file made from its name as generate_identifier_name
+// does. Names that come out the same get _2, _3 and so on in file order, and
+// COUNT is kept for the number of files
+static char** file_identifiers(
+    char* const* files, bool preserve_paths, size_t count)
 {
-  fprintf(fd, "static size_t EMBEDDED_FILE_DATA_SIZES[] = {\n  ");
-  for (int file_count = 0; *files; file_count++) {
-    const char* input_file = *files;
-    FILE* infd = fopen(input_file, "r");
-    fseek(infd, 0, SEEK_END);
-    size_t length = ftell(infd);
-    if (!infd) {
-      fprintf(stderr, "Could not open file: '%s'\n", input_file);
+  struct identifier_set set;
+  size_t capacity = 16;
+  while (capacity < (count + 1) * 2) {
+    capacity *= 2;
+  }
+  set.slots = calloc(capacity, sizeof(char*));
+  set.mask = capacity - 1;
+  char** identifiers = malloc(sizeof(char*) * (count + 1));
+  if (!set.slots || !identifiers) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  char count_name[] = "COUNT";
+  identifier_set_add(&set, count_name);
+  for (size_t i = 0; i < count; i++) {
+    const char* name = file_name(files[i], preserve_paths);
+    size_t length = strlen(name);
+    char* identifier = malloc(length + 32);
+    if (!identifier) {
+      fprintf(stderr, "Could not allocate memory\n");
       exit(1);
     }
-    if (file_count != 0) {
-      fprintf(fd, ",\n");
+    generate_identifier_name(name, identifier);
+    for (size_t suffix = 2; !identifier_set_add(&set, identifier); suffix++) {
+      generate_identifier_name(name, identifier);
+      sprintf(identifier + length, "_%zu", suffix);
     }
-    fprintf(fd, "\t/* %s */\n", input_file);
-    fprintf(fd, "\t%zu", length);
-    files++;
-    fclose(infd);
+    identifiers[i] = identifier;
   }
-  fprintf(fd, "\n};\n\n");
+  free(set.slots);
+  return identifiers;
 }
 
-// Generate the function for getting file data
-void generate_function(FILE* fd, const char* function_name)
+// Writes a name as a C string literal, with octal escapes for control bytes
+static void output_string_literal(FILE* fd, const char* text)
 {
-  fprintf(fd,
-      "const char* %s(const char* filename, size_t* length) {\n"
-      "  for (int i = 0; EMBEDDED_FILE_NAMES[i] != 0; i++) {\n"
-      "     if (0 == strcmp(filename, EMBEDDED_FILE_NAMES[i])) {\n"
-      "       if (length) {\n"
-      "         *length = EMBEDDED_FILE_DATA_SIZES[i];\n"
-      "       }\n"
-      "       return EMBEDDED_FILE_DATA[i];\n"
-      "     }\n"
-      "  }\n"
-      "  return NULL;\n"
-      "}\n\n",
+  fputc('"', fd);
+  for (const unsigned char* c = (const unsigned char*)text; *c; c++) {
+    if (*c == '"' || *c == '\\') {
+      fprintf(fd, "\\%c", *c);
+    } else if (*c < 0x20 || *c == 0x7f) {
+      fprintf(fd, "\\%03o", *c);
+    } else {
+      fputc(*c, fd);
+    }
+  }
+  fputc('"', fd);
+}
+
+// Declares an enum with every file's index and a static inline function
+// retrieving each file, for --file-index. These grow with the number of
+// files, so they are only written when asked for.
+static void generate_file_index_declarations(
+    FILE* fd, char* const* files, const struct options* options)
+{
+  const char* function_name = options->function_name;
+  size_t count = 0;
+  while (files[count]) {
+    count++;
+  }
+  char** identifiers
+      = file_identifiers(files, options->preserve_paths, count);
+  char prefix[strlen(function_name) + 1];
+  generate_identifier_name(function_name, prefix);
+  fprintf(fd, "\n// Index of each embedded file\nenum %s_file {\n",
       function_name);
+  for (size_t i = 0; i < count; i++) {
+    fprintf(fd, "  %s_FILE_%s = %zu,\n", prefix, identifiers[i], i);
+  }
+  fprintf(fd, "  %s_FILE_COUNT = %zu\n};\n\n", prefix, count);
+  for (size_t i = 0; i < count; i++) {
+    char lower[strlen(identifiers[i]) + 1];
+    for (size_t c = 0; identifiers[i][c] || (lower[c] = '\0'); c++) {
+      char u = identifiers[i][c];
+      lower[c] = u >= 'A' && u <= 'Z' ? u - 'A' + 'a' : u;
+    }
+    fprintf(fd,
+        "static inline const char* %s_file_%s(size_t* length) {\n"
+        "  return %s_at(%s_FILE_%s, length);\n"
+        "}\n",
+        function_name, lower, function_name, prefix, identifiers[i]);
+  }
+  for (size_t i = 0; i < count; i++) {
+    free(identifiers[i]);
+  }
+  free(identifiers);
 }
 
-void generate_function_declaration(FILE* fd, const char* function_name)
+// Declares access to files by index in the header: a function retrieving a
+// file by index, the functions going through every file and those of the
+// options used. With --file-index the per file declarations follow. Only
+// the names go in, so the header stays the same when the files' contents
+// change.
+void generate_index_declarations(
+    FILE* fd, char* const* files, const struct options* options)
 {
-  fprintf(fd, "const char* %s(const char* filename, size_t* length);\n",
+  const char* function_name = options->function_name;
+  fprintf(fd,
+      "\n// Retrieves a file by its index, without looking up its name\n"
+      "const char* %s_at(size_t index, size_t* length);\n\n"
+      "// Number of files, and the name and size of each by index, to go\n"
+      "// through them all\n"
+      "size_t %s_count(void);\n"
+      "const char* %s_name_at(size_t index);\n"
+      "size_t %s_size_at(size_t index);\n\n"
+      "// Copies up to `length` bytes of a file from `offset` on into\n"
+      "// `buffer`, returning how many were copied, 0 at the end of the file\n"
+      "size_t %s_read(size_t index, size_t offset, void* buffer, "
+      "size_t length);\n\n",
+      function_name, function_name, function_name, function_name,
       function_name);
+  if (options->hot_count) {
+    fprintf(fd,
+        "// Asks the system to page in the data of the hot files ahead of\n"
+        "// their first use, where it can\n"
+        "void %s_prefetch_hot(void);\n\n",
+        function_name);
+  }
+  if (options->overlay) {
+    fprintf(fd,
+        "// Serves files from `directory` in place of the embedded copies,\n"
+        "// NULL to only use the embedded copies. Does nothing in builds\n"
+        "// without the overlay.\n"
+        "void %s_set_overlay(const char* directory);\n\n",
+        function_name);
+  }
+  if (options->verify) {
+    fprintf(fd,
+        "// Checks a file's data against the checksum of the file it was\n"
+        "// generated from, returning 0 when it differs or can not be\n"
+        "// retrieved. %s_verify_all() returns how many files fail and can\n"
+        "// run on a thread of its own while the program starts.\n"
+        "int %s_verify(const char* filename);\n"
+        "int %s_verify_at(size_t index);\n"
+        "size_t %s_verify_all(void);\n\n",
+        function_name, function_name, function_name, function_name);
+  }
+  if (options->backend == BACKEND_PACK) {
+    fprintf(fd,
+        "// Maps the pack from `path` in place of the one named when the\n"
+        "// source was generated. Only the first call counts, and only\n"
+        "// before the pack is mapped by retrieving a file.\n"
+        "void %s_set_pack(const char* path);\n\n",
+        function_name);
+  }
+  if (options->file_index) {
+    generate_file_index_declarations(fd, files, options);
+  }
 }
 
-// Simply make it upper case and replace everything not a letter with _
-// Makes no attempt to deal with character encoding
-void generate_define_name(const char* filename, char* output_file)
+// Declares the C++ wrappers of the functions, which go after the extern "C"
+// block as templates can not have C linkage. Views need no copies of names,
+// a missing file has a null data().
+void generate_cpp_declarations(
+    FILE* fd, char* const* files, const struct options* options)
 {
-  const char* c = filename;
-  char* o = output_file;
-  while (*c != '\0') {
-    if (*c >= 'A' && *c <= 'Z') {
-      *o = *c;
-    } else if (*c >= 'a' && *c <= 'z') {
-      *o = *c - ('a' - 'A');
-    } else {
-      *o = '_';
-    }
-    o++;
-    c++;
+  const char* function_name = options->function_name;
+  fprintf(fd,
+      "\n#if defined(__cplusplus) && __cplusplus >= 201703L\n"
+      "#include <string_view>\n"
+      "inline std::string_view %s(std::string_view name) {\n"
+      "  size_t length = 0;\n"
+      "  const char* data = %s_n(name.data(), name.size(), &length);\n"
+      "  return data ? std::string_view(data, length) : std::string_view();\n"
+      "}\n"
+      "#if __cplusplus >= 202002L && defined(__has_include)\n"
+      "#if __has_include(<span>)\n"
+      "#include <cstddef>\n"
+      "#include <span>\n"
+      "inline std::span<const std::byte> %s_bytes(std::string_view name) {\n"
+      "  size_t length = 0;\n"
+      "  const char* data = %s_n(name.data(), name.size(), &length);\n"
+      "  return data ? std::span<const std::byte>(\n"
+      "                   reinterpret_cast<const std::byte*>(data), length)\n"
+      "              : std::span<const std::byte>();\n"
+      "}\n"
+      "#endif\n"
+      "#endif\n"
+      "#endif\n",
+      function_name, function_name, function_name, function_name);
+  if (!options->file_index) {
+    return;
   }
-  *o = '\0';
+  fprintf(fd,
+      "\n#if defined(__cplusplus) && __cplusplus >= 201402L\n"
+      "constexpr bool %s_name_equal(const char* a, const char* b) {\n"
+      "  while (*a && *a == *b) {\n"
+      "    a++;\n"
+      "    b++;\n"
+      "  }\n"
+      "  return *a == *b;\n"
+      "}\n\n"
+      "// Names of the files in order, ending in a null pointer\n"
+      "constexpr const char* const %s_index_names[] = {\n",
+      function_name, function_name);
+  for (size_t i = 0; files[i]; i++) {
+    fprintf(fd, "  ");
+    output_string_literal(fd, file_name(files[i], options->preserve_paths));
+    fprintf(fd, ",\n");
+  }
+  // A loop over one table compiles far faster than a branch per file
+  fprintf(fd,
+      "  nullptr\n"
+      "};\n\n"
+      "// Index of the file retrieved by `name`, or -1, which can be used in\n"
+      "// constant expressions\n"
+      "constexpr int %s_index(const char* name) {\n"
+      "  for (int i = 0; %s_index_names[i]; i++) {\n"
+      "    if (%s_name_equal(name, %s_index_names[i])) {\n"
+      "      return i;\n"
+      "    }\n"
+      "  }\n"
+      "  return -1;\n"
+      "}\n"
+      "#endif\n",
+      function_name, function_name, function_name, function_name);
 }
 
-int main(int argc, char** argv)
+// Generates one set of files, sharing inputs through `cache` with --sets
+static int embed_set(int argc, char** argv, struct input_cache* cache)
 {
   // Declare arguments we need
-  const char* function_name = NULL;
   const char* source_file = NULL;
   const char* header_file = NULL;
-  char* const* input_files = NULL;
-  bool preserve_paths = false;
+  const char* depfile = NULL;
+  bool incremental = false;
+  bool print_statistics = false;
+  const char* stats_json = NULL;
+  double start_time = clock_seconds();
+  char* const* input_args = NULL;
+  // Directories given with --recursive and archives given with --archive,
+  // NULL terminated
+  char** directories = calloc(argc, sizeof(char*));
+  size_t directory_count = 0;
+  char** archives = calloc(argc, sizeof(char*));
+  size_t archive_count = 0;
+  if (!directories || !archives) {
+    fprintf(stderr, "Could not allocate memory\n");
+    return EXIT_FAILURE;
+  }
+  // Taken before parsing, which splits --name=value arguments
+  uint64_t arguments_hash = hash_arguments(argc, argv);
+  struct options options = {
+    .function_name = NULL,
+    .preserve_paths = false,
+    .format = find_data_format("hex"),
+    .backend = BACKEND_ARRAY,
+    .fallback = true,
+    .lookup = LOOKUP_LINEAR,
+    .layout = LAYOUT_POINTERS,
+    .object_file = NULL,
+    .object_format = find_object_format(DEFAULT_OBJECT_FORMAT),
+    .pack_file = NULL,
+    .align = DATA_ALIGN,
+    .compress = COMPRESS_NONE,
+    .compress_threshold = 90,
+    .block_size = 0,
+    .jobs = 1,
+    .shards = 0,
+    .shard_files = NULL,
+    .stats = NULL,
+    .overlay = false,
+    .verify = false,
+    .file_index = false,
+    .section = NULL,
+    .hot_count = 0,
+    .cache = cache,
+  };
+  output_write_seconds = 0;
   // Search for arguments
   for (int arg = 1; arg < argc; arg++) {
+    // -j N and -jN are short for --jobs
+    if (!input_args && 0 == strncmp(argv[arg], "-j", 2)) {
+      const char* jobs = argv[arg][2] ? &argv[arg][2] : argv[++arg];
+      if (!jobs || !parse_jobs(jobs, &options.jobs)) {
+        fprintf(stderr, "-j needs a number of jobs\n");
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+      }
+      continue;
+    }
     if (argv[arg][0] == '-' && argv[arg][1] == '-') {
-      if (input_files) {
+      if (input_args) {
         fprintf(stderr, "You must specify all options before listing files\n");
         print_help(argv[0]);
         return EXIT_FAILURE;
       }
-      const char* arg_name = &(argv[arg][2]);
+      char* arg_name = &(argv[arg][2]);
       const char* arg_value = NULL;
-      if (arg != argc - 1) {
+      // Values are given either as --name=value or as the next argument
+      int value_args = 1;
+      char* equals = strchr(arg_name, '=');
+      if (equals) {
+        *equals = '\0';
+        arg_value = equals + 1;
+        value_args = 0;
+      } else if (arg != argc - 1) {
         arg_value = argv[arg + 1];
       }
       if (0 == strcmp(arg_name, "source")) {
         source_file = arg_value;
-        arg++;
+        arg += value_args;
       } else if (0 == strcmp(arg_name, "header")) {
         header_file = arg_value;
-        arg++;
+        arg += value_args;
       } else if (0 == strcmp(arg_name, "function")) {
-        function_name = arg_value;
-        arg++;
+        options.function_name = arg_value;
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "format")) {
+        options.format = arg_value ? find_data_format(arg_value) : NULL;
+        if (!options.format) {
+          fprintf(stderr, "Unknown data format '%s'\n",
+              arg_value ? arg_value : "");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "backend")) {
+        if (arg_value && 0 == strcmp(arg_value, "array")) {
+          options.backend = BACKEND_ARRAY;
+        } else if (arg_value && 0 == strcmp(arg_value, "embed")) {
+          options.backend = BACKEND_EMBED;
+        } else if (arg_value && 0 == strcmp(arg_value, "incbin")) {
+          options.backend = BACKEND_INCBIN;
+        } else {
+          fprintf(stderr, "Unknown backend '%s'\n", arg_value ? arg_value : "");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "lookup")) {
+        if (arg_value && 0 == strcmp(arg_value, "linear")) {
+          options.lookup = LOOKUP_LINEAR;
+        } else if (arg_value && 0 == strcmp(arg_value, "hash")) {
+          options.lookup = LOOKUP_HASH;
+        } else if (arg_value && 0 == strcmp(arg_value, "sorted")) {
+          options.lookup = LOOKUP_SORTED;
+        } else {
+          fprintf(stderr, "Unknown lookup '%s'\n", arg_value ? arg_value : "");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "layout")) {
+        if (arg_value && 0 == strcmp(arg_value, "pointers")) {
+          options.layout = LAYOUT_POINTERS;
+        } else if (arg_value && 0 == strcmp(arg_value, "blob")) {
+          options.layout = LAYOUT_BLOB;
+        } else {
+          fprintf(stderr, "Unknown layout '%s'\n", arg_value ? arg_value : "");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "align")) {
+        options.align = arg_value ? parse_align(arg_value) : 0;
+        if (!options.align) {
+          fprintf(stderr,
+              "Alignment must be a power of two no larger than %d\n",
+              MAX_DATA_ALIGN);
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "compress")) {
+        if (!arg_value || !find_compression(arg_value, &options.compress)) {
+          fprintf(stderr, "Unknown compression '%s'\n",
+              arg_value ? arg_value : "");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "compress-threshold")) {
+        if (!arg_value
+            || !parse_percent(arg_value, &options.compress_threshold)) {
+          fprintf(stderr, "The compression threshold must be a percentage\n");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "block-size")) {
+        if (!arg_value || !parse_block_size(arg_value, &options.block_size)) {
+          fprintf(stderr,
+              "The block size must be 0 or from %d to %d bytes\n",
+              MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "jobs")) {
+        if (!arg_value || !parse_jobs(arg_value, &options.jobs)) {
+          fprintf(stderr, "--jobs needs a number of jobs\n");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "max-memory")) {
+        if (!arg_value || !parse_memory_size(arg_value, &options.max_memory)) {
+          fprintf(stderr,
+              "--max-memory needs a number of bytes, as in 512M or 2G\n");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "object")) {
+        options.object_file = arg_value;
+        options.backend = BACKEND_OBJECT;
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "pack")) {
+        if (!arg_value) {
+          fprintf(stderr, "--pack needs a file name\n");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        options.pack_file = arg_value;
+        options.backend = BACKEND_PACK;
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "object-format")) {
+        options.object_format
+            = arg_value ? find_object_format(arg_value) : NULL;
+        if (!options.object_format) {
+          fprintf(stderr, "Unknown object format '%s'\n",
+              arg_value ? arg_value : "");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "no-fallback")) {
+        options.fallback = false;
+      } else if (0 == strcmp(arg_name, "overlay")) {
+        options.overlay = true;
+      } else if (0 == strcmp(arg_name, "verify")) {
+        options.verify = true;
+      } else if (0 == strcmp(arg_name, "section")) {
+        if (!arg_value || !valid_section(arg_value)) {
+          fprintf(stderr,
+              "--section needs a name of up to %d letters, digits, '_', "
+              "'.' or '$'\n",
+              MAX_SECTION_NAME);
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        options.section = arg_value;
+        arg += value_args;
       } else if (0 == strcmp(arg_name, "help")) {
         print_help(argv[0]);
         return EXIT_FAILURE;
+      } else if (0 == strcmp(arg_name, "file-index")) {
+        options.file_index = true;
       } else if (0 == strcmp(arg_name, "preserve-paths")) {
-        preserve_paths = true;
+        options.preserve_paths = true;
+      } else if (0 == strcmp(arg_name, "shards")) {
+        if (!arg_value || !parse_shards(arg_value, &options.shards)) {
+          fprintf(stderr, "--shards needs a number of shards\n");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "recursive")) {
+        if (!arg_value) {
+          fprintf(stderr, "--recursive needs a directory\n");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        directories[directory_count++] = (char*)arg_value;
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "archive")) {
+        if (!arg_value) {
+          fprintf(stderr, "--archive needs a tar or zip archive\n");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        archives[archive_count++] = (char*)arg_value;
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "stats")) {
+        print_statistics = true;
+      } else if (0 == strcmp(arg_name, "stats-json")) {
+        if (!arg_value) {
+          fprintf(stderr, "--stats-json needs a file name\n");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        stats_json = arg_value;
+        arg += value_args;
+      } else if (0 == strcmp(arg_name, "incremental")) {
+        incremental = true;
+      } else if (0 == strcmp(arg_name, "depfile")) {
+        if (!arg_value) {
+          fprintf(stderr, "--depfile needs a file name\n");
+          print_help(argv[0]);
+          return EXIT_FAILURE;
+        }
+        depfile = arg_value;
+        arg += value_args;
       } else {
         fprintf(stderr, "Unrecognized option '--%s'\n", arg_name);
         print_help(argv[0]);
         return EXIT_FAILURE;
       }
     } else {
-      if (!input_files) {
-        input_files = &(argv[arg]);
+      if (!input_args) {
+        input_args = &(argv[arg]);
       }
       break;
     }
   }
+  if (options.object_file && options.pack_file) {
+    fprintf(stderr, "--object and --pack can not be used together\n");
+    return EXIT_FAILURE;
+  }
   if (!source_file) {
     fprintf(stderr,
         "Error: You must provide --source for the output source file\n\n");
@@ -277,32 +8669,238 @@ int main(int argc, char** argv)
         "Notice: Not producing a header file because --header was not "
         "provided\n");
   }
-  if (!function_name) {
+  if (!options.function_name) {
     fprintf(stderr,
         "Error: You must provide --function for the file get function "
         "name\n\n");
     print_help(argv[0]);
     return EXIT_FAILURE;
   }
+  struct input_list input_list;
+  gather_input_files(&input_list, input_args, directories, archives,
+      arguments_hash, options.jobs);
+  free(directories);
+  free(archives);
+  char** input_files = input_list.files.items;
+  struct file_options* file_options = input_list.options;
+  options.hot_count = place_files(input_files, file_options);
+  bool placed = options.hot_count > 0;
+  for (size_t i = 0; input_files[i]; i++) {
+    placed = placed || file_options[i].placement != PLACEMENT_NORMAL;
+  }
+  if (placed && options.lookup == LOOKUP_SORTED) {
+    fprintf(stderr,
+        "placement needs the linear or hash lookup, sorted orders the files "
+        "by name\n");
+    return EXIT_FAILURE;
+  }
+  // Separate arrays and shards go wherever the compiler and linker put
+  // them, which need not be in file order, so the range advised as hot
+  // could take in cold data
+  bool in_order = options.backend == BACKEND_OBJECT
+      || options.backend == BACKEND_PACK
+      || (options.layout == LAYOUT_BLOB && options.shards <= 1);
+  if (placed && !in_order) {
+    fprintf(stderr,
+        "placement needs --layout blob without --shards, --object or --pack, "
+        "which keep the data in file order\n");
+    return EXIT_FAILURE;
+  }
+  if (options.lookup == LOOKUP_SORTED) {
+    sort_files(input_files, file_options, options.preserve_paths);
+  }
+  // Compressed data is written by embed itself, which the compiler reading
+  // the files for #embed and .incbin can not do
+  bool compress = options.compress != COMPRESS_NONE;
+  for (size_t i = 0; input_files[i]; i++) {
+    compress = compress
+        || (file_options[i].has_compress
+            && file_options[i].compress != COMPRESS_NONE);
+  }
+  if (compress && options.backend != BACKEND_ARRAY
+      && options.backend != BACKEND_OBJECT
+      && options.backend != BACKEND_PACK) {
+    fprintf(stderr,
+        "Compression needs the array backend, an object file or a pack\n");
+    return EXIT_FAILURE;
+  }
+  // The compiler reads files for #embed and .incbin by the path they are
+  // embedded under, so renamed files, stdin and archive members need embed
+  // to read them
+  bool renamed = false;
+  for (size_t i = 0; input_files[i]; i++) {
+    renamed = renamed || file_options[i].path || file_options[i].member.archive;
+  }
+  if (renamed && options.backend != BACKEND_ARRAY
+      && options.backend != BACKEND_OBJECT
+      && options.backend != BACKEND_PACK) {
+    fprintf(stderr,
+        "name, stdin and archive inputs need the array backend, an object "
+        "file or a pack\n");
+    return EXIT_FAILURE;
+  }
+  // Only arrays are slow enough to compile to be worth splitting up
+  if (options.shards && options.backend != BACKEND_ARRAY) {
+    fprintf(stderr, "--shards needs the array backend\n");
+    return EXIT_FAILURE;
+  }
+  if (options.shards) {
+    options.shard_files = malloc(sizeof(char*) * options.shards);
+    if (!options.shard_files) {
+      fprintf(stderr, "Could not allocate memory\n");
+      return EXIT_FAILURE;
+    }
+    for (unsigned i = 0; i < options.shards; i++) {
+      options.shard_files[i] = shard_file_name(source_file, i);
+    }
+  }
+  struct stats stats;
+  if ((print_statistics || stats_json) && !(cache && cache->planning)) {
+    init_stats(&stats, input_list.files.count);
+    options.stats = &stats;
+  }
+  double phase_start = clock_seconds();
+  struct input_data* inputs
+      = open_input_files(input_files, file_options, &options);
+  phase_start = record_phase(options.stats, PHASE_OPEN_INPUTS, phase_start);
+  if (options.max_memory) {
+    // The source's buffer, the object file's and one for each shard, and
+    // inputs that could not be mapped
+    options.reserved_memory = (size_t)OUTPUT_BUFFER_SIZE * (2 + options.shards);
+    for (size_t i = 0; input_files[i]; i++) {
+      if (!inputs[i].mapped
+          && (!inputs[i].borrowed || inputs[i].cache_entry)) {
+        options.reserved_memory += inputs[i].size;
+      }
+    }
+    for (size_t i = 0; i < input_list.archive_count; i++) {
+      if (!input_list.archives[i]->mapped) {
+        options.reserved_memory += input_list.archives[i]->size;
+      }
+    }
+    if (options.reserved_memory > options.max_memory) {
+      memory_exceeded(options.reserved_memory, &options);
+    }
+  }
+  if (cache && cache->planning) {
+    // Planning --shared-data only needs the data each file stores
+    struct data_layout layout;
+    compute_data_layout(&layout, input_files, inputs, file_options, &options);
+    free_data_layout(&layout);
+    free_input_list(&input_list);
+    for (unsigned i = 0; i < options.shards; i++) {
+      free(options.shard_files[i]);
+    }
+    free(options.shard_files);
+    return EXIT_SUCCESS;
+  }
+  if (!check_backend_paths(input_files, &options)) {
+    return EXIT_FAILURE;
+  }
+  size_t output_count = 4 + options.shards;
+  const char** outputs = malloc(sizeof(char*) * output_count);
+  if (!outputs) {
+    fprintf(stderr, "Could not allocate memory\n");
+    return EXIT_FAILURE;
+  }
+  outputs[0] = source_file;
+  outputs[1] = header_file;
+  outputs[2] = options.object_file;
+  outputs[3] = options.pack_file;
+  for (unsigned i = 0; i < options.shards; i++) {
+    outputs[4 + i] = options.shard_files[i];
+  }
+  if (depfile) {
+    write_depfile(depfile, outputs, output_count, input_files, file_options,
+        input_list.dependencies.items);
+  }
+  char* manifest_file = NULL;
+  struct output_buffer manifest = { 0 };
+  if (incremental) {
+    manifest_file = malloc(strlen(source_file) + sizeof(".manifest"));
+    if (!manifest_file) {
+      fprintf(stderr, "Could not allocate memory\n");
+      return EXIT_FAILURE;
+    }
+    sprintf(manifest_file, "%s.manifest", source_file);
+    output_buffer_init(&manifest, NULL);
+    build_manifest(
+        &manifest, input_files, inputs, input_list.hash, &options);
+    bool up_to_date
+        = file_matches(manifest_file, manifest.data, manifest.length);
+    for (size_t i = 0; i < output_count; i++) {
+      up_to_date = up_to_date && (!outputs[i] || file_exists(outputs[i]));
+    }
+    if (up_to_date) {
+      return EXIT_SUCCESS;
+    }
+    // An interrupted run must not leave a manifest matching partial outputs
+    remove(manifest_file);
+  }
   FILE* source_fd = fopen(source_file, "w");
   if (!source_fd) {
     fprintf(stderr, "Could not open output source file '%s'\n", source_file);
     return EXIT_FAILURE;
   }
-  FILE* header_fd = fopen(header_file, "w");
-  if (!header_fd) {
-    fprintf(stderr, "Could not open output header file '%s'\n", header_file);
-    return EXIT_FAILURE;
+  FILE* header_fd = NULL;
+  if (header_file) {
+    header_fd = fopen(header_file, "w");
+    if (!header_fd) {
+      fprintf(stderr, "Could not open output header file '%s'\n", header_file);
+      return EXIT_FAILURE;
+    }
   }
+  init_hex_table();
+  init_decimal_table();
+  init_crc32c_table();
   fprintf(source_fd,
       "#include <stdlib.h>\n"
-      "#include <string.h>\n");
-  generate_file_list(source_fd, input_files, preserve_paths);
-  generate_file_data(source_fd, input_files);
-  generate_file_data_sizes(source_fd, input_files);
-  generate_function(source_fd, function_name);
+      "#include <string.h>\n"
+      "%s%s",
+      options.lookup != LOOKUP_LINEAR || options.layout == LAYOUT_BLOB
+              || compress || options.hot_count
+              || options.backend == BACKEND_PACK || options.verify
+          ? "#include <stdint.h>\n"
+          : "",
+      align_macro);
+  struct output_buffer preamble;
+  output_buffer_init(&preamble, source_fd);
+  output_section_macro(&preamble, &options);
+  output_buffer_puts(&preamble, options.format->preamble);
+  output_buffer_free(&preamble);
+  struct data_layout layout;
+  phase_start = clock_seconds();
+  compute_data_layout(&layout, input_files, inputs, file_options, &options);
+  if (options.stats) {
+    record_layout_stats(options.stats, &layout, &options);
+  }
+  phase_start = record_phase(options.stats, PHASE_LAYOUT, phase_start);
+  generate_file_list(source_fd, input_files, &options);
+  phase_start = record_phase(options.stats, PHASE_FILE_LIST, phase_start);
+  if (options.backend == BACKEND_OBJECT) {
+    generate_object(input_files, &options, &layout);
+    phase_start = record_phase(options.stats, PHASE_OBJECT, phase_start);
+  } else if (options.backend == BACKEND_PACK) {
+    generate_pack(&options, &layout);
+    phase_start = record_phase(options.stats, PHASE_OBJECT, phase_start);
+  }
+  generate_file_data(source_fd, input_files, &options, &layout);
+  phase_start = record_phase(options.stats, PHASE_FILE_DATA, phase_start);
+  generate_file_data_sizes(source_fd, input_files, &options, &layout);
+  phase_start
+      = record_phase(options.stats, PHASE_FILE_DATA_SIZES, phase_start);
+  generate_pack_access(source_fd, &options, &layout);
+  generate_decompression(source_fd, &options, &layout);
+  phase_start = record_phase(options.stats, PHASE_DECOMPRESSION, phase_start);
+  generate_overlay(source_fd, &options, &layout);
+  generate_function(source_fd, input_files, &options);
+  generate_index_function(source_fd, &options, &layout);
+  generate_verify(source_fd, &options, &layout);
+  generate_prefetch(source_fd, &options, &layout);
+  free_data_layout(&layout);
   fprintf(source_fd, "\n");
   fclose(source_fd);
+  phase_start = record_phase(options.stats, PHASE_FUNCTION, phase_start);
   if (header_file) {
     char header_file_define_name[strlen(header_file) + 1];
     generate_define_name(header_file, header_file_define_name);
@@ -311,11 +8909,287 @@ int main(int argc, char** argv)
         "#ifndef _%s_\n"
         "#define _%s_\n"
         "#include <stdlib.h>\n"
-        "#include <string.h>\n\n",
-        header_file_define_name, header_file_define_name);
-    generate_function_declaration(header_fd, function_name);
+        "#include <string.h>\n%s\n"
+        "#ifdef __cplusplus\n"
+        "extern \"C\" {\n"
+        "#endif\n\n",
+        header_file_define_name, header_file_define_name,
+        options.lookup == LOOKUP_HASH ? "#include <stdint.h>\n" : "");
+    generate_function_declaration(header_fd, &options);
+    generate_index_declarations(header_fd, input_files, &options);
+    fprintf(header_fd, "\n#ifdef __cplusplus\n}\n#endif\n");
+    generate_cpp_declarations(header_fd, input_files, &options);
     fprintf(header_fd, "\n#endif\n");
     fclose(header_fd);
+    phase_start = record_phase(options.stats, PHASE_HEADER, phase_start);
+  }
+  if (options.stats) {
+    double total_seconds = clock_seconds() - start_time;
+    if (print_statistics) {
+      print_stats(options.stats, input_files, outputs, output_count,
+          total_seconds);
+    }
+    if (stats_json) {
+      write_stats_json(stats_json, options.stats, input_files, &options,
+          outputs, output_count, total_seconds);
+    }
+    free_stats(options.stats);
+  }
+  free_input_list(&input_list);
+  if (manifest_file) {
+    write_file(manifest_file, manifest.data, manifest.length);
+    free(manifest.data);
+    free(manifest_file);
+  }
+  for (unsigned i = 0; i < options.shards; i++) {
+    free(options.shard_files[i]);
   }
+  free(options.shard_files);
+  free(outputs);
   return EXIT_SUCCESS;
 }
+
+static bool is_blank(char c)
+{
+  return c == ' ' || c == '\t' || c == '\r';
+}
+
+// Splits a line of a --sets file into arguments at whitespace. Arguments
+// can be quoted with ' or " to hold whitespace
+static void split_set_line(
+    struct string_list* args, const char* line, const char* end)
+{
+  while (line < end) {
+    if (is_blank(*line)) {
+      line++;
+      continue;
+    }
+    char* arg = malloc(end - line + 1);
+    if (!arg) {
+      fprintf(stderr, "Could not allocate memory\n");
+      exit(1);
+    }
+    size_t length = 0;
+    char quote = 0;
+    for (; line < end && (quote || !is_blank(*line)); line++) {
+      if (quote && *line == quote) {
+        quote = 0;
+      } else if (!quote && (*line == '\'' || *line == '"')) {
+        quote = *line;
+      } else {
+        arg[length++] = *line;
+      }
+    }
+    if (quote) {
+      fprintf(stderr, "Unterminated quote in --sets file\n");
+      exit(1);
+    }
+    arg[length] = '\0';
+    string_list_add(args, arg);
+  }
+}
+
+// Prefix of the symbols of the --shared-data source, after its name without
+// directories or extension
+static char* shared_data_prefix(const char* shared_file)
+{
+  const char* name = plain_name(shared_file);
+  const char* extension = strrchr(name, '.');
+  size_t length = extension ? (size_t)(extension - name) : strlen(name);
+  char stem[length + 1];
+  memcpy(stem, name, length);
+  stem[length] = '\0';
+  char* prefix = malloc(length + sizeof("EMBEDDED_"));
+  if (!prefix) {
+    fprintf(stderr, "Could not allocate memory\n");
+    exit(1);
+  }
+  strcpy(prefix, "EMBEDDED_");
+  generate_identifier_name(stem, prefix + strlen(prefix));
+  return prefix;
+}
+
+// Numbers the data stored by more than one set and writes it into the
+// source of --shared-data, with the alignment each of the sets asks for
+static void generate_shared_data(
+    struct output_buffer* out, struct input_cache* cache)
+{
+  init_hex_table();
+  init_decimal_table();
+  output_buffer_puts(out, align_macro);
+  for (size_t f = 0; f < sizeof(data_formats) / sizeof(data_formats[0]);
+       f++) {
+    bool used = false;
+    for (size_t i = 0; i < cache->count && !used; i++) {
+      for (size_t p = 0; p < cache->entries[i].shared_count; p++) {
+        const struct shared_payload* shared = &cache->entries[i].shared[p];
+        used = used
+            || (shared->set_count > 1 && shared->format == &data_formats[f]);
+      }
+    }
+    if (used) {
+      output_buffer_puts(out, data_formats[f].preamble);
+    }
+  }
+  size_t symbol_count = 0;
+  char name[strlen(cache->shared_prefix) + 32];
+  for (size_t i = 0; i < cache->count; i++) {
+    struct cached_input* entry = &cache->entries[i];
+    for (size_t p = 0; p < entry->shared_count; p++) {
+      struct shared_payload* shared = &entry->shared[p];
+      if (shared->set_count < 2) {
+        continue;
+      }
+      shared->symbol = ++symbol_count;
+      // Any payload compressed this way, compressing is deterministic
+      const unsigned char* data = entry->input.data;
+      size_t size = entry->input.size;
+      for (size_t c = 0; c < entry->payload_count; c++) {
+        const struct cached_payload* cached = &entry->payloads[c];
+        if (shared->compression != COMPRESS_NONE
+            && cached->result == shared->compression) {
+          data = cached->payload;
+          size = cached->size;
+          break;
+        }
+      }
+      const struct data_format* format = array_format(shared->format);
+      snprintf(name, sizeof(name), "%s_%zu", cache->shared_prefix,
+          shared->symbol - 1);
+      output_buffer_puts(out, "\n/* ");
+      output_buffer_puts(out, entry->path);
+      output_buffer_puts(out, " */\n");
+      // Declared first so the array is not internal when compiled as C++
+      output_array_declaration(out, format, name);
+      output_array_begin(out, format, name, shared->align, true, false);
+      output_data(out, format, data, size, 0);
+      output_buffer_puts(out, format->end(size));
+      output_buffer_puts(out, ";\n");
+    }
+  }
+}
+
+// Generates each set of a --sets file in turn after the common options,
+// counting the sets found. Parsing writes into --name=value arguments, so
+// each set gets its own copy of them.
+static int run_sets(int argc, char** argv, const struct input_data* sets,
+    struct input_cache* cache, unsigned* set_count)
+{
+  int result = EXIT_SUCCESS;
+  *set_count = 0;
+  const char* c = (const char*)sets->data;
+  const char* end = c + sets->size;
+  while (c < end && result == EXIT_SUCCESS) {
+    const char* line_end = memchr(c, '\n', end - c);
+    if (!line_end) {
+      line_end = end;
+    }
+    const char* line = c;
+    c = line_end + 1;
+    while (line < line_end && is_blank(*line)) {
+      line++;
+    }
+    if (line == line_end || *line == '#') {
+      continue;
+    }
+    struct string_list args = { 0 };
+    for (int arg = 0; arg < argc; arg++) {
+      string_list_add(&args, copy_string(argv[arg]));
+    }
+    split_set_line(&args, line, line_end);
+    result = embed_set((int)args.count, args.items, cache);
+    string_list_free(&args);
+    (*set_count)++;
+  }
+  return result;
+}
+
+// Generates the sets of a --sets file, `argv` holding the options given
+// with it. With --shared-data the sets are first laid out without writing
+// anything to find the data stored by more than one of them, which is
+// written once into `shared_file`.
+static int embed_sets(int argc, char** argv, const char* sets_file,
+    const char* shared_file)
+{
+  struct input_data sets;
+  open_input_file(sets_file, &sets);
+  struct input_cache cache;
+  init_input_cache(&cache);
+  struct output_buffer shared = { 0 };
+  int result = EXIT_SUCCESS;
+  unsigned set_count = 0;
+  if (shared_file) {
+    cache.shared_file = shared_file;
+    cache.shared_prefix = shared_data_prefix(shared_file);
+    cache.planning = true;
+    result = run_sets(argc, argv, &sets, &cache, &set_count);
+    cache.planning = false;
+    output_buffer_init(&shared, NULL);
+    generate_shared_data(&shared, &cache);
+    cache.shared_hash
+        = xxh64((const unsigned char*)shared.data, shared.length, 0);
+  }
+  if (result == EXIT_SUCCESS) {
+    result = run_sets(argc, argv, &sets, &cache, &set_count);
+  }
+  // Left alone when unchanged so it is not compiled again
+  if (result == EXIT_SUCCESS && shared_file && set_count > 0
+      && !file_matches(shared_file, shared.data, shared.length)) {
+    write_file(shared_file, shared.data, shared.length);
+  }
+  free(shared.data);
+  close_input_file(&sets);
+  free_input_cache(&cache);
+  if (result == EXIT_SUCCESS && set_count == 0) {
+    fprintf(stderr, "No sets in '%s'\n", sets_file);
+    result = EXIT_FAILURE;
+  }
+  return result;
+}
+
+int main(int argc, char** argv)
+{
+  // --sets and --shared-data are taken out of the options every set gets
+  const char* sets_file = NULL;
+  const char* shared_file = NULL;
+  char** common = malloc(sizeof(char*) * (argc + 1));
+  if (!common) {
+    fprintf(stderr, "Could not allocate memory\n");
+    return EXIT_FAILURE;
+  }
+  int common_count = 0;
+  for (int arg = 0; arg < argc; arg++) {
+    if (arg > 0 && 0 == strcmp(argv[arg], "--sets")) {
+      if (arg == argc - 1) {
+        fprintf(stderr, "--sets needs a file\n");
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+      }
+      sets_file = argv[++arg];
+    } else if (arg > 0 && 0 == strncmp(argv[arg], "--sets=", 7)) {
+      sets_file = argv[arg] + 7;
+    } else if (arg > 0 && 0 == strcmp(argv[arg], "--shared-data")) {
+      if (arg == argc - 1) {
+        fprintf(stderr, "--shared-data needs a source file\n");
+        print_help(argv[0]);
+        return EXIT_FAILURE;
+      }
+      shared_file = argv[++arg];
+    } else if (arg > 0 && 0 == strncmp(argv[arg], "--shared-data=", 14)) {
+      shared_file = argv[arg] + 14;
+    } else {
+      common[common_count++] = argv[arg];
+    }
+  }
+  common[common_count] = NULL;
+  if (shared_file && !sets_file) {
+    fprintf(stderr, "--shared-data needs --sets\n");
+    print_help(argv[0]);
+    return EXIT_FAILURE;
+  }
+  int result = sets_file
+      ? embed_sets(common_count, common, sets_file, shared_file)
+      : embed_set(argc, argv, NULL);
+  free(common);
+  return result;
+}